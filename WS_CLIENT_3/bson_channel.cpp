@@ -0,0 +1,110 @@
+#include "bson_channel.h"
+
+#include <Poco/Mutex.h>
+
+// Plain TCP carrying BSON documents back to back. A document opens with its
+// own little-endian int32 length, so it is its own frame and nothing else is
+// written around it. No handshake either: a connection whose first four
+// bytes are no HTTP method is taken as this transport by the server.
+
+static Poco::FastMutex BsonSendMutex;
+
+static int bson_channel_length(const char *Buffer){
+	const unsigned char *Bytes = (const unsigned char *)Buffer;
+
+	return (int)((unsigned int)Bytes[0] | ((unsigned int)Bytes[1] << 8) | ((unsigned int)Bytes[2] << 16) | ((unsigned int)Bytes[3] << 24));
+}
+
+// RecvTimeout bounds every bson_channel_recv, 0 leaves it blocking.
+int bson_channel_open(BSON_CHANNEL *Channel, const char *IpAddress, u_short Port, int RecvTimeout){
+	memset(Channel, 0x00, sizeof *Channel);
+
+	Channel->Socket = net_connect(IpAddress, Port, 0);
+	if(Channel->Socket == INVALID_SOCKET){
+		return -1;
+	}
+
+	net_set_timeout(Channel->Socket, REQUEST_TIMEOUT_SEND, RecvTimeout);
+	return 0;
+}
+
+int bson_channel_close(BSON_CHANNEL *Channel){
+	if(Channel->Socket != INVALID_SOCKET){
+		net_close(Channel->Socket);
+		Channel->Socket = INVALID_SOCKET;
+	}
+
+	free(Channel->Buffer);
+	Channel->Buffer = NULL;
+	Channel->Len = Channel->Size = Channel->MessageLen = 0;
+	return 0;
+}
+
+int bson_channel_send(BSON_CHANNEL *Channel, const char *Document, int Len){
+	Poco::FastMutex::ScopedLock Lock(BsonSendMutex);
+	NET_SEGMENT Segment;
+
+	if(Channel->Socket == INVALID_SOCKET || Len < 5 || bson_channel_length(Document) != Len){
+		return -1;
+	}
+
+	Segment.Base = Document;
+	Segment.Len = Len;
+	return net_send_segments_all(Channel->Socket, &Segment, 1);
+}
+
+// Reads until one whole document is in. Returns 1 with Message pointing at
+// it, valid until the next call; 0 when the receive timeout ran out first,
+// a partial document stays buffered; -1 when the connection failed, was
+// closed or sent a length no document can have.
+int bson_channel_recv(BSON_CHANNEL *Channel, char **Message, int *MessageLen){
+	char *NewBuffer;
+	int NewSize = 0;
+	int Need = 0;
+	int RecvRes = 0;
+
+	// the document handed out last time is done with now
+	if(Channel->MessageLen > 0){
+		Channel->Len -= Channel->MessageLen;
+		memmove(Channel->Buffer, Channel->Buffer + Channel->MessageLen, Channel->Len);
+		Channel->MessageLen = 0;
+	}
+
+	while(1){
+		Need = 4;
+		if(Channel->Len >= 4){
+			Need = bson_channel_length(Channel->Buffer);
+			if(Need < 5 || Need > BSON_MAX_MESSAGE){
+				return -1;
+			}
+			if(Channel->Len >= Need){
+				Channel->MessageLen = Need;
+				*Message = Channel->Buffer;
+				*MessageLen = Need;
+				return 1;
+			}
+		}
+
+		if(Channel->Size - Channel->Len < SOCKET_MAX_BUF && Channel->Size < Need + SOCKET_MAX_BUF){
+			NewSize = Channel->Size > 0 ? Channel->Size : SOCKET_MAX_BUF;
+			while(NewSize < Need + SOCKET_MAX_BUF){
+				NewSize *= 2;
+			}
+			NewBuffer = (char *)realloc(Channel->Buffer, NewSize);
+			if(NewBuffer == NULL){
+				return -1;
+			}
+			Channel->Buffer = NewBuffer;
+			Channel->Size = NewSize;
+		}
+
+		RecvRes = recv(Channel->Socket, Channel->Buffer + Channel->Len, Channel->Size - Channel->Len, 0);
+		if(RecvRes == SOCKET_ERROR){
+			return net_would_block(net_last_error()) ? 0 : -1;
+		}
+		if(RecvRes == 0){
+			return -1;
+		}
+		Channel->Len += RecvRes;
+	}
+}
\ No newline at end of file
@@ -0,0 +1,21 @@
+#ifndef __BSON_CHANNEL__
+#define __BSON_CHANNEL__
+
+#include "define.h"
+#include "net_socket.h"
+
+typedef struct{
+	SOCKET Socket;
+	char *Buffer;
+	int Len;
+	int Size;
+	int MessageLen;
+}BSON_CHANNEL;
+
+int bson_channel_open(BSON_CHANNEL *Channel, const char *IpAddress, u_short Port, int RecvTimeout);
+int bson_channel_close(BSON_CHANNEL *Channel);
+
+int bson_channel_send(BSON_CHANNEL *Channel, const char *Document, int Len);
+int bson_channel_recv(BSON_CHANNEL *Channel, char **Message, int *MessageLen);
+
+#endif // __BSON_CHANNEL__
\ No newline at end of file
@@ -1,5 +1,225 @@
 #include "bson_parser.h"
 
+using uma::bson::Value;
+using uma::bson::Element;
+using uma::bson::Document;
+using uma::bson::Array;
+
 int change_to_bson_number(char *SendBuffer){
 	return 0;
+}
+
+// Encodes Doc straight into the caller's buffer, the same bytes
+// Document::toBson would put on a stream but without the ostringstream,
+// the std::string copy and the reallocations in between. Document::getSize
+// tells us up front whether the buffer is big enough, so it is checked once
+// and never grown; only a file reference is sized as it is written. Returns
+// the encoded length, or -1 if the buffer is too small or the document holds
+// a type we do not encode.
+int bson_write_document(const Document &Doc, char *Buffer, int BufferLen){
+	BSON_WRITER Writer;
+
+	if(Doc.getSize() > BufferLen){
+		return -1;
+	}
+
+	Writer.Buffer = Buffer;
+	Writer.BufferLen = BufferLen;
+	Writer.Pos = 0;
+
+	if(bson_writer_put_document(&Writer, Doc) == -1){
+		return -1;
+	}
+	return Writer.Pos;
+}
+
+// An element standing for the whole of a file: the document carries only
+// the name, and the writer puts the file's bytes in as a string, copied
+// from the file map straight into the buffer.
+uma::bson::BinaryData bson_file_ref(const char *FileName){
+	return uma::bson::BinaryData(FileName, (int)strlen(FileName), uma::bson::BinaryData::Custom);
+}
+
+int bson_writer_put_bytes(BSON_WRITER *Writer, const char *Bytes, int Len){
+	if(Writer->Pos + Len > Writer->BufferLen){
+		return -1;
+	}
+	memcpy(Writer->Buffer + Writer->Pos, Bytes, Len);
+	Writer->Pos += Len;
+	return Len;
+}
+
+int bson_writer_put_int32(BSON_WRITER *Writer, int Value){
+	unsigned char Bytes[4];
+
+	Bytes[0] = (unsigned char)(Value & 0xff);
+	Bytes[1] = (unsigned char)((Value >> 8) & 0xff);
+	Bytes[2] = (unsigned char)((Value >> 16) & 0xff);
+	Bytes[3] = (unsigned char)((Value >> 24) & 0xff);
+
+	return bson_writer_put_bytes(Writer, (const char *)Bytes, 4);
+}
+
+int bson_writer_put_int64(BSON_WRITER *Writer, long long Value){
+	unsigned char Bytes[8];
+	int i = 0;
+
+	for(i = 0; i < 8; i ++){
+		Bytes[i] = (unsigned char)((Value >> (i * 8)) & 0xff);
+	}
+
+	return bson_writer_put_bytes(Writer, (const char *)Bytes, 8);
+}
+
+int bson_writer_put_cstring(BSON_WRITER *Writer, const std::string &Value){
+	if(bson_writer_put_bytes(Writer, Value.c_str(), (int)Value.size() + 1) == -1){
+		return -1;
+	}
+	return (int)Value.size() + 1;
+}
+
+int bson_writer_put_string(BSON_WRITER *Writer, const std::string &Value){
+	if(bson_writer_put_int32(Writer, (int)Value.size() + 1) == -1){
+		return -1;
+	}
+	return bson_writer_put_cstring(Writer, Value);
+}
+
+int bson_writer_put_file(BSON_WRITER *Writer, const std::string &FileName){
+	FILE_MAP Map;
+	int Start = Writer->Pos;
+	char Terminator = 0;
+
+	if(file_map_open(&Map, FileName.c_str()) == -1){
+		return -1;
+	}
+	if(Map.Len >= 0x7fffffff || Writer->Pos + 4 + Map.Len + 1 > Writer->BufferLen
+		|| bson_writer_put_int32(Writer, (int)Map.Len + 1) == -1 || file_map_copy(&Map, Writer->Buffer + Writer->Pos) == -1){
+		file_map_close(&Map);
+		Writer->Pos = Start;
+		return -1;
+	}
+	Writer->Pos += (int)Map.Len;
+	file_map_close(&Map);
+
+	return bson_writer_put_bytes(Writer, &Terminator, 1);
+}
+
+int bson_writer_put_element(BSON_WRITER *Writer, const Element &Element){
+	char Type = (char)Element.getType();
+	char OidBytes[12];
+	double DoubleValue = 0;
+	long long LongValue = 0;
+	char BoolValue = 0;
+
+	if(Element.getType() == Value::BinData && Element.getValue<uma::bson::BinaryData>().getDataType() == uma::bson::BinaryData::Custom){
+		const uma::bson::BinaryData::Buffer &Name = Element.getValue<uma::bson::BinaryData>().getData();
+
+		Type = (char)Value::String;
+		if(bson_writer_put_bytes(Writer, &Type, 1) == -1 || bson_writer_put_cstring(Writer, Element.getName()) == -1){
+			return -1;
+		}
+		return bson_writer_put_file(Writer, std::string(Name.begin(), Name.end()));
+	}
+
+	if(bson_writer_put_bytes(Writer, &Type, 1) == -1 || bson_writer_put_cstring(Writer, Element.getName()) == -1){
+		return -1;
+	}
+
+	switch(Element.getType()){
+	case Value::Double:
+		DoubleValue = Element.getValue<uma::bson::Double>().getValue();
+		memcpy(&LongValue, &DoubleValue, 8);
+		return bson_writer_put_int64(Writer, LongValue);
+	case Value::String:
+		return bson_writer_put_string(Writer, Element.getValue<uma::bson::String>().getValue());
+	case Value::Object:
+		return bson_writer_put_document(Writer, Element.getValue<Document>());
+	case Value::Array:
+		return bson_writer_put_array(Writer, Element.getValue<Array>());
+	case Value::BinData:
+		{
+			const uma::bson::BinaryData &Data = Element.getValue<uma::bson::BinaryData>();
+			char SubType = (char)Data.getDataType();
+
+			if(bson_writer_put_int32(Writer, (int)Data.getData().size()) == -1 || bson_writer_put_bytes(Writer, &SubType, 1) == -1){
+				return -1;
+			}
+			if(Data.getData().empty()){
+				return 0;
+			}
+			return bson_writer_put_bytes(Writer, &Data.getData()[0], (int)Data.getData().size());
+		}
+	case Value::OID:
+		Element.getValue<uma::bson::ObjectId>().getBytes(OidBytes, 12);
+		return bson_writer_put_bytes(Writer, OidBytes, 12);
+	case Value::Boolean:
+		BoolValue = Element.getValue<uma::bson::Boolean>().getValue() ? 1 : 0;
+		return bson_writer_put_bytes(Writer, &BoolValue, 1);
+	case Value::Date:
+		return bson_writer_put_int64(Writer, (long long)(Element.getValue<uma::bson::Date>().getValue().epochMicroseconds() / 1000));
+	case Value::Null:
+		return 0;
+	case Value::Integer:
+		return bson_writer_put_int32(Writer, Element.getValue<uma::bson::Integer>().getValue());
+	case Value::Long:
+		return bson_writer_put_int64(Writer, Element.getValue<uma::bson::Long>().getValue());
+	default:
+		return -1;
+	}
+}
+
+int bson_writer_put_document(BSON_WRITER *Writer, const Document &Doc){
+	Document::ConstantIterator Iter;
+	int Start = Writer->Pos;
+	char Terminator = 0;
+
+	// the length is patched in once the elements are written
+	if(bson_writer_put_int32(Writer, 0) == -1){
+		return -1;
+	}
+
+	for(Iter = Doc.begin(); Iter != Doc.end(); ++ Iter){
+		if(bson_writer_put_element(Writer, *Iter) == -1){
+			return -1;
+		}
+	}
+
+	if(bson_writer_put_bytes(Writer, &Terminator, 1) == -1){
+		return -1;
+	}
+
+	return bson_writer_patch_length(Writer, Start);
+}
+
+int bson_writer_put_array(BSON_WRITER *Writer, const Array &Arr){
+	Array::ConstantIterator Iter;
+	int Start = Writer->Pos;
+	char Terminator = 0;
+
+	if(bson_writer_put_int32(Writer, 0) == -1){
+		return -1;
+	}
+
+	for(Iter = Arr.begin(); Iter != Arr.end(); ++ Iter){
+		if(bson_writer_put_element(Writer, *Iter) == -1){
+			return -1;
+		}
+	}
+
+	if(bson_writer_put_bytes(Writer, &Terminator, 1) == -1){
+		return -1;
+	}
+
+	return bson_writer_patch_length(Writer, Start);
+}
+
+int bson_writer_patch_length(BSON_WRITER *Writer, int Start){
+	int End = Writer->Pos;
+
+	Writer->Pos = Start;
+	bson_writer_put_int32(Writer, End - Start);
+	Writer->Pos = End;
+
+	return End - Start;
 }
\ No newline at end of file
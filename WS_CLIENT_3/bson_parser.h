@@ -2,7 +2,35 @@
 #define __BSON_PARSER__
 
 #include "define.h"
+#include "file_map.h"
+
+#include <uma/bson/Boolean.h>
+#include <uma/bson/Double.h>
+#include <uma/bson/Long.h>
+#include <uma/bson/Date.h>
+#include <uma/bson/BinaryData.h>
+#include <uma/bson/ObjectId.h>
+
+typedef struct{
+	char *Buffer;
+	int BufferLen;
+	int Pos;
+}BSON_WRITER;
 
 int change_to_bson_number(char *SendBuffer);
 
+int bson_write_document(const uma::bson::Document &Doc, char *Buffer, int BufferLen);
+uma::bson::BinaryData bson_file_ref(const char *FileName);
+
+int bson_writer_put_bytes(BSON_WRITER *Writer, const char *Bytes, int Len);
+int bson_writer_put_int32(BSON_WRITER *Writer, int Value);
+int bson_writer_put_int64(BSON_WRITER *Writer, long long Value);
+int bson_writer_put_cstring(BSON_WRITER *Writer, const std::string &Value);
+int bson_writer_put_string(BSON_WRITER *Writer, const std::string &Value);
+int bson_writer_put_file(BSON_WRITER *Writer, const std::string &FileName);
+int bson_writer_put_element(BSON_WRITER *Writer, const uma::bson::Element &Element);
+int bson_writer_put_document(BSON_WRITER *Writer, const uma::bson::Document &Doc);
+int bson_writer_put_array(BSON_WRITER *Writer, const uma::bson::Array &Arr);
+int bson_writer_patch_length(BSON_WRITER *Writer, int Start);
+
 #endif // __BSON_PARSER__
\ No newline at end of file
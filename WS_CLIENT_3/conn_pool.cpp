@@ -0,0 +1,261 @@
+#include "conn_pool.h"
+
+#include <Poco/Mutex.h>
+
+static CONN_POOL_ENTRY ConnPool[CONN_POOL_MAX_ENTRIES];
+static int ConnPoolNum = 0;
+static int ConnPoolMaxSockets = CONN_POOL_MAX_SOCKETS;
+static int ConnPoolIdleTimeout = CONN_POOL_IDLE_TIMEOUT;
+static int ConnPoolLaneNum[CONN_POOL_LANE_NUM];
+static int ConnPoolIsInit = 0;
+static Poco::FastMutex ConnPoolMutex;
+
+static void conn_pool_remove(int Index){
+	ConnPoolLaneNum[ConnPool[Index].Lane] --;
+	ConnPoolNum --;
+	if(Index != ConnPoolNum){
+		ConnPool[Index] = ConnPool[ConnPoolNum];
+	}
+}
+
+static int conn_pool_find_socket(SOCKET ClientSocket){
+	int i = 0;
+
+	for(i = 0; i < ConnPoolNum; i ++){
+		if(ConnPool[i].Socket == ClientSocket){
+			return i;
+		}
+	}
+	return -1;
+}
+
+// Control sockets get CONN_POOL_CONTROL_SOCKETS of the cap to themselves and
+// bulk the rest, so a burst of uploads can neither take a login's socket
+// nor evict it, and a comm request never queues behind an upload body on the
+// same connection.
+static int conn_pool_lane_max(int Lane){
+	int Control = CONN_POOL_CONTROL_SOCKETS;
+
+	if(Control >= ConnPoolMaxSockets){
+		Control = ConnPoolMaxSockets / 2;
+	}
+	return Lane == CONN_POOL_LANE_CONTROL ? Control : ConnPoolMaxSockets - Control;
+}
+
+static int conn_pool_find_idle(const char *IpAddress, u_short Port, int Lane){
+	int i = 0;
+
+	for(i = 0; i < ConnPoolNum; i ++){
+		if(!ConnPool[i].InUse && ConnPool[i].Lane == Lane && ConnPool[i].Port == Port && strcmp(ConnPool[i].IpAddress, IpAddress) == 0){
+			return i;
+		}
+	}
+	return -1;
+}
+
+static int conn_pool_find_reserved(const char *IpAddress, u_short Port, int Lane){
+	int i = 0;
+
+	for(i = 0; i < ConnPoolNum; i ++){
+		if(ConnPool[i].InUse && ConnPool[i].Socket == INVALID_SOCKET && ConnPool[i].Lane == Lane
+			&& ConnPool[i].Port == Port && strcmp(ConnPool[i].IpAddress, IpAddress) == 0){
+			return i;
+		}
+	}
+	return -1;
+}
+
+static int conn_pool_evict_oldest(int Lane){
+	int Oldest = -1;
+	int i = 0;
+
+	for(i = 0; i < ConnPoolNum; i ++){
+		if(!ConnPool[i].InUse && ConnPool[i].Lane == Lane && (Oldest == -1 || ConnPool[i].LastUsed < ConnPool[Oldest].LastUsed)){
+			Oldest = i;
+		}
+	}
+	if(Oldest == -1){
+		return -1;
+	}
+
+	net_close(ConnPool[Oldest].Socket);
+	conn_pool_remove(Oldest);
+	return 0;
+}
+
+static int conn_pool_reap_locked(unsigned long long Now){
+	int Reaped = 0;
+	int i = 0;
+
+	for(i = ConnPoolNum - 1; i >= 0; i --){
+		if(!ConnPool[i].InUse && Now - ConnPool[i].LastUsed >= (unsigned long long)ConnPoolIdleTimeout){
+			net_close(ConnPool[i].Socket);
+			conn_pool_remove(i);
+			Reaped ++;
+		}
+	}
+	return Reaped;
+}
+
+static int conn_pool_init_locked(int MaxSockets, int IdleTimeout){
+	if(MaxSockets <= 0 || MaxSockets > CONN_POOL_MAX_ENTRIES){
+		MaxSockets = CONN_POOL_MAX_ENTRIES;
+	}
+	ConnPoolMaxSockets = MaxSockets;
+	ConnPoolIdleTimeout = IdleTimeout;
+
+	if(!ConnPoolIsInit){
+		if(net_startup() == -1){
+			return -1;
+		}
+		ConnPoolNum = 0;
+		memset(ConnPoolLaneNum, 0x00, sizeof ConnPoolLaneNum);
+		ConnPoolIsInit = 1;
+	}
+	return 0;
+}
+
+int conn_pool_init(int MaxSockets, int IdleTimeout){
+	Poco::FastMutex::ScopedLock Lock(ConnPoolMutex);
+
+	return conn_pool_init_locked(MaxSockets, IdleTimeout);
+}
+
+int conn_pool_cleanup(){
+	Poco::FastMutex::ScopedLock Lock(ConnPoolMutex);
+	int i = 0;
+
+	if(!ConnPoolIsInit){
+		return 0;
+	}
+
+	for(i = 0; i < ConnPoolNum; i ++){
+		net_close(ConnPool[i].Socket);
+	}
+	ConnPoolNum = 0;
+	memset(ConnPoolLaneNum, 0x00, sizeof ConnPoolLaneNum);
+	ConnPoolIsInit = 0;
+
+	net_cleanup();
+	return 0;
+}
+
+// Hands out a socket connected to IpAddress:Port. An idle keep-alive socket
+// for the same endpoint is preferred; a new one is only opened when none of
+// them survives the health check. With NonBlocking the new socket is returned
+// while its connect is still in progress (CONN_POOL_CONNECTING).
+int conn_pool_acquire(const char *IpAddress, u_short Port, int NonBlocking, SOCKET *ClientSocket){
+	return conn_pool_acquire_lane(IpAddress, Port, CONN_POOL_LANE_BULK, NonBlocking, ClientSocket);
+}
+
+// Same as conn_pool_acquire, but only sockets of the given traffic class are
+// reused or evicted and the class is held to its own share of the cap.
+int conn_pool_acquire_lane(const char *IpAddress, u_short Port, int Lane, int NonBlocking, SOCKET *ClientSocket){
+	SOCKET NewSocket;
+	int Index = -1;
+
+	ConnPoolMutex.lock();
+	if(!ConnPoolIsInit && conn_pool_init_locked(ConnPoolMaxSockets, ConnPoolIdleTimeout) == -1){
+		ConnPoolMutex.unlock();
+		return -1;
+	}
+	conn_pool_reap_locked(net_tick_ms());
+
+	if(Lane < 0 || Lane >= CONN_POOL_LANE_NUM){
+		ConnPoolMutex.unlock();
+		return -1;
+	}
+
+	while((Index = conn_pool_find_idle(IpAddress, Port, Lane)) != -1){
+		if(net_is_alive(ConnPool[Index].Socket)){
+			ConnPool[Index].InUse = 1;
+			*ClientSocket = ConnPool[Index].Socket;
+			if(NonBlocking){
+				net_set_nonblocking(*ClientSocket, 1);
+			}
+			ConnPoolMutex.unlock();
+			return CONN_POOL_REUSED;
+		}
+		net_close(ConnPool[Index].Socket);
+		conn_pool_remove(Index);
+	}
+
+	if(ConnPoolLaneNum[Lane] >= conn_pool_lane_max(Lane) && conn_pool_evict_oldest(Lane) == -1){
+		ConnPoolMutex.unlock();
+		return -1;
+	}
+
+	// reserve the slot before connecting so the cap holds while unlocked
+	Index = ConnPoolNum ++;
+	memset(&ConnPool[Index], 0x00, sizeof ConnPool[Index]);
+	strncpy(ConnPool[Index].IpAddress, IpAddress, MARK_MAX_BUF - 1);
+	ConnPool[Index].Port = Port;
+	ConnPool[Index].Lane = Lane;
+	ConnPool[Index].Socket = INVALID_SOCKET;
+	ConnPool[Index].InUse = 1;
+	ConnPoolLaneNum[Lane] ++;
+	ConnPoolMutex.unlock();
+
+	NewSocket = net_connect(IpAddress, Port, NonBlocking);
+
+	ConnPoolMutex.lock();
+	Index = conn_pool_find_reserved(IpAddress, Port, Lane);
+	// conn_pool_cleanup may have emptied the pool while we were connecting
+	if(Index == -1){
+		ConnPoolMutex.unlock();
+		if(NewSocket != INVALID_SOCKET){
+			net_close(NewSocket);
+		}
+		return -1;
+	}
+	if(NewSocket == INVALID_SOCKET){
+		conn_pool_remove(Index);
+		ConnPoolMutex.unlock();
+		return -1;
+	}
+	ConnPool[Index].Socket = NewSocket;
+	ConnPoolMutex.unlock();
+
+	*ClientSocket = NewSocket;
+	return NonBlocking ? CONN_POOL_CONNECTING : CONN_POOL_CONNECTED;
+}
+
+// Returns a socket to the pool. KeepAlive is zero when the response told us
+// the server will close the connection or the exchange failed half way, in
+// which case the socket is closed instead of being parked.
+int conn_pool_release(const char *IpAddress, u_short Port, SOCKET ClientSocket, int KeepAlive){
+	Poco::FastMutex::ScopedLock Lock(ConnPoolMutex);
+	int Index = -1;
+
+	Index = conn_pool_find_socket(ClientSocket);
+	if(Index == -1){
+		if(!KeepAlive || ConnPoolLaneNum[CONN_POOL_LANE_BULK] >= conn_pool_lane_max(CONN_POOL_LANE_BULK)){
+			net_close(ClientSocket);
+			return 0;
+		}
+		Index = ConnPoolNum ++;
+		memset(&ConnPool[Index], 0x00, sizeof ConnPool[Index]);
+		strncpy(ConnPool[Index].IpAddress, IpAddress, MARK_MAX_BUF - 1);
+		ConnPool[Index].Port = Port;
+		ConnPool[Index].Lane = CONN_POOL_LANE_BULK;
+		ConnPool[Index].Socket = ClientSocket;
+		ConnPoolLaneNum[CONN_POOL_LANE_BULK] ++;
+	}
+
+	if(!KeepAlive){
+		net_close(ClientSocket);
+		conn_pool_remove(Index);
+		return 0;
+	}
+
+	net_set_nonblocking(ClientSocket, 0);
+	ConnPool[Index].InUse = 0;
+	ConnPool[Index].LastUsed = net_tick_ms();
+	return 0;
+}
+
+int conn_pool_reap(){
+	Poco::FastMutex::ScopedLock Lock(ConnPoolMutex);
+
+	return conn_pool_reap_locked(net_tick_ms());
+}
\ No newline at end of file
@@ -0,0 +1,34 @@
+#ifndef __CONN_POOL__
+#define __CONN_POOL__
+
+#include "define.h"
+#include "net_socket.h"
+
+#define CONN_POOL_REUSED 0
+#define CONN_POOL_CONNECTED 1
+#define CONN_POOL_CONNECTING 2
+
+#define CONN_POOL_LANE_CONTROL 0
+#define CONN_POOL_LANE_BULK 1
+#define CONN_POOL_LANE_NUM 2
+
+#define CONN_POOL_MAX_ENTRIES 256
+
+typedef struct{
+	char IpAddress[MARK_MAX_BUF];
+	u_short Port;
+	int Lane;
+	SOCKET Socket;
+	int InUse;
+	unsigned long long LastUsed;
+}CONN_POOL_ENTRY;
+
+int conn_pool_init(int MaxSockets, int IdleTimeout);
+int conn_pool_cleanup();
+
+int conn_pool_acquire(const char *IpAddress, u_short Port, int NonBlocking, SOCKET *ClientSocket);
+int conn_pool_acquire_lane(const char *IpAddress, u_short Port, int Lane, int NonBlocking, SOCKET *ClientSocket);
+int conn_pool_release(const char *IpAddress, u_short Port, SOCKET ClientSocket, int KeepAlive);
+int conn_pool_reap();
+
+#endif // __CONN_POOL__
\ No newline at end of file
@@ -2,14 +2,38 @@
 #define __DEFINE__
 
 #include <stdio.h>
-#include <Windows.h>
 #include <string.h>
 #include <stdlib.h>
 #include <time.h>
-#include <io.h>
+#include <ctype.h>
+#include <errno.h>
 #include <sys/stat.h>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <Windows.h>
+#include <io.h>
 #include <direct.h>
 
+typedef int socklen_t;
+#else
+#include <unistd.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+typedef int SOCKET;
+#define INVALID_SOCKET (-1)
+#define SOCKET_ERROR (-1)
+#define closesocket close
+#define _stricmp strcasecmp
+#endif
+
 #include <uma/bson/Object.h>
 #include <uma/bson/ODMObject.h>
 #include <uma/bson/Document.h>
@@ -22,9 +46,14 @@
 #include <fstream>
 #include <vector>
 
+#define CLIENT_DEVID "550e8400-e29b-41d4-a716-446655440000"
+
 #define POST_API_ACTION_INIT 101
 #define POST_API_ACTION_LOGIN 102
 #define POST_API_ACTION_UPLOAD 111
+#define POST_API_ACTION_UPLOAD_BEGIN 112
+#define POST_API_ACTION_UPLOAD_SEGMENT 113
+#define POST_API_ACTION_UPLOAD_PROBE 114
 #define POST_API_ACTION_COMM 121
 #define POST_API_ACTION_CONFIG 122
 #define POST_API_ACTION_DOWNLOAD 123
@@ -37,10 +66,99 @@
 #define UPLOAD_TYPE_EMAIL 105
 
 #define SOCKET_MAX_BUF 65535
+#define HTTP_HEADER_MAX_BUF 1024
 #define FILE_MAX_BUF 60000000
+#define SEND_MAX_BUF 4194304
 #define FILE_NAME_LEN 1000
-#define EML_MAX_NUM 2000
 #define MARK_MAX_BUF 200
 #define MARK_MAX_NUMBER 6
 
+#define ENDPOINT_LIST "218.193.154.30:8888"
+#define ENDPOINT_MAX 16
+#define ENDPOINT_VNODES 100
+#define ENDPOINT_EJECT_FAILURES 3
+#define ENDPOINT_PROBE_INTERVAL 1000
+#define ENDPOINT_PROBE_MAX_INTERVAL 30000
+
+#define CONN_POOL_MAX_SOCKETS 48
+#define CONN_POOL_IDLE_TIMEOUT 30000
+#define CONN_POOL_CONTROL_SOCKETS 2
+
+#define COMM_POLL_INTERVAL 5000
+#define TRAFFIC_LANE_SLICE 50
+
+#define SESSION_TRANSPORT 0
+#define SESSION_MAX_PENDING 16
+#define SESSION_PIPELINE_DEPTH 4
+#define SESSION_READ_SLICE 200
+#define WS_PATH "/api/ws"
+#define WS_MAX_MESSAGE SEND_MAX_BUF
+#define BSON_MAX_MESSAGE SEND_MAX_BUF
+
+#define UPLOAD_ENGINE_INFLIGHT 32
+
+#define REQUEST_TIMEOUT_CONNECT 5000
+#define REQUEST_TIMEOUT_SEND 30000
+#define REQUEST_TIMEOUT_FIRST_BYTE 30000
+#define REQUEST_TIMEOUT_TOTAL 300000
+#define TIMER_WHEEL_TICK 10
+
+#define UPLOAD_WINDOW_INITIAL 2
+#define UPLOAD_WINDOW_RTT_TOLERANCE 2
+#define UPLOAD_WINDOW_RTT_SLACK 10
+
+#define UPLOAD_STREAM_THRESHOLD 1048576
+#define UPLOAD_STREAM_BLOCK 262144
+
+#define NET_ZEROCOPY_THRESHOLD 65536
+#define NET_ZEROCOPY_TIMEOUT 1000
+
+#define FILE_MAP_THRESHOLD 65536
+
+#define UPLOAD_RESUME_THRESHOLD 4194304
+#define UPLOAD_RESUME_SEGMENT 1048576
+#define UPLOAD_RESUME_RECONNECTS 3
+
+#define UPLOAD_DEDUP 1
+#define UPLOAD_PROBE_COUNT 256
+
+#define UPLOAD_BATCH_MAX_COUNT 64
+#define UPLOAD_BATCH_COUNT 32
+#define UPLOAD_BATCH_BYTES 1048576
+
+#define UPLOAD_PIPELINE_DEPTH 1
+
+#define DIR_SCAN_THREADS 4
+#define DIR_SCAN_QUEUE 1024
+
+#define DIR_WATCH_SETTLE 250
+#define DIR_WATCH_IDLE 100
+#define DIR_WATCH_MAX_DIRS 4096
+#define DIR_WATCH_SCAN_INTERVAL 1
+
+#define RATE_LIMIT_BYTES 0
+#define RATE_LIMIT_BYTE_BURST 0
+#define RATE_LIMIT_REQUESTS 0
+#define RATE_LIMIT_REQUEST_BURST 0
+#define RATE_LIMIT_QUANTUM 4096
+
+#define HTTP_ENCODING_LEVEL 6
+#define HTTP_ENCODING_THRESHOLD 1024
+
+#define RETRY_MAX_ATTEMPTS 8
+#define RETRY_BASE_CONNECT 2000
+#define RETRY_BASE_TIMEOUT 5000
+#define RETRY_BASE_SERVER 10000
+#define RETRY_BASE_ERROR 30000
+#define RETRY_MAX_DELAY 300000
+#define RETRY_DRAIN_MAX_WAIT 60000
+#define RETRY_COMPACT_THRESHOLD 64
+
+#define SENT_INDEX_CAPACITY 65536
+#define SENT_INDEX_LOAD 70
+
+#define UPLOAD_JOURNAL_COMMIT_COUNT 256
+#define UPLOAD_JOURNAL_COMMIT_INTERVAL 50
+#define UPLOAD_JOURNAL_COMPACT_COUNT 4096
+
 #endif // __DEFINE__
\ No newline at end of file
@@ -0,0 +1,406 @@
+#include "dir_scan.h"
+
+#include <Poco/Mutex.h>
+#include <Poco/Condition.h>
+#include <Poco/Runnable.h>
+#include <Poco/Thread.h>
+
+#include <deque>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <dirent.h>
+#endif
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+// Directories are read by a pool of worker threads. Each worker keeps the
+// subdirectories it finds on a deque of its own and takes the newest one
+// back first, which keeps its walk depth first and its deque short; a worker
+// that runs dry steals the oldest directory of another, which is the top of
+// the biggest subtree that one has not started on yet. The files found go to
+// a bounded queue in batches, and a worker that finds it full waits, so the
+// scan runs ahead of the uploads only so far. The caller empties the whole
+// queue at once and hands the files out from there, so neither side takes
+// the lock per file. The scan is over once no directory is waiting or being
+// read.
+
+#ifdef _WIN32
+#define DIR_SCAN_SEPARATOR '\\'
+#else
+#define DIR_SCAN_SEPARATOR '/'
+#endif
+
+#define DIR_SCAN_BUFFER 65536
+#define DIR_SCAN_BATCH 64
+#define DIR_SCAN_IDLE_WAIT 10
+
+typedef struct{
+	Poco::FastMutex Mutex;
+	std::deque<std::string> Dir;
+}DIR_SCAN_DEQUE;
+
+class DirScanWorker : public Poco::Runnable{
+public:
+	void run();
+
+	int Index;
+	std::vector<std::string> Batch;
+};
+
+static DIR_SCAN_DEQUE DirScanWork[DIR_SCAN_MAX_THREADS];
+static DirScanWorker DirScanWorkers[DIR_SCAN_MAX_THREADS];
+static Poco::Thread *DirScanThread[DIR_SCAN_MAX_THREADS];
+static int DirScanThreadNum = 0;
+static char DirScanSuffix[MARK_MAX_BUF];
+static int DirScanSuffixLen = 0;
+
+static Poco::FastMutex DirScanMutex;
+static Poco::Condition DirScanNotEmpty;
+static Poco::Condition DirScanNotFull;
+static Poco::Condition DirScanWorkReady;
+static std::deque<std::string> DirScanFound;
+static std::deque<std::string> DirScanTaken;
+static int DirScanFoundMax = 0;
+static int DirScanPending = 0;
+static int DirScanStopping = 0;
+
+// Queues Dir on the deque of worker Index. It counts as pending from here on,
+// so the scan cannot look finished while it waits.
+static void dir_scan_push(int Index, const std::string &Dir){
+	DirScanMutex.lock();
+	DirScanPending ++;
+	DirScanMutex.unlock();
+
+	DirScanWork[Index].Mutex.lock();
+	DirScanWork[Index].Dir.push_back(Dir);
+	DirScanWork[Index].Mutex.unlock();
+
+	DirScanWorkReady.signal();
+}
+
+// Takes the newest directory of worker Index or, failing that, the oldest one
+// of any other worker. Returns 1 when Dir was set.
+static int dir_scan_take(int Index, std::string &Dir){
+	int Victim = 0;
+	int i = 0;
+
+	for(i = 0; i < DirScanThreadNum; i ++){
+		Victim = (Index + i) % DirScanThreadNum;
+
+		Poco::FastMutex::ScopedLock Lock(DirScanWork[Victim].Mutex);
+		if(DirScanWork[Victim].Dir.empty()){
+			continue;
+		}
+		if(Victim == Index){
+			Dir = DirScanWork[Victim].Dir.back();
+			DirScanWork[Victim].Dir.pop_back();
+		}
+		else{
+			Dir = DirScanWork[Victim].Dir.front();
+			DirScanWork[Victim].Dir.pop_front();
+		}
+		return 1;
+	}
+	return 0;
+}
+
+// Moves the files worker Index has found to the queue, waiting while the
+// queue is full. Returns -1 once the scan is being stopped.
+static int dir_scan_flush(int Index){
+	std::vector<std::string> &Batch = DirScanWorkers[Index].Batch;
+	int i = 0;
+
+	if(Batch.empty()){
+		return 0;
+	}
+
+	Poco::FastMutex::ScopedLock Lock(DirScanMutex);
+	while((int)DirScanFound.size() >= DirScanFoundMax && !DirScanStopping){
+		DirScanNotFull.wait(DirScanMutex);
+	}
+	if(DirScanStopping){
+		Batch.clear();
+		return -1;
+	}
+	for(i = 0; i < (int)Batch.size(); i ++){
+		DirScanFound.push_back(Batch[i]);
+	}
+	Batch.clear();
+	DirScanNotEmpty.signal();
+	return 0;
+}
+
+static int dir_scan_found(int Index, const std::string &Dir, const char *Name){
+	std::vector<std::string> &Batch = DirScanWorkers[Index].Batch;
+	int NameLen = (int)strlen(Name);
+
+	if(NameLen <= DirScanSuffixLen || strcmp(Name + NameLen - DirScanSuffixLen, DirScanSuffix) != 0){
+		return 0;
+	}
+	if((int)Dir.size() + 1 + NameLen >= FILE_NAME_LEN){
+		return 0;
+	}
+
+	Batch.push_back(Dir);
+	Batch.back() += DIR_SCAN_SEPARATOR;
+	Batch.back() += Name;
+
+	if((int)Batch.size() < DIR_SCAN_BATCH){
+		return 0;
+	}
+	return dir_scan_flush(Index);
+}
+
+// A subdirectory is queued unless it is hidden, or . and .. themselves.
+static void dir_scan_subdir(int Index, const std::string &Dir, const char *Name){
+	std::string Path;
+
+	if(Name[0] == '.'){
+		return;
+	}
+	Path = Dir;
+	Path += DIR_SCAN_SEPARATOR;
+	Path += Name;
+	dir_scan_push(Index, Path);
+}
+
+#ifdef __linux__
+struct dir_scan_dirent64{
+	unsigned long long d_ino;
+	long long d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[1];
+};
+
+// getdents64 fills Buffer with as many entries as fit per call, type included
+// on the file systems that keep it, so a directory of thousands of emails is
+// read in a handful of system calls and never stat'ed entry by entry.
+static int dir_scan_read(int Index, const std::string &Dir, char *Buffer){
+	struct dir_scan_dirent64 *Entry;
+	struct stat FileStat;
+	unsigned char Type = 0;
+	long Len = 0;
+	long Pos = 0;
+	int Fd = 0;
+
+	Fd = open(Dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if(Fd == -1){
+		return -1;
+	}
+
+	while((Len = syscall(SYS_getdents64, Fd, Buffer, DIR_SCAN_BUFFER)) > 0){
+		for(Pos = 0; Pos < Len; Pos += Entry->d_reclen){
+			Entry = (struct dir_scan_dirent64 *)(Buffer + Pos);
+
+			Type = Entry->d_type;
+			if(Type == DT_UNKNOWN){
+				if(fstatat(Fd, Entry->d_name, &FileStat, AT_SYMLINK_NOFOLLOW) == -1){
+					continue;
+				}
+				Type = S_ISDIR(FileStat.st_mode) ? DT_DIR : (S_ISREG(FileStat.st_mode) ? DT_REG : DT_UNKNOWN);
+			}
+
+			if(Type == DT_DIR){
+				dir_scan_subdir(Index, Dir, Entry->d_name);
+			}
+			else if(Type == DT_REG && dir_scan_found(Index, Dir, Entry->d_name) == -1){
+				close(Fd);
+				return -1;
+			}
+		}
+	}
+
+	close(Fd);
+	return Len == 0 ? 0 : -1;
+}
+#elif defined(_WIN32)
+// The basic information level skips the short 8.3 names and the large fetch
+// has each call bring back as many entries as the buffer takes.
+static int dir_scan_read(int Index, const std::string &Dir, char *Buffer){
+	WIN32_FIND_DATAA FindData;
+	HANDLE Handle;
+	std::string Pattern;
+	int Res = 0;
+
+	Pattern = Dir + "\\*";
+	Handle = FindFirstFileExA(Pattern.c_str(), FindExInfoBasic, &FindData, FindExSearchNameMatch, NULL, FIND_FIRST_EX_LARGE_FETCH);
+	if(Handle == INVALID_HANDLE_VALUE){
+		return -1;
+	}
+
+	do{
+		if(FindData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY){
+			dir_scan_subdir(Index, Dir, FindData.cFileName);
+		}
+		else if(dir_scan_found(Index, Dir, FindData.cFileName) == -1){
+			Res = -1;
+			break;
+		}
+	}while(FindNextFileA(Handle, &FindData));
+
+	FindClose(Handle);
+	return Res;
+}
+#else
+static int dir_scan_read(int Index, const std::string &Dir, char *Buffer){
+	struct dirent *Entry;
+	struct stat FileStat;
+	std::string Path;
+	DIR *Handle;
+	int Res = 0;
+
+	Handle = opendir(Dir.c_str());
+	if(Handle == NULL){
+		return -1;
+	}
+
+	while((Entry = readdir(Handle)) != NULL){
+		Path = Dir + DIR_SCAN_SEPARATOR + Entry->d_name;
+		if(lstat(Path.c_str(), &FileStat) == -1){
+			continue;
+		}
+		if(S_ISDIR(FileStat.st_mode)){
+			dir_scan_subdir(Index, Dir, Entry->d_name);
+		}
+		else if(S_ISREG(FileStat.st_mode) && dir_scan_found(Index, Dir, Entry->d_name) == -1){
+			Res = -1;
+			break;
+		}
+	}
+
+	closedir(Handle);
+	return Res;
+}
+#endif
+
+void DirScanWorker::run(){
+	std::string Dir;
+	char *Buffer;
+
+	Buffer = (char *)malloc(DIR_SCAN_BUFFER);
+	if(Buffer == NULL){
+		return;
+	}
+
+	while(1){
+		if(!dir_scan_take(Index, Dir)){
+			Poco::FastMutex::ScopedLock Lock(DirScanMutex);
+			if(DirScanPending == 0 || DirScanStopping){
+				break;
+			}
+			// a push signals, but another worker may take the signal and find
+			// nothing to steal, so do not rely on it alone
+			DirScanWorkReady.tryWait(DirScanMutex, DIR_SCAN_IDLE_WAIT);
+			continue;
+		}
+
+		// a directory that cannot be read is skipped, as _findfirst did
+		dir_scan_read(Index, Dir, Buffer);
+		dir_scan_flush(Index);
+
+		Poco::FastMutex::ScopedLock Lock(DirScanMutex);
+		DirScanPending --;
+		if(DirScanPending == 0){
+			DirScanWorkReady.broadcast();
+			DirScanNotEmpty.broadcast();
+		}
+		if(DirScanStopping){
+			break;
+		}
+	}
+
+	free(Buffer);
+}
+
+// Starts ThreadNum workers on Root. Files whose name ends in Suffix are
+// queued, at most QueueSize at a time, for dir_scan_next.
+int dir_scan_start(const char *Root, const char *Suffix, int ThreadNum, int QueueSize){
+	std::string Dir(Root);
+	int i = 0;
+
+	if(DirScanThreadNum != 0 || strlen(Suffix) >= sizeof DirScanSuffix){
+		return -1;
+	}
+	if(ThreadNum <= 0 || ThreadNum > DIR_SCAN_MAX_THREADS){
+		ThreadNum = DIR_SCAN_MAX_THREADS;
+	}
+
+	// the walk adds its own separators
+	while(Dir.size() > 1 && (Dir[Dir.size() - 1] == '\\' || Dir[Dir.size() - 1] == '/')){
+		Dir.erase(Dir.size() - 1);
+	}
+
+	strcpy(DirScanSuffix, Suffix);
+	DirScanSuffixLen = (int)strlen(Suffix);
+	DirScanFoundMax = QueueSize > 0 ? QueueSize : 1;
+	DirScanFound.clear();
+	DirScanTaken.clear();
+	DirScanPending = 0;
+	DirScanStopping = 0;
+	DirScanThreadNum = ThreadNum;
+
+	dir_scan_push(0, Dir);
+
+	for(i = 0; i < ThreadNum; i ++){
+		DirScanWorkers[i].Index = i;
+		DirScanThread[i] = new Poco::Thread();
+		DirScanThread[i]->start(DirScanWorkers[i]);
+	}
+	return 0;
+}
+
+// Takes the next file found, waiting for one while the scan goes on. Returns
+// 1 with FilePathAndFileName set, or 0 once the scan is over and every file
+// has been taken.
+int dir_scan_next(char *FilePathAndFileName){
+	if(DirScanTaken.empty()){
+		Poco::FastMutex::ScopedLock Lock(DirScanMutex);
+
+		while(DirScanFound.empty() && DirScanPending > 0 && !DirScanStopping){
+			DirScanNotEmpty.wait(DirScanMutex);
+		}
+		if(DirScanFound.empty()){
+			return 0;
+		}
+		DirScanTaken.swap(DirScanFound);
+		DirScanNotFull.broadcast();
+	}
+
+	strcpy(FilePathAndFileName, DirScanTaken.front().c_str());
+	DirScanTaken.pop_front();
+	return 1;
+}
+
+// Ends the scan, finished or not, and waits for the workers to go.
+int dir_scan_stop(){
+	int i = 0;
+
+	DirScanMutex.lock();
+	DirScanStopping = 1;
+	DirScanNotFull.broadcast();
+	DirScanNotEmpty.broadcast();
+	DirScanWorkReady.broadcast();
+	DirScanMutex.unlock();
+
+	for(i = 0; i < DirScanThreadNum; i ++){
+		DirScanThread[i]->join();
+		delete DirScanThread[i];
+		DirScanThread[i] = NULL;
+
+		DirScanWork[i].Mutex.lock();
+		DirScanWork[i].Dir.clear();
+		DirScanWork[i].Mutex.unlock();
+	}
+	DirScanThreadNum = 0;
+
+	DirScanMutex.lock();
+	DirScanFound.clear();
+	DirScanTaken.clear();
+	DirScanPending = 0;
+	DirScanMutex.unlock();
+	return 0;
+}
\ No newline at end of file
@@ -0,0 +1,12 @@
+#ifndef __DIR_SCAN__
+#define __DIR_SCAN__
+
+#include "define.h"
+
+#define DIR_SCAN_MAX_THREADS 16
+
+int dir_scan_start(const char *Root, const char *Suffix, int ThreadNum, int QueueSize);
+int dir_scan_next(char *FilePathAndFileName);
+int dir_scan_stop();
+
+#endif // __DIR_SCAN__
\ No newline at end of file
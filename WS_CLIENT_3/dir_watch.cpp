@@ -0,0 +1,275 @@
+#include "dir_watch.h"
+#include "net_socket.h"
+
+#include <Poco/Mutex.h>
+#include <Poco/Event.h>
+#include <Poco/File.h>
+#include <Poco/DirectoryIterator.h>
+#include <Poco/DirectoryWatcher.h>
+#include <Poco/Delegate.h>
+#include <Poco/Exception.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+// Poco::DirectoryWatcher watches a single directory, inotify backed on Linux,
+// so every directory of the tree gets one, and a directory created later
+// gets one as soon as it shows up. The events only mark a file as touched:
+// a burst of them for one file is a single entry holding the time of the
+// last one and the size and mtime seen then. dir_watch_next hands a file out
+// once it has been quiet for DIR_WATCH_SETTLE and still has that size and
+// mtime, so a file still being written is never taken half done.
+
+typedef struct{
+	unsigned long long LastEvent;
+	long long Size;
+	long long MTime;
+}DIR_WATCH_ENTRY;
+
+class DirWatchHandler{
+public:
+	void onItemAdded(const void *, const Poco::DirectoryWatcher::DirectoryEvent &Event);
+	void onItemChanged(const void *, const Poco::DirectoryWatcher::DirectoryEvent &Event);
+	void onItemRemoved(const void *, const Poco::DirectoryWatcher::DirectoryEvent &Event);
+};
+
+static DirWatchHandler Handler;
+static Poco::FastMutex DirWatchMutex;
+static Poco::Event DirWatchTouched;
+static std::vector<Poco::DirectoryWatcher *> DirWatchWatcher;
+static std::map<std::string, DIR_WATCH_ENTRY> DirWatchPending;
+static char DirWatchSuffix[MARK_MAX_BUF];
+static int DirWatchSuffixLen = 0;
+static int DirWatchRunning = 0;
+
+static int dir_watch_match(const std::string &Path){
+	int Len = (int)Path.size();
+
+	return Len > DirWatchSuffixLen && strcmp(Path.c_str() + Len - DirWatchSuffixLen, DirWatchSuffix) == 0;
+}
+
+static int dir_watch_hidden(const std::string &Path){
+	std::string::size_type Pos = Path.find_last_of("\\/");
+
+	return Path[Pos == std::string::npos ? 0 : Pos + 1] == '.';
+}
+
+// Marks Path as touched now, or forgets it when it is gone.
+static void dir_watch_touch(const std::string &Path){
+	struct stat FileStat;
+	DIR_WATCH_ENTRY Entry;
+
+	if(!dir_watch_match(Path)){
+		return;
+	}
+
+	Poco::FastMutex::ScopedLock Lock(DirWatchMutex);
+	if(stat(Path.c_str(), &FileStat) == -1){
+		DirWatchPending.erase(Path);
+		return;
+	}
+	Entry.LastEvent = net_tick_ms();
+	Entry.Size = FileStat.st_size;
+	Entry.MTime = FileStat.st_mtime;
+	DirWatchPending[Path] = Entry;
+	DirWatchTouched.set();
+}
+
+// Watches Dir and every directory below it. With Queue set, files already in
+// there are taken as new: they came in between the directory showing up and
+// its watcher starting.
+static void dir_watch_add(const std::string &Dir, int Queue){
+	Poco::DirectoryWatcher *Watcher;
+	std::vector<std::string> SubDir;
+	int i = 0;
+
+	{
+		Poco::FastMutex::ScopedLock Lock(DirWatchMutex);
+		if(!DirWatchRunning){
+			return;
+		}
+		if((int)DirWatchWatcher.size() >= DIR_WATCH_MAX_DIRS){
+			printf("watch: too many directories, %s is not watched\n", Dir.c_str());
+			return;
+		}
+		try{
+			Watcher = new Poco::DirectoryWatcher(Dir, Poco::DirectoryWatcher::DW_FILTER_ENABLE_ALL, DIR_WATCH_SCAN_INTERVAL);
+		}
+		catch(Poco::Exception &){
+			return;
+		}
+		Watcher->itemAdded += Poco::delegate(&Handler, &DirWatchHandler::onItemAdded);
+		Watcher->itemMovedTo += Poco::delegate(&Handler, &DirWatchHandler::onItemAdded);
+		Watcher->itemModified += Poco::delegate(&Handler, &DirWatchHandler::onItemChanged);
+		Watcher->itemRemoved += Poco::delegate(&Handler, &DirWatchHandler::onItemRemoved);
+		Watcher->itemMovedFrom += Poco::delegate(&Handler, &DirWatchHandler::onItemRemoved);
+		DirWatchWatcher.push_back(Watcher);
+	}
+
+	try{
+		Poco::DirectoryIterator It(Dir);
+		Poco::DirectoryIterator End;
+
+		for(; It != End; ++ It){
+			if(dir_watch_hidden(It->path())){
+				continue;
+			}
+			if(It->isDirectory()){
+				SubDir.push_back(It->path());
+			}
+			else if(Queue){
+				dir_watch_touch(It->path());
+			}
+		}
+	}
+	catch(Poco::Exception &){
+	}
+
+	for(i = 0; i < (int)SubDir.size(); i ++){
+		dir_watch_add(SubDir[i], Queue);
+	}
+}
+
+// These run on the watcher threads.
+void DirWatchHandler::onItemAdded(const void *, const Poco::DirectoryWatcher::DirectoryEvent &Event){
+	try{
+		if(Event.item.isDirectory()){
+			if(!dir_watch_hidden(Event.item.path())){
+				dir_watch_add(Event.item.path(), 1);
+			}
+			return;
+		}
+	}
+	catch(Poco::Exception &){
+		return;
+	}
+	dir_watch_touch(Event.item.path());
+}
+
+void DirWatchHandler::onItemChanged(const void *, const Poco::DirectoryWatcher::DirectoryEvent &Event){
+	dir_watch_touch(Event.item.path());
+}
+
+void DirWatchHandler::onItemRemoved(const void *, const Poco::DirectoryWatcher::DirectoryEvent &Event){
+	Poco::FastMutex::ScopedLock Lock(DirWatchMutex);
+	DirWatchPending.erase(Event.item.path());
+}
+
+// Starts watching the tree under Root for files whose name ends in Suffix.
+// What is there already is left to the scan.
+int dir_watch_start(const char *Root, const char *Suffix){
+	std::string Dir(Root);
+
+	if(strlen(Suffix) >= sizeof DirWatchSuffix){
+		return -1;
+	}
+	while(Dir.size() > 1 && (Dir[Dir.size() - 1] == '\\' || Dir[Dir.size() - 1] == '/')){
+		Dir.erase(Dir.size() - 1);
+	}
+
+	{
+		Poco::FastMutex::ScopedLock Lock(DirWatchMutex);
+		if(DirWatchRunning){
+			return -1;
+		}
+		strcpy(DirWatchSuffix, Suffix);
+		DirWatchSuffixLen = (int)strlen(Suffix);
+		DirWatchPending.clear();
+		DirWatchRunning = 1;
+	}
+
+	dir_watch_add(Dir, 0);
+
+	Poco::FastMutex::ScopedLock Lock(DirWatchMutex);
+	if(DirWatchWatcher.empty()){
+		DirWatchRunning = 0;
+		return -1;
+	}
+	return 0;
+}
+
+// Takes a file that has settled, waiting up to Timeout milliseconds for one.
+// Returns 1 with FilePathAndFileName set, 0 on timeout and -1 when the watch
+// is not running. A file that changed since its last event is given another
+// DIR_WATCH_SETTLE.
+int dir_watch_next(char *FilePathAndFileName, int Timeout){
+	std::map<std::string, DIR_WATCH_ENTRY>::iterator It;
+	struct stat FileStat;
+	unsigned long long Until = net_tick_ms() + Timeout;
+	unsigned long long Now = 0;
+	unsigned long long Wait = 0;
+
+	while(1){
+		Wait = DIR_WATCH_SETTLE;
+
+		{
+			Poco::FastMutex::ScopedLock Lock(DirWatchMutex);
+			if(!DirWatchRunning){
+				return -1;
+			}
+
+			// read under the lock, no event can be newer than Now then
+			Now = net_tick_ms();
+
+			It = DirWatchPending.begin();
+			while(It != DirWatchPending.end()){
+				if(Now - It->second.LastEvent < DIR_WATCH_SETTLE){
+					if(It->second.LastEvent + DIR_WATCH_SETTLE - Now < Wait){
+						Wait = It->second.LastEvent + DIR_WATCH_SETTLE - Now;
+					}
+					++ It;
+					continue;
+				}
+				if(stat(It->first.c_str(), &FileStat) == -1){
+					DirWatchPending.erase(It ++);
+					continue;
+				}
+				if(FileStat.st_size != It->second.Size || FileStat.st_mtime != It->second.MTime || It->first.size() >= FILE_NAME_LEN){
+					It->second.LastEvent = Now;
+					It->second.Size = FileStat.st_size;
+					It->second.MTime = FileStat.st_mtime;
+					if(It->first.size() >= FILE_NAME_LEN){
+						DirWatchPending.erase(It ++);
+					}
+					else{
+						++ It;
+					}
+					continue;
+				}
+
+				strcpy(FilePathAndFileName, It->first.c_str());
+				DirWatchPending.erase(It);
+				return 1;
+			}
+		}
+
+		if(Now >= Until){
+			return 0;
+		}
+		if(Now + Wait > Until){
+			Wait = Until - Now;
+		}
+		DirWatchTouched.tryWait((long)Wait);
+	}
+}
+
+// Stops every watcher. Files that had not settled yet are dropped.
+int dir_watch_stop(){
+	std::vector<Poco::DirectoryWatcher *> Watcher;
+	int i = 0;
+
+	{
+		Poco::FastMutex::ScopedLock Lock(DirWatchMutex);
+		DirWatchRunning = 0;
+		Watcher.swap(DirWatchWatcher);
+		DirWatchPending.clear();
+	}
+
+	// a watcher joins its thread on the way out, which may be in a handler
+	// waiting for the lock, so it is not held here
+	for(i = 0; i < (int)Watcher.size(); i ++){
+		delete Watcher[i];
+	}
+	return 0;
+}
\ No newline at end of file
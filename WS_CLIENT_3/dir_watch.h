@@ -0,0 +1,10 @@
+#ifndef __DIR_WATCH__
+#define __DIR_WATCH__
+
+#include "define.h"
+
+int dir_watch_start(const char *Root, const char *Suffix);
+int dir_watch_next(char *FilePathAndFileName, int Timeout);
+int dir_watch_stop();
+
+#endif // __DIR_WATCH__
\ No newline at end of file
@@ -0,0 +1,257 @@
+#include "endpoint.h"
+
+#include <Poco/Mutex.h>
+#include <Poco/Event.h>
+#include <Poco/Runnable.h>
+#include <Poco/Thread.h>
+
+// The ingest tier as a list of host:port endpoints. Uploads are placed on a
+// hash ring by devid and folder, ENDPOINT_VNODES points per endpoint, so a
+// folder keeps going to the same endpoint and adding one moves only its
+// share of folders. An endpoint that fails ENDPOINT_EJECT_FAILURES requests
+// in a row leaves the rotation; its folders fall to the next endpoint on the
+// ring while a background thread probes it with plain connects, backing off
+// up to ENDPOINT_PROBE_MAX_INTERVAL, until it answers again.
+
+class EndpointProber : public Poco::Runnable{
+public:
+	void run();
+};
+
+static ENDPOINT Endpoint[ENDPOINT_MAX];
+static int EndpointNum = 0;
+static ENDPOINT_POINT EndpointRing[ENDPOINT_MAX * ENDPOINT_VNODES];
+static int EndpointRingNum = 0;
+static Poco::FastMutex EndpointMutex;
+
+static EndpointProber Prober;
+static Poco::Thread *ProberThread = NULL;
+static Poco::Event ProberStop;
+
+// FNV-1a with a final mix, FNV alone clusters keys that differ only at the end
+static unsigned int endpoint_hash(const char *Key){
+	unsigned int Hash = 2166136261u;
+
+	while(*Key){
+		Hash ^= (unsigned char)*Key ++;
+		Hash *= 16777619u;
+	}
+	Hash ^= Hash >> 16;
+	Hash *= 0x85ebca6bu;
+	Hash ^= Hash >> 13;
+	Hash *= 0xc2b2ae35u;
+	Hash ^= Hash >> 16;
+	return Hash;
+}
+
+static int endpoint_point_cmp(const void *a, const void *b){
+	const ENDPOINT_POINT *PointA = (const ENDPOINT_POINT *)a;
+	const ENDPOINT_POINT *PointB = (const ENDPOINT_POINT *)b;
+
+	if(PointA->Hash != PointB->Hash){
+		return PointA->Hash < PointB->Hash ? -1 : 1;
+	}
+	return PointA->Index - PointB->Index;
+}
+
+// EndpointList is "ip:port,ip:port,..."
+int endpoint_init(const char *EndpointList){
+	Poco::FastMutex::ScopedLock Lock(EndpointMutex);
+	char Key[MARK_MAX_BUF * 2];
+	const char *Pos = EndpointList;
+	const char *Colon;
+	const char *End;
+	int Len = 0;
+	int i = 0;
+	int k = 0;
+
+	EndpointNum = 0;
+	EndpointRingNum = 0;
+
+	while(*Pos && EndpointNum < ENDPOINT_MAX){
+		End = strchr(Pos, ',');
+		if(End == NULL){
+			End = Pos + strlen(Pos);
+		}
+		Colon = (const char *)memchr(Pos, ':', End - Pos);
+		Len = (int)((Colon != NULL ? Colon : End) - Pos);
+		if(Colon == NULL || Len == 0 || Len >= MARK_MAX_BUF || atoi(Colon + 1) <= 0){
+			printf("bad endpoint: %.*s\n", (int)(End - Pos), Pos);
+			return -1;
+		}
+
+		memset(&Endpoint[EndpointNum], 0x00, sizeof Endpoint[EndpointNum]);
+		memcpy(Endpoint[EndpointNum].IpAddress, Pos, Len);
+		Endpoint[EndpointNum].Port = (u_short)atoi(Colon + 1);
+		Endpoint[EndpointNum].Healthy = 1;
+		Endpoint[EndpointNum].ProbeInterval = ENDPOINT_PROBE_INTERVAL;
+		EndpointNum ++;
+
+		Pos = (*End == ',') ? End + 1 : End;
+	}
+	if(EndpointNum == 0){
+		return -1;
+	}
+
+	for(i = 0; i < EndpointNum; i ++){
+		for(k = 0; k < ENDPOINT_VNODES; k ++){
+			sprintf(Key, "%s:%d#%d", Endpoint[i].IpAddress, Endpoint[i].Port, k);
+			EndpointRing[EndpointRingNum].Hash = endpoint_hash(Key);
+			EndpointRing[EndpointRingNum].Index = i;
+			EndpointRingNum ++;
+		}
+	}
+	qsort(EndpointRing, EndpointRingNum, sizeof EndpointRing[0], endpoint_point_cmp);
+
+	if(ProberThread == NULL && EndpointNum > 1){
+		ProberStop.reset();
+		ProberThread = new Poco::Thread();
+		ProberThread->start(Prober);
+	}
+	return EndpointNum;
+}
+
+int endpoint_cleanup(){
+	if(ProberThread != NULL){
+		ProberStop.set();
+		ProberThread->join();
+		delete ProberThread;
+		ProberThread = NULL;
+	}
+
+	Poco::FastMutex::ScopedLock Lock(EndpointMutex);
+	EndpointNum = 0;
+	EndpointRingNum = 0;
+	return 0;
+}
+
+// Copies out the endpoint for the folder and returns its index, for the
+// success and failure reports. Walks clockwise from the folder's point past
+// endpoints out of rotation; with none left it sticks to the first one,
+// there being nothing better to try.
+int endpoint_pick(const char *Folder, char *IpAddress, u_short *Port){
+	Poco::FastMutex::ScopedLock Lock(EndpointMutex);
+	ENDPOINT_POINT Point;
+	char Key[FILE_NAME_LEN + MARK_MAX_BUF];
+	int Low = 0;
+	int High = 0;
+	int Mid = 0;
+	int Index = -1;
+	int i = 0;
+
+	if(EndpointNum == 0){
+		return -1;
+	}
+
+	sprintf(Key, "%s/%s", CLIENT_DEVID, Folder);
+	Point.Hash = endpoint_hash(Key);
+
+	// first point at or after the key's hash, wrapping around
+	Low = 0;
+	High = EndpointRingNum;
+	while(Low < High){
+		Mid = (Low + High) / 2;
+		if(EndpointRing[Mid].Hash < Point.Hash){
+			Low = Mid + 1;
+		}
+		else{
+			High = Mid;
+		}
+	}
+
+	for(i = 0; i < EndpointRingNum; i ++){
+		Point = EndpointRing[(Low + i) % EndpointRingNum];
+		if(Index == -1){
+			Index = Point.Index;
+		}
+		if(Endpoint[Point.Index].Healthy){
+			Index = Point.Index;
+			break;
+		}
+	}
+
+	strcpy(IpAddress, Endpoint[Index].IpAddress);
+	*Port = Endpoint[Index].Port;
+	return Index;
+}
+
+void endpoint_success(int Index){
+	Poco::FastMutex::ScopedLock Lock(EndpointMutex);
+
+	if(Index < 0 || Index >= EndpointNum){
+		return;
+	}
+	Endpoint[Index].Failures = 0;
+	Endpoint[Index].Healthy = 1;
+	Endpoint[Index].ProbeInterval = ENDPOINT_PROBE_INTERVAL;
+}
+
+void endpoint_failure(int Index){
+	Poco::FastMutex::ScopedLock Lock(EndpointMutex);
+
+	if(Index < 0 || Index >= EndpointNum){
+		return;
+	}
+	Endpoint[Index].Failures ++;
+	if(Endpoint[Index].Healthy && Endpoint[Index].Failures >= ENDPOINT_EJECT_FAILURES && EndpointNum > 1){
+		Endpoint[Index].Healthy = 0;
+		Endpoint[Index].NextProbe = net_tick_ms() + Endpoint[Index].ProbeInterval;
+		printf("endpoint %s:%d out of rotation\n", Endpoint[Index].IpAddress, Endpoint[Index].Port);
+	}
+}
+
+int endpoint_healthy(){
+	Poco::FastMutex::ScopedLock Lock(EndpointMutex);
+	int Healthy = 0;
+	int i = 0;
+
+	for(i = 0; i < EndpointNum; i ++){
+		Healthy += Endpoint[i].Healthy;
+	}
+	return Healthy;
+}
+
+// One probe round: every endpoint out of rotation whose time has come gets
+// a connect; the lock is not held while connecting.
+static void endpoint_probe(){
+	ENDPOINT Probe[ENDPOINT_MAX];
+	int ProbeIndex[ENDPOINT_MAX];
+	int ProbeNum = 0;
+	unsigned long long Now = net_tick_ms();
+	SOCKET ClientSocket;
+	int i = 0;
+
+	{
+		Poco::FastMutex::ScopedLock Lock(EndpointMutex);
+
+		for(i = 0; i < EndpointNum; i ++){
+			if(!Endpoint[i].Healthy && Endpoint[i].NextProbe <= Now){
+				Probe[ProbeNum] = Endpoint[i];
+				ProbeIndex[ProbeNum] = i;
+				ProbeNum ++;
+			}
+		}
+	}
+
+	for(i = 0; i < ProbeNum; i ++){
+		ClientSocket = net_connect(Probe[i].IpAddress, Probe[i].Port, 0);
+
+		Poco::FastMutex::ScopedLock Lock(EndpointMutex);
+		if(ClientSocket != INVALID_SOCKET){
+			net_close(ClientSocket);
+			Endpoint[ProbeIndex[i]].Healthy = 1;
+			Endpoint[ProbeIndex[i]].Failures = 0;
+			Endpoint[ProbeIndex[i]].ProbeInterval = ENDPOINT_PROBE_INTERVAL;
+			printf("endpoint %s:%d back in rotation\n", Probe[i].IpAddress, Probe[i].Port);
+			continue;
+		}
+		Endpoint[ProbeIndex[i]].ProbeInterval = Endpoint[ProbeIndex[i]].ProbeInterval * 2 > ENDPOINT_PROBE_MAX_INTERVAL ? ENDPOINT_PROBE_MAX_INTERVAL : Endpoint[ProbeIndex[i]].ProbeInterval * 2;
+		Endpoint[ProbeIndex[i]].NextProbe = net_tick_ms() + Endpoint[ProbeIndex[i]].ProbeInterval;
+	}
+}
+
+void EndpointProber::run(){
+	while(!ProberStop.tryWait(ENDPOINT_PROBE_INTERVAL)){
+		endpoint_probe();
+	}
+}
\ No newline at end of file
@@ -0,0 +1,29 @@
+#ifndef __ENDPOINT__
+#define __ENDPOINT__
+
+#include "define.h"
+#include "net_socket.h"
+
+typedef struct{
+	char IpAddress[MARK_MAX_BUF];
+	u_short Port;
+	int Healthy;
+	int Failures;
+	int ProbeInterval;
+	unsigned long long NextProbe;
+}ENDPOINT;
+
+typedef struct{
+	unsigned int Hash;
+	int Index;
+}ENDPOINT_POINT;
+
+int endpoint_init(const char *EndpointList);
+int endpoint_cleanup();
+
+int endpoint_pick(const char *Folder, char *IpAddress, u_short *Port);
+void endpoint_success(int Index);
+void endpoint_failure(int Index);
+int endpoint_healthy();
+
+#endif // __ENDPOINT__
\ No newline at end of file
@@ -0,0 +1,281 @@
+#include "file_map.h"
+
+#ifndef _WIN32
+#include <Poco/Mutex.h>
+
+#include <sys/mman.h>
+#include <signal.h>
+#include <setjmp.h>
+#endif
+
+// A file's bytes as one span for the encoder to copy into the request in a
+// single pass. A file up to FILE_MAP_THRESHOLD is read into the heap in one
+// go; a bigger one is mapped read-only, sequential, and never copied until
+// file_map_copy puts it where it is sent from. The emails watched or scanned
+// here are written by others, so a mapped file can be cut short under us.
+// On Windows the mapping itself keeps that from happening. Elsewhere the
+// copy runs under a SIGBUS guard for the pages that went away, and the size
+// is taken again afterwards for a cut inside the last page, which reads as
+// zeros instead of faulting; either way the copy is refused. The file is
+// taken as binary, whatever it holds.
+
+#ifdef _WIN32
+// reads all Map->Len bytes of File into the heap, or fails
+static int file_map_read(FILE_MAP *Map, HANDLE File){
+	char *Buffer;
+	long long Done = 0;
+	DWORD ReadLen = 0;
+
+	Buffer = (char *)malloc((size_t)Map->Len);
+	if(Buffer == NULL){
+		return -1;
+	}
+	while(Done < Map->Len){
+		if(!ReadFile(File, Buffer + Done, (DWORD)(Map->Len - Done), &ReadLen, NULL) || ReadLen == 0){
+			break;
+		}
+		Done += ReadLen;
+	}
+	if(Done != Map->Len){
+		free(Buffer);
+		return -1;
+	}
+	Map->Base = Buffer;
+	return 0;
+}
+
+static int file_map_map(FILE_MAP *Map, HANDLE File){
+	Map->Mapping = CreateFileMappingA(File, NULL, PAGE_READONLY, 0, 0, NULL);
+	if(Map->Mapping == NULL){
+		return -1;
+	}
+	Map->Base = (const char *)MapViewOfFile(Map->Mapping, FILE_MAP_READ, 0, 0, (SIZE_T)Map->Len);
+	if(Map->Base == NULL){
+		CloseHandle(Map->Mapping);
+		return -1;
+	}
+	Map->Mapped = 1;
+	return 0;
+}
+
+// Makes the whole of FileName readable at Map->Base, Map->Len bytes long.
+int file_map_open(FILE_MAP *Map, const char *FileName){
+	HANDLE File;
+	BY_HANDLE_FILE_INFORMATION Info;
+	int Res = 0;
+
+	memset(Map, 0x00, sizeof *Map);
+	File = CreateFileA(FileName, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if(File == INVALID_HANDLE_VALUE){
+		return -1;
+	}
+	if(!GetFileInformationByHandle(File, &Info) || (Info.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)){
+		CloseHandle(File);
+		return -1;
+	}
+
+	Map->Len = ((long long)Info.nFileSizeHigh << 32) | Info.nFileSizeLow;
+	if(Map->Len == 0){
+		Map->Base = "";
+	}
+	else if((unsigned long long)Map->Len > (size_t)-1){
+		Res = -1;
+	}
+	else if(Map->Len <= FILE_MAP_THRESHOLD){
+		Res = file_map_read(Map, File);
+	}
+	else{
+		Res = file_map_map(Map, File);
+	}
+	CloseHandle(File);
+	return Res;
+}
+
+// Copies the whole file to Buffer, which holds Map->Len bytes. A mapped
+// view reports a read that failed underneath it, a share gone away, as an
+// exception rather than an error.
+int file_map_copy(FILE_MAP *Map, char *Buffer){
+	if(!Map->Mapped){
+		memcpy(Buffer, Map->Base, (size_t)Map->Len);
+		return 0;
+	}
+
+	__try{
+		memcpy(Buffer, Map->Base, (size_t)Map->Len);
+	}
+	__except(GetExceptionCode() == EXCEPTION_IN_PAGE_ERROR ? EXCEPTION_EXECUTE_HANDLER : EXCEPTION_CONTINUE_SEARCH){
+		return -1;
+	}
+	return 0;
+}
+#else
+// volatile: only the signal handler reads them, the compiler must not drop
+// the stores around the copy
+static __thread sigjmp_buf * volatile FileMapGuard = NULL;
+static __thread const char * volatile FileMapGuardBase = NULL;
+static __thread volatile long long FileMapGuardLen = 0;
+static struct sigaction FileMapOldAction;
+static int FileMapGuardIsInit = 0;
+static Poco::FastMutex FileMapMutex;
+
+// a fault inside the span being copied on this thread ends that copy; any
+// other goes back to whoever handled SIGBUS before and faults again there
+static void file_map_sigbus(int Signal, siginfo_t *Info, void *){
+	const char *Addr = (const char *)Info->si_addr;
+
+	if(FileMapGuard != NULL && Addr >= FileMapGuardBase && Addr < FileMapGuardBase + FileMapGuardLen){
+		siglongjmp(*FileMapGuard, 1);
+	}
+	sigaction(Signal, &FileMapOldAction, NULL);
+}
+
+static int file_map_guard_init(){
+	Poco::FastMutex::ScopedLock Lock(FileMapMutex);
+	struct sigaction Action;
+
+	if(FileMapGuardIsInit){
+		return 0;
+	}
+
+	memset(&Action, 0x00, sizeof Action);
+	Action.sa_sigaction = file_map_sigbus;
+	Action.sa_flags = SA_SIGINFO;
+	sigemptyset(&Action.sa_mask);
+	if(sigaction(SIGBUS, &Action, &FileMapOldAction) == -1){
+		return -1;
+	}
+	FileMapGuardIsInit = 1;
+	return 0;
+}
+
+// reads all Map->Len bytes of File into the heap, or fails
+static int file_map_read(FILE_MAP *Map, int File){
+	char *Buffer;
+	long long Done = 0;
+	ssize_t ReadLen = 0;
+
+	Buffer = (char *)malloc((size_t)Map->Len);
+	if(Buffer == NULL){
+		return -1;
+	}
+	while(Done < Map->Len){
+		ReadLen = pread(File, Buffer + Done, (size_t)(Map->Len - Done), (off_t)Done);
+		if(ReadLen == -1 && errno == EINTR){
+			continue;
+		}
+		if(ReadLen <= 0){
+			break;
+		}
+		Done += ReadLen;
+	}
+
+	// shorter than it was a moment ago: it is being written over
+	if(Done != Map->Len){
+		free(Buffer);
+		return -1;
+	}
+	Map->Base = Buffer;
+	return 0;
+}
+
+static int file_map_map(FILE_MAP *Map, int File){
+	void *Base;
+
+	if(file_map_guard_init() == -1){
+		return -1;
+	}
+	Base = mmap(NULL, (size_t)Map->Len, PROT_READ, MAP_SHARED, File, 0);
+	if(Base == MAP_FAILED){
+		return -1;
+	}
+#ifdef MADV_SEQUENTIAL
+	madvise(Base, (size_t)Map->Len, MADV_SEQUENTIAL);
+#endif
+	Map->Base = (const char *)Base;
+	Map->Fd = File;
+	Map->Mapped = 1;
+	return 0;
+}
+
+// Makes the whole of FileName readable at Map->Base, Map->Len bytes long.
+int file_map_open(FILE_MAP *Map, const char *FileName){
+	struct stat FileStat;
+	int File;
+	int Res = 0;
+
+	memset(Map, 0x00, sizeof *Map);
+	Map->Fd = -1;
+	File = open(FileName, O_RDONLY);
+	if(File == -1){
+		return -1;
+	}
+	if(fstat(File, &FileStat) == -1 || !S_ISREG(FileStat.st_mode) || (unsigned long long)FileStat.st_size > (size_t)-1){
+		close(File);
+		return -1;
+	}
+
+	Map->Len = (long long)FileStat.st_size;
+	if(Map->Len == 0){
+		Map->Base = "";
+	}
+	else if(Map->Len <= FILE_MAP_THRESHOLD){
+		Res = file_map_read(Map, File);
+	}
+	else{
+		Res = file_map_map(Map, File);
+	}
+	// a mapping keeps its descriptor to take the size again after the copy
+	if(!Map->Mapped){
+		close(File);
+	}
+	return Res;
+}
+
+// Copies the whole file to Buffer, which holds Map->Len bytes. Fails when
+// the file turned out shorter than it was mapped.
+int file_map_copy(FILE_MAP *Map, char *Buffer){
+	struct stat FileStat;
+	sigjmp_buf Guard;
+
+	if(!Map->Mapped){
+		memcpy(Buffer, Map->Base, (size_t)Map->Len);
+		return 0;
+	}
+
+	if(sigsetjmp(Guard, 1) != 0){
+		FileMapGuard = NULL;
+		return -1;
+	}
+	FileMapGuardBase = Map->Base;
+	FileMapGuardLen = Map->Len;
+	FileMapGuard = &Guard;
+	memcpy(Buffer, Map->Base, (size_t)Map->Len);
+	FileMapGuard = NULL;
+
+	if(fstat(Map->Fd, &FileStat) == -1 || (long long)FileStat.st_size != Map->Len){
+		return -1;
+	}
+	return 0;
+}
+#endif
+
+void file_map_close(FILE_MAP *Map){
+	if(Map->Len == 0 || Map->Base == NULL){
+		Map->Base = NULL;
+		return;
+	}
+	if(!Map->Mapped){
+		free((void *)Map->Base);
+	}
+	else{
+#ifdef _WIN32
+		UnmapViewOfFile(Map->Base);
+		CloseHandle(Map->Mapping);
+#else
+		munmap((void *)Map->Base, (size_t)Map->Len);
+		close(Map->Fd);
+#endif
+	}
+	Map->Base = NULL;
+	Map->Len = 0;
+}
\ No newline at end of file
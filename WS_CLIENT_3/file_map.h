@@ -0,0 +1,21 @@
+#ifndef __FILE_MAP__
+#define __FILE_MAP__
+
+#include "define.h"
+
+typedef struct{
+	const char *Base;
+	long long Len;
+	int Mapped;
+#ifdef _WIN32
+	HANDLE Mapping;
+#else
+	int Fd;
+#endif
+}FILE_MAP;
+
+int file_map_open(FILE_MAP *Map, const char *FileName);
+int file_map_copy(FILE_MAP *Map, char *Buffer);
+void file_map_close(FILE_MAP *Map);
+
+#endif // __FILE_MAP__
\ No newline at end of file
@@ -0,0 +1,150 @@
+#include "http_encoding.h"
+#include "http_response.h"
+
+#include <Poco/DeflatingStream.h>
+#include <Poco/MemoryStream.h>
+
+static int HttpEncoding = HTTP_ENCODING_GZIP;
+static int HttpEncodingLevel = HTTP_ENCODING_LEVEL;
+static int HttpEncodingThreshold = HTTP_ENCODING_THRESHOLD;
+static int HttpEncodingNegotiate = 1;
+// what the server said it accepts, one bit per encoding; nothing until it
+// has told us in a response
+static int HttpEncodingAccepted = 0;
+
+static const char *http_encoding_name(int Encoding){
+	switch(Encoding){
+	case HTTP_ENCODING_DEFLATE:
+		return "deflate";
+	case HTTP_ENCODING_GZIP:
+		return "gzip";
+	}
+	return NULL;
+}
+
+// Encoding is HTTP_ENCODING_IDENTITY to turn compression off. With Negotiate
+// set a body is only compressed once a response has listed the encoding in
+// its Accept-Encoding header.
+int http_encoding_config(int Encoding, int Level, int Threshold, int Negotiate){
+	if(Encoding != HTTP_ENCODING_IDENTITY && http_encoding_name(Encoding) == NULL){
+		return -1;
+	}
+	if(Level < 0 || Level > 9){
+		Level = HTTP_ENCODING_LEVEL;
+	}
+
+	HttpEncoding = Encoding;
+	HttpEncodingLevel = Level;
+	HttpEncodingThreshold = Threshold;
+	HttpEncodingNegotiate = Negotiate;
+	return 0;
+}
+
+int http_encoding_active(){
+	if(HttpEncoding == HTTP_ENCODING_IDENTITY){
+		return 0;
+	}
+	if(HttpEncodingNegotiate && !(HttpEncodingAccepted & (1 << HttpEncoding))){
+		return 0;
+	}
+	return 1;
+}
+
+// Picks up Accept-Encoding from a response. A 415 means the server refused
+// an encoded body, so nothing is compressed again until it advertises anew.
+int http_encoding_learn(const char *RecvBuffer, int HeaderLen, int StatusCode){
+	char Value[MARK_MAX_BUF];
+	char *Token;
+	char *Next;
+	char *Param;
+	int Accepted = 0;
+	int Encoding = 0;
+
+	if(StatusCode == 415){
+		HttpEncodingAccepted = 0;
+		return 0;
+	}
+
+	if(http_response_header_value(RecvBuffer, HeaderLen, "Accept-Encoding", Value, sizeof Value) == -1){
+		return HttpEncodingAccepted;
+	}
+
+	for(Token = Value; Token != NULL; Token = Next){
+		Next = strchr(Token, ',');
+		if(Next != NULL){
+			*Next ++ = 0x00;
+		}
+		while(*Token == ' ' || *Token == '\t'){
+			Token ++;
+		}
+
+		// "gzip;q=0" is a refusal, not an offer
+		Param = strchr(Token, ';');
+		if(Param != NULL){
+			*Param ++ = 0x00;
+			while(*Param == ' '){
+				Param ++;
+			}
+			if((Param[0] == 'q' || Param[0] == 'Q') && Param[1] == '=' && atof(Param + 2) <= 0){
+				continue;
+			}
+		}
+		Param = Token + strlen(Token);
+		while(Param > Token && (Param[-1] == ' ' || Param[-1] == '\t')){
+			*-- Param = 0x00;
+		}
+
+		for(Encoding = HTTP_ENCODING_DEFLATE; Encoding <= HTTP_ENCODING_GZIP; Encoding ++){
+			if(_stricmp(Token, http_encoding_name(Encoding)) == 0){
+				Accepted |= 1 << Encoding;
+			}
+		}
+		if(_stricmp(Token, "x-gzip") == 0){
+			Accepted |= 1 << HTTP_ENCODING_GZIP;
+		}
+		if(strcmp(Token, "*") == 0){
+			Accepted |= (1 << HTTP_ENCODING_DEFLATE) | (1 << HTTP_ENCODING_GZIP);
+		}
+	}
+
+	HttpEncodingAccepted = Accepted;
+	return Accepted;
+}
+
+// Deflates Body into Out. Returns the encoded length and sets ContentEncoding,
+// or -1 when the body should go out as it is: compression is off or not
+// accepted, the body is under the threshold, or it did not get any smaller.
+int http_encoding_compress(const char *Body, int BodyLen, char *Out, int OutLen, const char **ContentEncoding){
+	Poco::DeflatingStreamBuf::StreamType Type;
+	int Len = 0;
+
+	*ContentEncoding = NULL;
+
+	if(!http_encoding_active() || BodyLen < HttpEncodingThreshold || OutLen <= 0){
+		return -1;
+	}
+
+	Type = (HttpEncoding == HTTP_ENCODING_GZIP) ? Poco::DeflatingStreamBuf::STREAM_GZIP : Poco::DeflatingStreamBuf::STREAM_ZLIB;
+
+	try{
+		Poco::MemoryOutputStream MemStream(Out, OutLen);
+		Poco::DeflatingOutputStream Deflater(MemStream, Type, HttpEncodingLevel);
+
+		Deflater.write(Body, BodyLen);
+		Deflater.close();
+		if(!Deflater.good() || !MemStream.good()){
+			return -1;
+		}
+		Len = (int)MemStream.charsWritten();
+	}
+	catch(std::exception &){
+		return -1;
+	}
+
+	if(Len <= 0 || Len >= BodyLen){
+		return -1;
+	}
+
+	*ContentEncoding = http_encoding_name(HttpEncoding);
+	return Len;
+}
\ No newline at end of file
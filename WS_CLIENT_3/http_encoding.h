@@ -0,0 +1,15 @@
+#ifndef __HTTP_ENCODING__
+#define __HTTP_ENCODING__
+
+#include "define.h"
+
+#define HTTP_ENCODING_IDENTITY 0
+#define HTTP_ENCODING_DEFLATE 1
+#define HTTP_ENCODING_GZIP 2
+
+int http_encoding_config(int Encoding, int Level, int Threshold, int Negotiate);
+int http_encoding_active();
+int http_encoding_learn(const char *RecvBuffer, int HeaderLen, int StatusCode);
+int http_encoding_compress(const char *Body, int BodyLen, char *Out, int OutLen, const char **ContentEncoding);
+
+#endif // __HTTP_ENCODING__
\ No newline at end of file
@@ -21,23 +21,342 @@ using uma::bson::Array;
 using uma::bson::String;
 using uma::bson::Integer;
 
-int construct_http(const char *IpAddress, u_short Port, int PostAction, char *SendBuffer, char *UserName, char *Password, char *FilePath, char *FilePathAndFileName, int UPLOAD_TYPE){
-	char HttpHeader[SOCKET_MAX_BUF];
-	int HttpHeaderLen = 0, HttpContentLen = 0;
+// The request is kept as a header segment plus the body that was encoded
+// into SendBuffer; both are handed to the socket in one gathered send, so
+// the body is never moved once it has been encoded.
+int construct_http(const char *IpAddress, u_short Port, int PostAction, HTTP_REQUEST *Request, char *SendBuffer, int SendBufferLen, char *UserName, char *Password, char *FilePath, char *FilePathAndFileName, int UPLOAD_TYPE){
+	const char *ContentEncoding = NULL;
+	char *HttpContent = SendBuffer;
+	int HttpContentLen = 0;
+	int EncodedLen = 0;
 
 	memset(SendBuffer, 0x00, sizeof SendBuffer);
-	memset(HttpHeader, 0x00, sizeof HttpHeader);
+	memset(Request->Header, 0x00, sizeof Request->Header);
+	Request->SegmentNum = 0;
+	Request->Len = 0;
 
-	HttpContentLen = construct_http_content(PostAction, SendBuffer, UserName, Password, FilePath, FilePathAndFileName, UPLOAD_TYPE);
-	HttpHeaderLen = construct_http_header(IpAddress, Port, PostAction, HttpHeader, HttpContentLen);
+	HttpContentLen = construct_http_content(PostAction, SendBuffer, SendBufferLen, UserName, Password, FilePath, FilePathAndFileName, UPLOAD_TYPE);
+	if(HttpContentLen == -1){
+		return -1;
+	}
+
+	// the compressed body goes into the free space behind the plain one
+	EncodedLen = http_encoding_compress(SendBuffer, HttpContentLen, SendBuffer + HttpContentLen, SendBufferLen - HttpContentLen, &ContentEncoding);
+	if(EncodedLen != -1){
+		HttpContent = SendBuffer + HttpContentLen;
+		HttpContentLen = EncodedLen;
+	}
+
+	Request->HeaderLen = construct_http_header(IpAddress, Port, PostAction, Request->Header, HttpContentLen, ContentEncoding);
 
-	memmove(SendBuffer + HttpHeaderLen, SendBuffer, HttpContentLen);
-	memcpy(SendBuffer, HttpHeader, HttpHeaderLen);
+	http_request_add_segment(Request, Request->Header, Request->HeaderLen);
+	http_request_add_segment(Request, HttpContent, HttpContentLen);
 	
-	return HttpHeaderLen + HttpContentLen;
+	return Request->Len;
+}
+
+// A batch carries ItemNum emails as an array under data, each item tagged
+// with its index so the per-item acknowledgements can be matched back. An
+// item with a digest names its content; one the server already has goes as
+// that reference alone, without the content.
+int construct_http_batch(const char *IpAddress, u_short Port, HTTP_REQUEST *Request, char *SendBuffer, int SendBufferLen, HTTP_UPLOAD_ITEM *Item, int ItemNum){
+	uma::bson::Document HttpContent;
+
+	if(construct_http_content_batch(HttpContent, Item, ItemNum) == -1){
+		return -1;
+	}
+
+	return construct_http_document(IpAddress, Port, POST_API_ACTION_UPLOAD, Request, HttpContent, SendBuffer, SendBufferLen);
+}
+
+// the batch document alone
+int construct_http_content_batch(uma::bson::Document &HttpContent, HTTP_UPLOAD_ITEM *Item, int ItemNum){
+	using std::string;
+
+	uma::bson::Array BsonEmailArray;
+	int i = 0;
+
+	construct_http_content_base(HttpContent, POST_API_ACTION_UPLOAD);
+
+	for(i = 0; i < ItemNum; i ++){
+		uma::bson::Document BsonEmailData;
+
+		BsonEmailData.set("id", i);
+		BsonEmailData.set("folder", (string)Item[i].FilePath);
+		if(Item[i].Digest != NULL && Item[i].Digest[0] != 0x00){
+			BsonEmailData.set("digest", (string)Item[i].Digest);
+		}
+		if(!Item[i].Have){
+			construct_http_content_upload(BsonEmailData, Item[i].FilePathAndFileName);
+		}
+		BsonEmailArray.add(BsonEmailData);
+	}
+	HttpContent.set("data", BsonEmailArray);
+	return 0;
+}
+
+// Asks which of ItemNum contents the server stores already: data is an array
+// of {id, digest, size}, the reply lists the ids it has.
+int construct_http_probe(const char *IpAddress, u_short Port, HTTP_REQUEST *Request, char *SendBuffer, int SendBufferLen, HTTP_UPLOAD_ITEM *Item, long long *Size, int ItemNum){
+	using std::string;
+
+	uma::bson::Document HttpContent;
+	uma::bson::Array BsonProbeArray;
+	int i = 0;
+
+	construct_http_content_base(HttpContent, POST_API_ACTION_UPLOAD_PROBE);
+
+	for(i = 0; i < ItemNum; i ++){
+		uma::bson::Document BsonProbeData;
+
+		BsonProbeData.set("id", i);
+		BsonProbeData.set("digest", (string)Item[i].Digest);
+		BsonProbeData.set("size", uma::bson::Long(Size[i]));
+		BsonProbeArray.add(BsonProbeData);
+	}
+	HttpContent.set("data", BsonProbeArray);
+
+	return construct_http_document(IpAddress, Port, POST_API_ACTION_UPLOAD_PROBE, Request, HttpContent, SendBuffer, SendBufferLen);
+}
+
+// Encodes a finished document into SendBuffer, compressed behind itself when
+// the server takes an encoding, and sets up the request around it.
+int construct_http_document(const char *IpAddress, u_short Port, int PostAction, HTTP_REQUEST *Request, const uma::bson::Document &HttpContent, char *SendBuffer, int SendBufferLen){
+	const char *ContentEncoding = NULL;
+	char *Content = SendBuffer;
+	int ContentLen = 0;
+	int EncodedLen = 0;
+
+	memset(Request->Header, 0x00, sizeof Request->Header);
+	Request->SegmentNum = 0;
+	Request->Len = 0;
+
+	ContentLen = bson_write_document(HttpContent, SendBuffer, SendBufferLen);
+	if(ContentLen == -1){
+		return -1;
+	}
+
+	EncodedLen = http_encoding_compress(SendBuffer, ContentLen, SendBuffer + ContentLen, SendBufferLen - ContentLen, &ContentEncoding);
+	if(EncodedLen != -1){
+		Content = SendBuffer + ContentLen;
+		ContentLen = EncodedLen;
+	}
+
+	Request->HeaderLen = construct_http_header(IpAddress, Port, PostAction, Request->Header, ContentLen, ContentEncoding);
+
+	http_request_add_segment(Request, Request->Header, Request->HeaderLen);
+	http_request_add_segment(Request, Content, ContentLen);
+
+	return Request->Len;
+}
+
+int http_request_add_segment(HTTP_REQUEST *Request, const char *Base, int Len){
+	if(Request->SegmentNum >= NET_MAX_SEGMENT){
+		return -1;
+	}
+
+	Request->Segment[Request->SegmentNum].Base = Base;
+	Request->Segment[Request->SegmentNum].Len = Len;
+	Request->Segment[Request->SegmentNum].Fd = -1;
+	Request->Segment[Request->SegmentNum].FileOffset = 0;
+	Request->SegmentNum ++;
+	Request->Len += Len;
+
+	return Request->SegmentNum;
+}
+
+// A streamed upload sends the same document as construct_http_content, but
+// the content string is never held in memory: the document is encoded with
+// an empty content, its three length fields are patched for ContentLen, and
+// the result is cut just before the string terminator. The caller then sends
+// this prefix, the file bytes and the three closing zero bytes as chunks.
+int construct_http_stream(const char *IpAddress, u_short Port, int PostAction, HTTP_REQUEST *Request, char *SendBuffer, int SendBufferLen, char *FilePath, int ContentLen){
+	using std::string;
+
+	uma::bson::Document HttpContent;
+	uma::bson::Document BsonEmailData;
+	int BufLen = 0;
+	int DataLen = 0;
+	int DataStart = 0;
+	int Len = 0;
+
+	memset(Request->Header, 0x00, sizeof Request->Header);
+	Request->SegmentNum = 0;
+	Request->Len = 0;
+
+	if(ContentLen < 0 || ContentLen > 0x7fffffff - SendBufferLen){
+		return -1;
+	}
+
+	construct_http_content_base(HttpContent, PostAction);
+
+	BsonEmailData.set("folder", (string)FilePath);
+	BsonEmailData.set("content", (string)"");
+	HttpContent.set("data", BsonEmailData);
+
+	BufLen = bson_write_document(HttpContent, SendBuffer, SendBufferLen);
+	if(BufLen < 8){
+		return -1;
+	}
+
+	// the tail must be: int32 1, string terminator, end of data, end of document
+	memcpy(&Len, SendBuffer + BufLen - 7, 4);
+	if(Len != 1 || SendBuffer[BufLen - 3] != 0x00 || SendBuffer[BufLen - 2] != 0x00 || SendBuffer[BufLen - 1] != 0x00){
+		return -1;
+	}
+
+	DataLen = (int)BsonEmailData.getSize();
+	DataStart = BufLen - 1 - DataLen;
+	memcpy(&Len, SendBuffer + DataStart, 4);
+	if(DataStart < 4 || Len != DataLen){
+		return -1;
+	}
+
+	Len = BufLen + ContentLen;
+	memcpy(SendBuffer, &Len, 4);
+	Len = DataLen + ContentLen;
+	memcpy(SendBuffer + DataStart, &Len, 4);
+	Len = ContentLen + 1;
+	memcpy(SendBuffer + BufLen - 7, &Len, 4);
+
+	Request->HeaderLen = construct_http_header(IpAddress, Port, PostAction, Request->Header, -1, NULL);
+	http_request_add_segment(Request, Request->Header, Request->HeaderLen);
+
+	return BufLen - 3;
+}
+
+// one chunk is three segments: the hex size line, the data and the CRLF
+int http_request_add_chunk(HTTP_REQUEST *Request, char *SizeLine, const char *Base, int Len){
+	int SizeLineLen = 0;
+
+	SizeLineLen = sprintf(SizeLine, "%x\r\n", Len);
+
+	if(http_request_add_segment(Request, SizeLine, SizeLineLen) == -1){
+		return -1;
+	}
+	if(http_request_add_segment(Request, Base, Len) == -1){
+		return -1;
+	}
+	return http_request_add_segment(Request, "\r\n", 2);
+}
+
+// Len bytes of the open file Fd from Offset on, left in the page cache for
+// the socket layer to send from
+int http_request_add_file(HTTP_REQUEST *Request, int Fd, long long Offset, int Len){
+	if(http_request_add_segment(Request, NULL, Len) == -1){
+		return -1;
+	}
+	Request->Segment[Request->SegmentNum - 1].Fd = Fd;
+	Request->Segment[Request->SegmentNum - 1].FileOffset = Offset;
+	return Request->SegmentNum;
+}
+
+// Opens FilePathAndFileName and fills Request with the header and the first
+// chunk (the BSON prefix). Buffer is the only memory the stream uses; every
+// later chunk is read into it by http_stream_next once the previous one has
+// been sent. Where the socket can send from a file the content goes as a
+// single chunk straight out of the page cache instead and Buffer only holds
+// the prefix.
+int http_stream_open(HTTP_STREAM *Stream, const char *IpAddress, u_short Port, HTTP_REQUEST *Request, char *Buffer, int BufferLen, char *FilePath, char *FilePathAndFileName){
+	struct stat FileStat;
+	int PrefixLen = 0;
+
+	memset(Stream, 0x00, sizeof *Stream);
+	Stream->Buffer = Buffer;
+	Stream->BufferLen = BufferLen;
+
+	if(stat(FilePathAndFileName, &FileStat) == -1){
+		return -1;
+	}
+
+	if((long long)FileStat.st_size > 0x7fffffff){
+		return -1;
+	}
+
+	Stream->PFile = fopen(FilePathAndFileName, "rb");
+	if(Stream->PFile == NULL){
+		return -1;
+	}
+
+	PrefixLen = construct_http_stream(IpAddress, Port, POST_API_ACTION_UPLOAD, Request, Buffer, BufferLen, FilePath, (int)FileStat.st_size);
+	if(PrefixLen == -1){
+		http_stream_close(Stream);
+		return -1;
+	}
+
+	Stream->Size = (int)FileStat.st_size;
+	Stream->Remain = Stream->Size;
+#ifdef __linux__
+	Stream->Direct = 1;
+#endif
+	Stream->State = Stream->Remain > 0 ? HTTP_STREAM_BODY : HTTP_STREAM_END;
+
+	if(http_request_add_chunk(Request, Stream->SizeLine, Buffer, PrefixLen) == -1){
+		http_stream_close(Stream);
+		return -1;
+	}
+	return Request->Len;
 }
 
-int construct_http_header(const char *IpAddress, u_short Port, int PostAction, char *HttpHeader, int HttpContentLen){
+// Replaces the segments in Request with the next chunk. Returns 1 when there
+// is a chunk to send, 0 once the terminating chunk has gone out and -1 when
+// the file changed size under us, since the BSON lengths are already sent.
+int http_stream_next(HTTP_STREAM *Stream, HTTP_REQUEST *Request){
+	struct stat FileStat;
+	int ReadLen = 0;
+
+	Request->SegmentNum = 0;
+	Request->Len = 0;
+
+	switch(Stream->State){
+	case HTTP_STREAM_BODY:
+		if(Stream->Direct){
+			http_request_add_segment(Request, Stream->SizeLine, sprintf(Stream->SizeLine, "%x\r\n", Stream->Remain));
+			http_request_add_file(Request, fileno(Stream->PFile), Stream->Size - Stream->Remain, Stream->Remain);
+			http_request_add_segment(Request, "\r\n", 2);
+			Stream->Remain = 0;
+			Stream->State = HTTP_STREAM_END;
+			return 1;
+		}
+		ReadLen = Stream->Remain < Stream->BufferLen ? Stream->Remain : Stream->BufferLen;
+		ReadLen = (int)fread(Stream->Buffer, 1, ReadLen, Stream->PFile);
+		if(ReadLen <= 0){
+			return -1;
+		}
+		Stream->Remain -= ReadLen;
+		if(Stream->Remain == 0){
+			Stream->State = HTTP_STREAM_END;
+		}
+		http_request_add_chunk(Request, Stream->SizeLine, Stream->Buffer, ReadLen);
+		return 1;
+	case HTTP_STREAM_END:
+		// a file sent from the page cache was never read, so its size is
+		// what tells whether it changed
+		if(Stream->Direct){
+			if(fstat(fileno(Stream->PFile), &FileStat) == -1 || (long long)FileStat.st_size != Stream->Size){
+				return -1;
+			}
+		}
+		else if(fgetc(Stream->PFile) != EOF){
+			return -1;
+		}
+		http_request_add_chunk(Request, Stream->SizeLine, "\0\0\0", 3);
+		http_request_add_segment(Request, "0\r\n\r\n", 5);
+		Stream->State = HTTP_STREAM_DONE;
+		return 1;
+	}
+	return 0;
+}
+
+void http_stream_close(HTTP_STREAM *Stream){
+	if(Stream->PFile != NULL){
+		fclose(Stream->PFile);
+		Stream->PFile = NULL;
+	}
+	Stream->State = HTTP_STREAM_DONE;
+}
+
+int construct_http_header(const char *IpAddress, u_short Port, int PostAction, char *HttpHeader, int HttpContentLen, const char *ContentEncoding){
 	char HttpContentLenString[MARK_MAX_BUF];
 	int len = 0;
 
@@ -51,6 +370,15 @@ int construct_http_header(const char *IpAddress, u_short Port, int PostAction, c
 	case POST_API_ACTION_UPLOAD:
 		strcat(HttpHeader, "POST /api/upload");
 		break;
+	case POST_API_ACTION_UPLOAD_BEGIN:
+		strcat(HttpHeader, "POST /api/upload/begin");
+		break;
+	case POST_API_ACTION_UPLOAD_SEGMENT:
+		strcat(HttpHeader, "POST /api/upload/segment");
+		break;
+	case POST_API_ACTION_UPLOAD_PROBE:
+		strcat(HttpHeader, "POST /api/upload/probe");
+		break;
 	case POST_API_ACTION_COMM:
 		strcat(HttpHeader, "POST /api/comm");
 		break;
@@ -70,9 +398,20 @@ int construct_http_header(const char *IpAddress, u_short Port, int PostAction, c
 	strcat(HttpHeader, IpAddress);
 	strcat(HttpHeader, "\r\n");
 	strcat(HttpHeader, "Accept: */*\r\n");
-	strcat(HttpHeader, "Content-Length: ");
-	strcat(HttpHeader, HttpContentLenString);
-	strcat(HttpHeader, "\r\n");
+	strcat(HttpHeader, "Connection: keep-alive\r\n");
+	if(HttpContentLen < 0){
+		strcat(HttpHeader, "Transfer-Encoding: chunked\r\n");
+	}
+	else{
+		strcat(HttpHeader, "Content-Length: ");
+		strcat(HttpHeader, HttpContentLenString);
+		strcat(HttpHeader, "\r\n");
+	}
+	if(ContentEncoding != NULL){
+		strcat(HttpHeader, "Content-Encoding: ");
+		strcat(HttpHeader, ContentEncoding);
+		strcat(HttpHeader, "\r\n");
+	}
 
 	strcat(HttpHeader, "\r\n");
 
@@ -80,37 +419,13 @@ int construct_http_header(const char *IpAddress, u_short Port, int PostAction, c
 	return len;
 }
 
-int construct_http_content(int PostAction, char *SendBuffer, char *UserName, char *Password, char *FilePath, char *FilePathAndFileName, int UPLOAD_TYPE){
-	char DEVID[MARK_MAX_BUF], SIG[MARK_MAX_BUF];
-	//char VER_STRING[MARK_MAX_BUF], SOURCE_STRING[MARK_MAX_BUF], NONCE_STRING[MARK_MAX_BUF], ACTION_STRING[MARK_MAX_BUF];
-	int VER, SOURCE, NONCE, ACTION;
-	char SECRETKEY[MARK_MAX_BUF];
-
-	memset(DEVID, 0x00, sizeof DEVID);
-	memset(SIG, 0x00, sizeof SIG);
-	memset(SECRETKEY, 0x00, sizeof SECRETKEY);
-
-	sprintf(DEVID, "%s", "550e8400-e29b-41d4-a716-446655440000");
-	VER = 6;
-	SOURCE = 21;
-	ACTION = PostAction;
-	NONCE = get_nonce();
-	sprintf(SECRETKEY, "%s", "8YRIJ41NK9PLOT6");
-
-	get_sig(SIG, DEVID, VER, SOURCE, ACTION, NONCE, SECRETKEY);
-
+int construct_http_content(int PostAction, char *SendBuffer, int SendBufferLen, char *UserName, char *Password, char *FilePath, char *FilePathAndFileName, int UPLOAD_TYPE){
 	using std::string;
-	using std::ostringstream;
 	
 	uma::bson::Document HttpContent;
 	uma::bson::Document BsonEmailData;
 
-	HttpContent.set("devid", (string)DEVID);
-	HttpContent.set("ver", VER);
-	HttpContent.set("source", SOURCE);
-	HttpContent.set("action", ACTION);
-	HttpContent.set("nonce", NONCE);
-	HttpContent.set("sig", (string)SIG);
+	construct_http_content_base(HttpContent, PostAction);
 
 	switch(PostAction){
 	case POST_API_ACTION_INIT:
@@ -118,10 +433,9 @@ int construct_http_content(int PostAction, char *SendBuffer, char *UserName, cha
 		HttpContent.set("password", (string)Password);
 		break;
 	case POST_API_ACTION_UPLOAD:
-		construct_http_content_upload(SendBuffer, FilePathAndFileName);
+		construct_http_content_upload(BsonEmailData, FilePathAndFileName);
 
 		BsonEmailData.set("folder", (string)FilePath);
-		BsonEmailData.set("content", (string)SendBuffer);
 		HttpContent.set("data", BsonEmailData);
 		
 		break;
@@ -141,35 +455,48 @@ int construct_http_content(int PostAction, char *SendBuffer, char *UserName, cha
 	ostringstream StreamBuf;
 	test.toBson(StreamBuf);
 	*/
-	ostringstream StreamBuf;
-	HttpContent.toBson(StreamBuf);
-	string StringBuf;
-	StringBuf = StreamBuf.str();
 	int BufLen;
-	BufLen = StringBuf.size();
-
-	memset(SendBuffer, 0x00, sizeof SendBuffer);
-	memcpy(SendBuffer, StringBuf.c_str(), BufLen);
+	BufLen = bson_write_document(HttpContent, SendBuffer, SendBufferLen);
 
 	return BufLen;
 }
 
-int construct_http_content_upload(char *SendBuffer, char *FilePathAndFileName){
-	FILE *PFile = NULL;
-	char InBuffer[SOCKET_MAX_BUF];
+// devid, ver, source, action, nonce and sig open every request body
+void construct_http_content_base(uma::bson::Document &HttpContent, int PostAction){
+	char DEVID[MARK_MAX_BUF], SIG[MARK_MAX_BUF];
+	//char VER_STRING[MARK_MAX_BUF], SOURCE_STRING[MARK_MAX_BUF], NONCE_STRING[MARK_MAX_BUF], ACTION_STRING[MARK_MAX_BUF];
+	int VER, SOURCE, NONCE, ACTION;
+	char SECRETKEY[MARK_MAX_BUF];
 
-	memset(InBuffer, 0x00, sizeof InBuffer);
-	
-	PFile = fopen(FilePathAndFileName, "r");
-	if(PFile == NULL){
-		return -1;
-	}
-	else{
-		while(fgets(InBuffer, SOCKET_MAX_BUF, PFile)){
-			strcat(SendBuffer, InBuffer);
-			return 0;
-		}
-	}
+	memset(DEVID, 0x00, sizeof DEVID);
+	memset(SIG, 0x00, sizeof SIG);
+	memset(SECRETKEY, 0x00, sizeof SECRETKEY);
+
+	sprintf(DEVID, "%s", CLIENT_DEVID);
+	VER = 6;
+	SOURCE = 21;
+	ACTION = PostAction;
+	NONCE = get_nonce();
+	sprintf(SECRETKEY, "%s", "8YRIJ41NK9PLOT6");
+
+	get_sig(SIG, DEVID, VER, SOURCE, ACTION, NONCE, SECRETKEY);
+
+	using std::string;
+
+	HttpContent.set("devid", (string)DEVID);
+	HttpContent.set("ver", VER);
+	HttpContent.set("source", SOURCE);
+	HttpContent.set("action", ACTION);
+	HttpContent.set("nonce", NONCE);
+	HttpContent.set("sig", (string)SIG);
+}
+
+// The email goes in as content whole and byte for byte. The document only
+// names the file; its bytes are copied once, from the mapped file into the
+// send buffer, when the document is encoded, and a file that cannot be read
+// then fails the encoding.
+void construct_http_content_upload(uma::bson::Document &BsonEmailData, char *FilePathAndFileName){
+	BsonEmailData.set("content", bson_file_ref(FilePathAndFileName));
 }
 
 int get_nonce(){
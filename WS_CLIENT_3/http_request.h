@@ -4,11 +4,55 @@
 #include "define.h"
 #include "bson_parser.h"
 #include "md5.h"
+#include "net_socket.h"
+#include "http_encoding.h"
 
-int construct_http(const char *IpAddress, u_short Port, int PostAction, char *SendBuffer, char *UserName, char *Password, char *FilePath, char *FilePathAndFileName, int UPLOAD_TYPE);
-int construct_http_header(const char *IpAddress, u_short Port, int PostAction, char *HttpHeader, int HttpContentLen);
-int construct_http_content(int PostAction, char *SendBuffer, char *UserName, char *Password, char *FilePath, char *FilePathAndFileName, int UPLOAD_TYPE);
-int construct_http_content_upload(char *SendBuffer, char *FilePathAndFileName);
+typedef struct{
+	char Header[HTTP_HEADER_MAX_BUF];
+	int HeaderLen;
+	NET_SEGMENT Segment[NET_MAX_SEGMENT];
+	int SegmentNum;
+	int Len;
+}HTTP_REQUEST;
+
+typedef struct{
+	char *FilePath;
+	char *FilePathAndFileName;
+	const char *Digest;
+	int Have;
+}HTTP_UPLOAD_ITEM;
+
+#define HTTP_STREAM_BODY 0
+#define HTTP_STREAM_END 1
+#define HTTP_STREAM_DONE 2
+
+typedef struct{
+	FILE *PFile;
+	int Size;
+	int Remain;
+	int Direct;
+	int State;
+	char *Buffer;
+	int BufferLen;
+	char SizeLine[MARK_MAX_BUF];
+}HTTP_STREAM;
+
+int construct_http(const char *IpAddress, u_short Port, int PostAction, HTTP_REQUEST *Request, char *SendBuffer, int SendBufferLen, char *UserName, char *Password, char *FilePath, char *FilePathAndFileName, int UPLOAD_TYPE);
+int construct_http_batch(const char *IpAddress, u_short Port, HTTP_REQUEST *Request, char *SendBuffer, int SendBufferLen, HTTP_UPLOAD_ITEM *Item, int ItemNum);
+int construct_http_probe(const char *IpAddress, u_short Port, HTTP_REQUEST *Request, char *SendBuffer, int SendBufferLen, HTTP_UPLOAD_ITEM *Item, long long *Size, int ItemNum);
+int construct_http_document(const char *IpAddress, u_short Port, int PostAction, HTTP_REQUEST *Request, const uma::bson::Document &HttpContent, char *SendBuffer, int SendBufferLen);
+int http_request_add_segment(HTTP_REQUEST *Request, const char *Base, int Len);
+int construct_http_stream(const char *IpAddress, u_short Port, int PostAction, HTTP_REQUEST *Request, char *SendBuffer, int SendBufferLen, char *FilePath, int ContentLen);
+int http_request_add_chunk(HTTP_REQUEST *Request, char *SizeLine, const char *Base, int Len);
+int http_request_add_file(HTTP_REQUEST *Request, int Fd, long long Offset, int Len);
+int http_stream_open(HTTP_STREAM *Stream, const char *IpAddress, u_short Port, HTTP_REQUEST *Request, char *Buffer, int BufferLen, char *FilePath, char *FilePathAndFileName);
+int http_stream_next(HTTP_STREAM *Stream, HTTP_REQUEST *Request);
+void http_stream_close(HTTP_STREAM *Stream);
+int construct_http_header(const char *IpAddress, u_short Port, int PostAction, char *HttpHeader, int HttpContentLen, const char *ContentEncoding);
+int construct_http_content(int PostAction, char *SendBuffer, int SendBufferLen, char *UserName, char *Password, char *FilePath, char *FilePathAndFileName, int UPLOAD_TYPE);
+void construct_http_content_base(uma::bson::Document &HttpContent, int PostAction);
+int construct_http_content_batch(uma::bson::Document &HttpContent, HTTP_UPLOAD_ITEM *Item, int ItemNum);
+void construct_http_content_upload(uma::bson::Document &BsonEmailData, char *FilePathAndFileName);
 //int construct_http_content_header(int PostAction, char *HttpContentHeader);
 
 int get_nonce();
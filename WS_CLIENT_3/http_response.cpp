@@ -32,47 +32,631 @@ int ParseRecvBuffer(char *RecvBuffer, int PostAction){
 }
 */
 
+// Runs a complete response held in RecvBuffer through the parser and hands
+// the body to ParseRecvBody. Kept for callers that still have a flat buffer.
 int ParseRecvBuffer(char *RecvBuffer, int RecvLen, int PostAction){
-	char TempString[FILE_NAME_LEN];
-	int BufferLen;
-	int ContentStartPos = -1;
+	HTTP_PARSER Parser;
+	int ParseRes = 0;
 
-	int i = 0;
-	
-	BufferLen = RecvLen;
-	for(i = 0; i < BufferLen; i ++){
-		if(i + 8 < BufferLen){
-			memset(TempString, 0x00, sizeof TempString);
-			memcpy(TempString, RecvBuffer + i, 8);
-			if(strcmp(TempString, "\r\n\r\n:") == 0){
-				ContentStartPos = i + 9;
-				break;
-			}
-		}
+	http_parser_init(&Parser);
+	ParseRes = http_parser_feed(&Parser, RecvBuffer, RecvLen);
+	if(ParseRes == 0){
+		ParseRes = http_parser_finish(&Parser, RecvLen);
+	}
+	if(ParseRes != 1){
+		return -1;
 	}
 
-	if(ContentStartPos == -1){
+	return ParseRecvBody(RecvBuffer + Parser.BodyStart, Parser.BodyLen, PostAction);
+}
+
+int ParseRecvBody(const char *Body, int BodyLen, int PostAction){
+	// the debug endpoint puts ':' and four more bytes in front of the document
+	if(BodyLen > 5 && Body[0] == ':'){
+		Body += 5;
+		BodyLen -= 5;
+	}
+
+	if(BodyLen < 5){
 		return -1;
 	}
-	else{
+
+	try{
 		using std::string;
 
 		if(PostAction == POST_API_ACTION_LOGIN){
-			Document HttpContent = Document::fromBytes(RecvBuffer + ContentStartPos, BufferLen - ContentStartPos);
+			Document HttpContent = Document::fromBytes(Body, BodyLen);
 			char UID[20];
 			HttpContent.get("uid").getValue<ObjectId>().getBytes(UID, 12);
 		}
 
-		Document HttpContent = Document::fromBytes(RecvBuffer + ContentStartPos, BufferLen - ContentStartPos);
+		Document HttpContent = Document::fromBytes(Body, BodyLen);
 		int error;
 		error = HttpContent.get("error").getValue<Integer>().getValue();
 		printf("%d\n", error);
+	}
+	catch(std::exception &){
+		return -1;
+	}
+
+	return 0;
+}
+
+// The seq field of a message, or -1 when it has none or is not a document.
+int ParseRecvSeq(const char *Body, int BodyLen){
+	int Seq = -1;
+
+	if(BodyLen < 5){
+		return -1;
+	}
+
+	try{
+		Document HttpContent = Document::fromBytes(Body, BodyLen);
+		if(HttpContent.hasElement("seq")){
+			Seq = HttpContent.get("seq").getValue<Integer>().getValue();
+		}
+	}
+	catch(std::exception &){
+		return -1;
+	}
+
+	return Seq;
+}
+
+// The error field of a reply, or -1 when the reply is not a readable document.
+int ParseRecvError(const char *Body, int BodyLen){
+	int error = -1;
+
+	if(BodyLen > 5 && Body[0] == ':'){
+		Body += 5;
+		BodyLen -= 5;
+	}
+
+	if(BodyLen < 5){
+		return -1;
+	}
+
+	try{
+		Document HttpContent = Document::fromBytes(Body, BodyLen);
+		error = HttpContent.get("error").getValue<Integer>().getValue();
+	}
+	catch(std::exception &){
+		return -1;
+	}
+
+	return error;
+}
+
+// Fills Result[i] with 0 for every batch item the server acknowledged and -1
+// for the rest. The reply carries data:[{id, error}, ...] with the ids the
+// items were sent with. Returns the number acknowledged, or -1 when the
+// reply could not be read at all.
+int ParseRecvBatch(const char *Body, int BodyLen, int *Result, int ResultNum){
+	int AckNum = 0;
+	int Id = 0;
+	int i = 0;
+
+	for(i = 0; i < ResultNum; i ++){
+		Result[i] = -1;
+	}
+
+	if(BodyLen > 5 && Body[0] == ':'){
+		Body += 5;
+		BodyLen -= 5;
+	}
+
+	if(BodyLen < 5){
+		return -1;
+	}
 
-		return 0;
+	try{
+		Document HttpContent = Document::fromBytes(Body, BodyLen);
+		int error;
+		error = HttpContent.get("error").getValue<Integer>().getValue();
+		if(error != 0 || !HttpContent.hasElement("data")){
+			return 0;
+		}
+
+		const Array &Ack = HttpContent.get("data").getValue<Array>();
+		for(Array::ConstantIterator it = Ack.begin(); it != Ack.end(); ++ it){
+			const Document &Item = it->getValue<Document>();
+
+			Id = Item.get("id").getValue<Integer>().getValue();
+			if(Id < 0 || Id >= ResultNum || Result[Id] == 0){
+				continue;
+			}
+			if(Item.get("error").getValue<Integer>().getValue() == 0){
+				Result[Id] = 0;
+				AckNum ++;
+			}
+		}
+	}
+	catch(std::exception &){
+		return -1;
+	}
+
+	return AckNum;
+}
+
+// Sets Have[id] to 1 for every probed content the server says it stores and
+// 0 for the rest. Returns how many it has, or -1 when the reply is an error
+// or unreadable, as from a server that does not know the probe.
+int ParseRecvHave(const char *Body, int BodyLen, int *Have, int HaveNum){
+	int HaveCount = 0;
+	int Id = 0;
+	int i = 0;
+
+	for(i = 0; i < HaveNum; i ++){
+		Have[i] = 0;
+	}
+
+	if(BodyLen > 5 && Body[0] == ':'){
+		Body += 5;
+		BodyLen -= 5;
+	}
+
+	if(BodyLen < 5){
+		return -1;
+	}
+
+	try{
+		Document HttpContent = Document::fromBytes(Body, BodyLen);
+		if(HttpContent.get("error").getValue<Integer>().getValue() != 0){
+			return -1;
+		}
+		if(!HttpContent.hasElement("have")){
+			return 0;
+		}
+
+		const Array &HaveArray = HttpContent.get("have").getValue<Array>();
+		for(Array::ConstantIterator it = HaveArray.begin(); it != HaveArray.end(); ++ it){
+			Id = it->getValue<Integer>().getValue();
+			if(Id < 0 || Id >= HaveNum || Have[Id] == 1){
+				continue;
+			}
+			Have[Id] = 1;
+			HaveCount ++;
+		}
+	}
+	catch(std::exception &){
+		return -1;
 	}
+
+	return HaveCount;
+}
+
+// The error field of a resumable upload reply, with the offset the server
+// has committed for the upload in Offset; -1 when the reply is unreadable.
+int ParseRecvOffset(const char *Body, int BodyLen, long long *Offset){
+	int error = -1;
+
+	if(BodyLen > 5 && Body[0] == ':'){
+		Body += 5;
+		BodyLen -= 5;
+	}
+
+	if(BodyLen < 5){
+		return -1;
+	}
+
+	try{
+		Document HttpContent = Document::fromBytes(Body, BodyLen);
+		error = HttpContent.get("error").getValue<Integer>().getValue();
+		if(error != 0){
+			return error;
+		}
+
+		// small offsets may come back as int32
+		const uma::bson::Element &OffsetElement = HttpContent.get("offset");
+		if(OffsetElement.getType() == uma::bson::Value::Long){
+			*Offset = OffsetElement.getValue<uma::bson::Long>().getValue();
+		}
+		else{
+			*Offset = OffsetElement.getValue<Integer>().getValue();
+		}
+	}
+	catch(std::exception &){
+		return -1;
+	}
+
+	return error;
 }
 /**/
 
+void http_parser_init(HTTP_PARSER *Parser){
+	memset(Parser, 0x00, sizeof *Parser);
+	Parser->State = HTTP_PARSE_HEADER;
+	Parser->HeaderLen = -1;
+	Parser->ContentLength = -1;
+}
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define HTTP_PARSER_SSE2
+#include <emmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+static int http_parser_lowest_bit(int Mask){
+#ifdef _MSC_VER
+	unsigned long Index;
+	_BitScanForward(&Index, (unsigned long)Mask);
+	return (int)Index;
+#else
+	return __builtin_ctz((unsigned int)Mask);
+#endif
+}
+#endif
+
+// Looks for the blank line that ends the header, starting at Start. With SSE2
+// sixteen bytes are compared against '\n' at a time and only the hits are
+// checked for the surrounding "\r\n\r\n". Returns the header length or -1.
+int http_parser_find_header_end(const char *Buffer, int Start, int Len){
+	int Pos = 0;
+	int i = Start;
+
+#ifdef HTTP_PARSER_SSE2
+	const __m128i NewLine = _mm_set1_epi8('\n');
+	int Mask = 0;
+
+	for(; i + 16 <= Len; i += 16){
+		Mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(Buffer + i)), NewLine));
+		while(Mask != 0){
+			Pos = i + http_parser_lowest_bit(Mask);
+			if(Pos >= 3 && Buffer[Pos - 1] == '\r' && Buffer[Pos - 2] == '\n' && Buffer[Pos - 3] == '\r'){
+				return Pos + 1;
+			}
+			Mask &= Mask - 1;
+		}
+	}
+#endif
+
+	for(; i < Len; i ++){
+		if(Buffer[i] == '\n' && i >= 3 && Buffer[i - 1] == '\r' && Buffer[i - 2] == '\n' && Buffer[i - 3] == '\r'){
+			return i + 1;
+		}
+	}
+	return -1;
+}
+
+static int http_parser_header(HTTP_PARSER *Parser, const char *Buffer){
+	char HeaderValue[MARK_MAX_BUF];
+	int Http11 = 0;
+	int i = 0;
+
+	if(Parser->HeaderLen < 12 || strncmp(Buffer, "HTTP/1.", 7) != 0){
+		return -1;
+	}
+	Http11 = (Buffer[7] == '1');
+	Parser->StatusCode = atoi(Buffer + 9);
+
+	if(http_response_header_value(Buffer, Parser->HeaderLen, "Content-Length", HeaderValue, sizeof HeaderValue) != -1){
+		Parser->ContentLength = atoi(HeaderValue);
+		if(Parser->ContentLength < 0){
+			return -1;
+		}
+	}
+
+	if(http_response_header_value(Buffer, Parser->HeaderLen, "Transfer-Encoding", HeaderValue, sizeof HeaderValue) != -1){
+		for(i = 0; HeaderValue[i]; i ++){
+			HeaderValue[i] = tolower((unsigned char)HeaderValue[i]);
+		}
+		Parser->Chunked = (strstr(HeaderValue, "chunked") != NULL);
+	}
+
+	Parser->KeepAlive = Http11;
+	if(http_response_header_value(Buffer, Parser->HeaderLen, "Connection", HeaderValue, sizeof HeaderValue) != -1){
+		if(HeaderValue[0] == 'c' || HeaderValue[0] == 'C'){
+			Parser->KeepAlive = 0;
+		}
+		else if(HeaderValue[0] == 'k' || HeaderValue[0] == 'K'){
+			Parser->KeepAlive = 1;
+		}
+	}
+
+	if(Parser->StatusCode == 204 || Parser->StatusCode == 304){
+		Parser->Chunked = 0;
+		Parser->ContentLength = 0;
+	}
+
+	Parser->BodyStart = Parser->HeaderLen;
+	Parser->ParsePos = Parser->HeaderLen;
+	Parser->BodyLen = 0;
+
+	if(Parser->Chunked){
+		Parser->State = HTTP_PARSE_CHUNK_SIZE;
+	}
+	else if(Parser->ContentLength != -1){
+		Parser->State = HTTP_PARSE_BODY;
+	}
+	else{
+		Parser->KeepAlive = 0;
+		Parser->State = HTTP_PARSE_BODY_UNTIL_CLOSE;
+	}
+	return 0;
+}
+
+static int http_parser_line_end(const char *Buffer, int Start, int Len){
+	const char *Pos;
+
+	Pos = (const char *)memchr(Buffer + Start, '\n', Len - Start);
+	if(Pos == NULL){
+		return -1;
+	}
+	return (int)(Pos - Buffer);
+}
+
+// Feeds the parser with the first Len bytes of Buffer; earlier calls must have
+// seen a prefix of the same bytes, so a caller just keeps appending what recv
+// returns and calls again. Nothing is copied out: once done the body is
+// Buffer + BodyStart for BodyLen bytes. Chunked bodies are joined up in place,
+// each chunk moved down over the chunk-size line in front of it.
+// Returns 1 when the response is complete, 0 when more bytes are needed and
+// -1 on a malformed response. ParsePos is then where the next response starts.
+int http_parser_feed(HTTP_PARSER *Parser, char *Buffer, int Len){
+	int LineEnd = 0;
+	int Take = 0;
+
+	while(1){
+		switch(Parser->State){
+		case HTTP_PARSE_HEADER:
+			Parser->HeaderLen = http_parser_find_header_end(Buffer, Parser->ScanPos, Len);
+			if(Parser->HeaderLen == -1){
+				if(Len > SOCKET_MAX_BUF){
+					return -1;
+				}
+				Parser->ScanPos = (Len > 3) ? Len - 3 : 0;
+				return 0;
+			}
+			if(http_parser_header(Parser, Buffer) == -1){
+				return -1;
+			}
+			break;
+		case HTTP_PARSE_BODY:
+			Take = Len - Parser->ParsePos;
+			if(Take > Parser->ContentLength - Parser->BodyLen){
+				Take = Parser->ContentLength - Parser->BodyLen;
+			}
+			Parser->BodyLen += Take;
+			Parser->ParsePos += Take;
+			if(Parser->BodyLen < Parser->ContentLength){
+				return 0;
+			}
+			Parser->State = HTTP_PARSE_DONE;
+			break;
+		case HTTP_PARSE_BODY_UNTIL_CLOSE:
+			Parser->BodyLen += Len - Parser->ParsePos;
+			Parser->ParsePos = Len;
+			return 0;
+		case HTTP_PARSE_CHUNK_SIZE:
+			LineEnd = http_parser_line_end(Buffer, Parser->ParsePos, Len);
+			if(LineEnd == -1){
+				return (Len - Parser->ParsePos > HTTP_CHUNK_LINE_MAX) ? -1 : 0;
+			}
+			if(!isxdigit((unsigned char)Buffer[Parser->ParsePos])){
+				return -1;
+			}
+			Parser->ChunkRemain = (int)strtol(Buffer + Parser->ParsePos, NULL, 16);
+			if(Parser->ChunkRemain < 0){
+				return -1;
+			}
+			Parser->ParsePos = LineEnd + 1;
+			Parser->State = (Parser->ChunkRemain == 0) ? HTTP_PARSE_TRAILER : HTTP_PARSE_CHUNK_DATA;
+			break;
+		case HTTP_PARSE_CHUNK_DATA:
+			Take = Len - Parser->ParsePos;
+			if(Take > Parser->ChunkRemain){
+				Take = Parser->ChunkRemain;
+			}
+			if(Take > 0 && Parser->BodyStart + Parser->BodyLen != Parser->ParsePos){
+				memmove(Buffer + Parser->BodyStart + Parser->BodyLen, Buffer + Parser->ParsePos, Take);
+			}
+			Parser->BodyLen += Take;
+			Parser->ParsePos += Take;
+			Parser->ChunkRemain -= Take;
+			if(Parser->ChunkRemain > 0){
+				return 0;
+			}
+			Parser->State = HTTP_PARSE_CHUNK_DATA_END;
+			break;
+		case HTTP_PARSE_CHUNK_DATA_END:
+			if(Len - Parser->ParsePos < 2){
+				return 0;
+			}
+			if(Buffer[Parser->ParsePos] != '\r' || Buffer[Parser->ParsePos + 1] != '\n'){
+				return -1;
+			}
+			Parser->ParsePos += 2;
+			Parser->State = HTTP_PARSE_CHUNK_SIZE;
+			break;
+		case HTTP_PARSE_TRAILER:
+			LineEnd = http_parser_line_end(Buffer, Parser->ParsePos, Len);
+			if(LineEnd == -1){
+				return (Len - Parser->ParsePos > HTTP_CHUNK_LINE_MAX) ? -1 : 0;
+			}
+			if(LineEnd - Parser->ParsePos <= 1){
+				Parser->State = HTTP_PARSE_DONE;
+			}
+			Parser->ParsePos = LineEnd + 1;
+			break;
+		case HTTP_PARSE_DONE:
+			return 1;
+		default:
+			return -1;
+		}
+	}
+}
+
+// Called when the server closed the connection after Len bytes. Only a body
+// without Content-Length or chunked framing may legitimately end that way.
+int http_parser_finish(HTTP_PARSER *Parser, int Len){
+	if(Parser->State == HTTP_PARSE_DONE){
+		return 1;
+	}
+	if(Parser->State == HTTP_PARSE_BODY_UNTIL_CLOSE){
+		Parser->BodyLen += Len - Parser->ParsePos;
+		Parser->ParsePos = Len;
+		Parser->State = HTTP_PARSE_DONE;
+		return 1;
+	}
+	return -1;
+}
+
+int http_response_init(HTTP_RESPONSE *Response){
+	Response->Buffer = (char *)malloc(SOCKET_MAX_BUF);
+	if(Response->Buffer == NULL){
+		return -1;
+	}
+	Response->Size = SOCKET_MAX_BUF;
+	Response->Len = 0;
+	http_parser_init(&Response->Parser);
+	return 0;
+}
+
+// Gets the buffer ready for the next response on the same connection. Bytes
+// that arrived after the end of the previous response are kept.
+int http_response_reset(HTTP_RESPONSE *Response){
+	int Rest = 0;
+
+	if(Response->Parser.State == HTTP_PARSE_DONE){
+		Rest = Response->Len - Response->Parser.ParsePos;
+		if(Rest > 0){
+			memmove(Response->Buffer, Response->Buffer + Response->Parser.ParsePos, Rest);
+		}
+	}
+	Response->Len = Rest;
+	http_parser_init(&Response->Parser);
+	return Rest;
+}
+
+int http_response_free(HTTP_RESPONSE *Response){
+	free(Response->Buffer);
+	Response->Buffer = NULL;
+	Response->Size = 0;
+	Response->Len = 0;
+	return 0;
+}
+
+// Returns where the next recv should write and how much room there is. Once
+// Content-Length is known the buffer is grown to hold the whole response in
+// one step; otherwise it doubles whenever it fills up.
+char *http_response_reserve(HTTP_RESPONSE *Response, int *Space){
+	HTTP_PARSER *Parser = &Response->Parser;
+	char *NewBuffer;
+	int NewSize = Response->Size;
+
+	if(Parser->State == HTTP_PARSE_BODY && Parser->HeaderLen + Parser->ContentLength > NewSize){
+		NewSize = Parser->HeaderLen + Parser->ContentLength;
+	}
+	if(NewSize - Response->Len < SOCKET_MAX_BUF / 4 && Parser->State != HTTP_PARSE_BODY){
+		NewSize = NewSize * 2;
+	}
+	if(NewSize > FILE_MAX_BUF){
+		NewSize = FILE_MAX_BUF;
+	}
+
+	if(NewSize > Response->Size){
+		NewBuffer = (char *)realloc(Response->Buffer, NewSize);
+		if(NewBuffer == NULL){
+			return NULL;
+		}
+		Response->Buffer = NewBuffer;
+		Response->Size = NewSize;
+	}
+
+	*Space = Response->Size - Response->Len;
+	if(*Space <= 0){
+		return NULL;
+	}
+	return Response->Buffer + Response->Len;
+}
+
+int http_response_feed(HTTP_RESPONSE *Response, int RecvLen){
+	Response->Len += RecvLen;
+	return http_parser_feed(&Response->Parser, Response->Buffer, Response->Len);
+}
+
+// Reads exactly one response off a blocking keep-alive connection. Returns 1
+// when the connection can carry another request, 0 when it must be closed and
+// -1 when no complete response arrived.
+int http_response_recv(SOCKET ClientSocket, HTTP_RESPONSE *Response){
+	unsigned long long StartTick = net_tick_ms();
+	char *RecvPos;
+	int Space = 0;
+	int RecvRes = 0;
+	int ParseRes = 0;
+
+	ParseRes = http_parser_feed(&Response->Parser, Response->Buffer, Response->Len);
+
+	while(ParseRes == 0){
+		// each recv is bounded by the socket timeout, the whole reply by this
+		if(net_tick_ms() - StartTick > REQUEST_TIMEOUT_TOTAL){
+			return -1;
+		}
+
+		RecvPos = http_response_reserve(Response, &Space);
+		if(RecvPos == NULL){
+			return -1;
+		}
+
+		RecvRes = recv(ClientSocket, RecvPos, Space, 0);
+		if(RecvRes == SOCKET_ERROR){
+			return -1;
+		}
+		if(RecvRes == 0){
+			ParseRes = http_parser_finish(&Response->Parser, Response->Len);
+			break;
+		}
+
+		ParseRes = http_response_feed(Response, RecvRes);
+	}
+
+	if(ParseRes != 1){
+		return -1;
+	}
+	http_encoding_learn(Response->Buffer, Response->Parser.HeaderLen, Response->Parser.StatusCode);
+	return Response->Parser.KeepAlive;
+}
+
+int http_response_header_value(const char *RecvBuffer, int HeaderLen, const char *Name, char *Value, int ValueLen){
+	int NameLen = strlen(Name);
+	int LineStart = 0, LineEnd = 0;
+	int Len = 0;
+	int i = 0, j = 0;
+
+	while(LineStart < HeaderLen){
+		LineEnd = LineStart;
+		while(LineEnd < HeaderLen && RecvBuffer[LineEnd] != '\r'){
+			LineEnd ++;
+		}
+
+		if(LineEnd - LineStart > NameLen && RecvBuffer[LineStart + NameLen] == ':'){
+			for(j = 0; j < NameLen; j ++){
+				if(tolower((unsigned char)RecvBuffer[LineStart + j]) != tolower((unsigned char)Name[j])){
+					break;
+				}
+			}
+
+			if(j == NameLen){
+				i = LineStart + NameLen + 1;
+				while(i < LineEnd && RecvBuffer[i] == ' '){
+					i ++;
+				}
+				Len = 0;
+				while(i < LineEnd && Len < ValueLen - 1){
+					Value[Len ++] = RecvBuffer[i ++];
+				}
+				Value[Len] = 0;
+				return Len;
+			}
+		}
+
+		LineStart = LineEnd + 2;
+	}
+
+	return -1;
+}
+
 /*
 int ParseRecvBuffer(char *RecvBuffer, int PostAction){
 
@@ -3,7 +3,60 @@
 
 #include "define.h"
 #include "bson_parser.h"
+#include "http_encoding.h"
+#include "net_socket.h"
+
+#define HTTP_PARSE_HEADER 0
+#define HTTP_PARSE_BODY 1
+#define HTTP_PARSE_BODY_UNTIL_CLOSE 2
+#define HTTP_PARSE_CHUNK_SIZE 3
+#define HTTP_PARSE_CHUNK_DATA 4
+#define HTTP_PARSE_CHUNK_DATA_END 5
+#define HTTP_PARSE_TRAILER 6
+#define HTTP_PARSE_DONE 7
+
+#define HTTP_CHUNK_LINE_MAX 1024
+
+typedef struct{
+	int State;
+	int ScanPos;
+	int ParsePos;
+	int HeaderLen;
+	int StatusCode;
+	int KeepAlive;
+	int Chunked;
+	int ContentLength;
+	int ChunkRemain;
+	int BodyStart;
+	int BodyLen;
+}HTTP_PARSER;
+
+typedef struct{
+	char *Buffer;
+	int Len;
+	int Size;
+	HTTP_PARSER Parser;
+}HTTP_RESPONSE;
 
 int ParseRecvBuffer(char *RecvBuffer, int RecvLen, int PostAction);
+int ParseRecvBody(const char *Body, int BodyLen, int PostAction);
+int ParseRecvError(const char *Body, int BodyLen);
+int ParseRecvSeq(const char *Body, int BodyLen);
+int ParseRecvBatch(const char *Body, int BodyLen, int *Result, int ResultNum);
+int ParseRecvHave(const char *Body, int BodyLen, int *Have, int HaveNum);
+int ParseRecvOffset(const char *Body, int BodyLen, long long *Offset);
+
+void http_parser_init(HTTP_PARSER *Parser);
+int http_parser_feed(HTTP_PARSER *Parser, char *Buffer, int Len);
+int http_parser_finish(HTTP_PARSER *Parser, int Len);
+int http_parser_find_header_end(const char *Buffer, int Start, int Len);
+
+int http_response_init(HTTP_RESPONSE *Response);
+int http_response_reset(HTTP_RESPONSE *Response);
+int http_response_free(HTTP_RESPONSE *Response);
+char *http_response_reserve(HTTP_RESPONSE *Response, int *Space);
+int http_response_feed(HTTP_RESPONSE *Response, int RecvLen);
+int http_response_recv(SOCKET ClientSocket, HTTP_RESPONSE *Response);
+int http_response_header_value(const char *RecvBuffer, int HeaderLen, const char *Name, char *Value, int ValueLen);
 
 #endif // __HTTP_REPONSE__
\ No newline at end of file
@@ -2,6 +2,12 @@
 #include "post_api_comm.h"
 #include "post_api_login.h"
 #include "post_api_upload.h"
+#include "conn_pool.h"
+#include "http_encoding.h"
+#include "rate_limit.h"
+#include "endpoint.h"
+#include "traffic_lane.h"
+#include "post_api_session.h"
 
 #include "getopt.h"
 
@@ -9,9 +15,14 @@
 
 //char IPAddress[] = "127.0.0.1";
 //u_short Port = 80;
-char IPAddress[] = "218.193.154.30";
-u_short Port = 8888;
-char SendBuffer[FILE_MAX_BUF];
+char IPAddress[MARK_MAX_BUF];
+u_short Port = 0;
+
+typedef struct{
+	char Command;
+	char *Path;
+	char *Folder;
+}UPLOAD_COMMAND;
 
 /*
 int main(){
@@ -34,26 +45,103 @@ int main(){
 }
 */
 
+// login and comm go to the endpoint the session was placed on at startup
+static int main_login(char *SendBuffer, void *){
+	// over the persistent session when it came up, the server pushes cmd then
+	if(post_api_session_active(NULL, 0) && post_api_session_login(SendBuffer, "test", "test") == 0){
+		return 0;
+	}
+	return post_api_login(IPAddress, Port, SendBuffer, "test", "test");
+}
+
+static int main_comm(char *SendBuffer, void *){
+	return post_api_comm(IPAddress, Port, SendBuffer);
+}
+
+static int main_upload(char *SendBuffer, void *HandlerArg){
+	UPLOAD_COMMAND *Command = (UPLOAD_COMMAND *)HandlerArg;
+
+	return post_api_upload(SendBuffer, Command->Command, Command->Path, Command->Folder);
+}
+
+// WS_CLIENT_3 [-e ip:port,ip:port,...] [-w | -b] -a Path File | -u Path Folder | -m Path Folder ...
 int main(int argc, char * argv[]){
+	const char *EndpointList = ENDPOINT_LIST;
+	int Transport = SESSION_TRANSPORT;
+	UPLOAD_COMMAND *Command;
+	int CommandNum = 0;
 	int Optind = 1;
 	int Optchar;
 
-	post_api_login(IPAddress, Port, SendBuffer, "test", "test");
+	// the endpoint list and transport come first, the login below needs them
+	while((Optchar = getopt(argc, argv, "a:ume:wb", Optind)) == 'e' || Optchar == 'w' || Optchar == 'b'){
+		if(Optchar != 'e'){
+			Transport = (Optchar == 'w') ? SESSION_TRANSPORT_WEBSOCKET : SESSION_TRANSPORT_BSON;
+			Optind += 1;
+			continue;
+		}
+		if(Optind + 1 >= argc){
+			break;
+		}
+		EndpointList = argv[Optind + 1];
+		Optind += 2;
+	}
+	if(endpoint_init(EndpointList) == -1){
+		return -1;
+	}
+
+	conn_pool_init(CONN_POOL_MAX_SOCKETS, CONN_POOL_IDLE_TIMEOUT);
+	http_encoding_config(HTTP_ENCODING_GZIP, HTTP_ENCODING_LEVEL, HTTP_ENCODING_THRESHOLD, 1);
+	rate_limit_init(RATE_LIMIT_BYTES, RATE_LIMIT_BYTE_BURST, RATE_LIMIT_REQUESTS, RATE_LIMIT_REQUEST_BURST);
+	traffic_lane_init();
+
+	// the session belongs to the device, so it is placed by devid alone
+	endpoint_pick("", IPAddress, &Port);
+	if(Transport != SESSION_TRANSPORT_HTTP){
+		post_api_session_open(IPAddress, Port, Transport);
+	}
+	traffic_lane_call(TRAFFIC_LANE_CONTROL, main_login, NULL);
 	system("pause");
 
-	while((Optchar = getopt (argc, argv,  "a:u", Optind)) != -1){
+	Command = new UPLOAD_COMMAND[argc];
+
+	// every command takes a path and a folder or file after it
+	while((Optchar = getopt (argc, argv,  "a:ume:wb", Optind)) != -1){
+
+		if(Optind + 2 >= argc){
+			printf("h\n");
+			break;
+		}
 
 		switch(Optchar){
 		case 'a':
-			post_api_upload(IPAddress, Port, SendBuffer, Optchar, argv[Optind + 1], argv[Optind + 2]);
-			break;
 		case 'u':
-			post_api_upload(IPAddress, Port, SendBuffer, Optchar, argv[Optind + 1], argv[Optind + 2]);
+		case 'm':
+			Command[CommandNum].Command = (char)Optchar;
+			Command[CommandNum].Path = argv[Optind + 1];
+			Command[CommandNum].Folder = argv[Optind + 2];
+			traffic_lane_post(TRAFFIC_LANE_BULK, main_upload, &Command[CommandNum]);
+			CommandNum ++;
 			break;
 		default:
 			printf("h\n");
 			break;
 		}
+		Optind += 3;
 	}
+
+	// uploads run on the bulk lane meanwhile, comm polls overtake them; with
+	// the persistent session up the server pushes cmd and nothing is polled
+	while(traffic_lane_wait(TRAFFIC_LANE_BULK, COMM_POLL_INTERVAL) == -1){
+		if(!post_api_session_active(NULL, 0)){
+			traffic_lane_call(TRAFFIC_LANE_CONTROL, main_comm, NULL);
+		}
+	}
+
+	post_api_session_close();
+	traffic_lane_cleanup();
+	delete[] Command;
+	conn_pool_cleanup();
+	endpoint_cleanup();
 	return 0;
 }
\ No newline at end of file
@@ -0,0 +1,558 @@
+#include "net_socket.h"
+#include "rate_limit.h"
+
+#ifndef _WIN32
+#include <signal.h>
+#include <sys/uio.h>
+#endif
+
+#ifdef __linux__
+#include <sys/sendfile.h>
+#include <linux/errqueue.h>
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+#endif
+
+int net_startup(){
+#ifdef _WIN32
+	WSADATA Ws;
+
+	if(WSAStartup(MAKEWORD(2, 2), &Ws) != 0){
+		return -1;
+	}
+#else
+	// a peer resetting a pooled connection must not kill the process
+	signal(SIGPIPE, SIG_IGN);
+#endif
+	return 0;
+}
+
+int net_cleanup(){
+#ifdef _WIN32
+	WSACleanup();
+#endif
+	return 0;
+}
+
+// A non-blocking connect is left in progress for the caller to poll. A
+// blocking one is still started non-blocking so it can give up after
+// REQUEST_TIMEOUT_CONNECT, and the socket gets send and receive timeouts so
+// a dead server cannot hang a blocking request forever.
+SOCKET net_connect(const char *IpAddress, u_short Port, int NonBlocking){
+	SOCKET ClientSocket;
+	struct sockaddr_in ServerAddr;
+	int SocketError = 0;
+	socklen_t SocketErrorLen = sizeof SocketError;
+	int NoDelay = 1;
+	int Ret = 0;
+
+	ClientSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if(ClientSocket == INVALID_SOCKET){
+		return INVALID_SOCKET;
+	}
+
+	setsockopt(ClientSocket, IPPROTO_TCP, TCP_NODELAY, (const char *)&NoDelay, sizeof NoDelay);
+
+	if(net_set_nonblocking(ClientSocket, 1) == -1){
+		closesocket(ClientSocket);
+		return INVALID_SOCKET;
+	}
+	net_set_timeout(ClientSocket, REQUEST_TIMEOUT_SEND, REQUEST_TIMEOUT_FIRST_BYTE);
+
+	memset(&ServerAddr, 0x00, sizeof ServerAddr);
+	ServerAddr.sin_family = AF_INET;
+	ServerAddr.sin_addr.s_addr = inet_addr(IpAddress);
+	ServerAddr.sin_port = htons(Port);
+
+	Ret = connect(ClientSocket, (struct sockaddr *)&ServerAddr, sizeof(ServerAddr));
+	if(Ret == SOCKET_ERROR && !net_would_block(net_last_error())){
+		closesocket(ClientSocket);
+		return INVALID_SOCKET;
+	}
+	if(NonBlocking){
+		return ClientSocket;
+	}
+
+	if(Ret == SOCKET_ERROR){
+		if(net_wait_writable(ClientSocket, REQUEST_TIMEOUT_CONNECT) != 1 || getsockopt(ClientSocket, SOL_SOCKET, SO_ERROR, (char *)&SocketError, &SocketErrorLen) == SOCKET_ERROR || SocketError != 0){
+			closesocket(ClientSocket);
+			return INVALID_SOCKET;
+		}
+	}
+	if(net_set_nonblocking(ClientSocket, 0) == -1){
+		closesocket(ClientSocket);
+		return INVALID_SOCKET;
+	}
+
+	return ClientSocket;
+}
+
+int net_close(SOCKET ClientSocket){
+	if(ClientSocket == INVALID_SOCKET){
+		return -1;
+	}
+	closesocket(ClientSocket);
+	return 0;
+}
+
+#ifdef __linux__
+// Sends Len bytes of Fd from Offset on. sendfile moves them from the page
+// cache without a copy through user space; a file system that cannot do
+// that gets the bytes read and sent through a small buffer instead.
+static int net_send_file(SOCKET ClientSocket, int Fd, long long Offset, int Len){
+	char Buffer[16384];
+	off_t FileOffset = (off_t)Offset;
+	ssize_t Res = 0;
+
+	Res = sendfile(ClientSocket, Fd, &FileOffset, Len);
+	if(Res == 0){
+		// the file is shorter than when the request was framed
+		errno = EIO;
+		return SOCKET_ERROR;
+	}
+	if(Res != -1 || (errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP)){
+		return (int)Res;
+	}
+
+	if(Len > (int)sizeof Buffer){
+		Len = sizeof Buffer;
+	}
+	Res = pread(Fd, Buffer, Len, (off_t)Offset);
+	if(Res <= 0){
+		errno = EIO;
+		return SOCKET_ERROR;
+	}
+	return (int)send(ClientSocket, Buffer, Res, MSG_NOSIGNAL);
+}
+#endif
+
+// Gathers the segments from byte Offset on into a single sendmsg/WSASend
+// call, so a header and a body that live in different buffers go out
+// together without being copied next to each other first.
+// Sends what is left of the segments past Offset in one gathered call, but
+// no more than MaxLen bytes when MaxLen is not -1.
+int net_send_segments(SOCKET ClientSocket, const NET_SEGMENT *Segment, int SegmentNum, int Offset, int MaxLen){
+	return net_send_segments_zerocopy(ClientSocket, Segment, SegmentNum, Offset, MaxLen, NULL);
+}
+
+// As net_send_segments. A gather stops in front of a file segment, which goes
+// out on its own call. With ZeroCopy enabled, a gather of at least
+// NET_ZEROCOPY_THRESHOLD bytes is sent with MSG_ZEROCOPY and counted; smaller
+// ones are cheaper to copy than to pin and reap.
+int net_send_segments_zerocopy(SOCKET ClientSocket, const NET_SEGMENT *Segment, int SegmentNum, int Offset, int MaxLen, NET_ZEROCOPY *ZeroCopy){
+	int VecNum = 0;
+	int VecLen = 0;
+	int Total = 0;
+	int i = 0;
+
+#ifdef _WIN32
+	WSABUF Vec[NET_MAX_SEGMENT];
+	DWORD SendRes = 0;
+#else
+	struct iovec Vec[NET_MAX_SEGMENT];
+	struct msghdr Msg;
+	int Flags = MSG_NOSIGNAL;
+	int SendRes = 0;
+#endif
+
+	for(i = 0; i < SegmentNum && VecNum < NET_MAX_SEGMENT && MaxLen != 0; i ++){
+		if(Offset >= Segment[i].Len){
+			Offset -= Segment[i].Len;
+			continue;
+		}
+		VecLen = Segment[i].Len - Offset;
+		if(MaxLen != -1 && VecLen > MaxLen){
+			VecLen = MaxLen;
+		}
+		if(Segment[i].Base == NULL){
+#ifdef __linux__
+			if(VecNum == 0){
+				return net_send_file(ClientSocket, Segment[i].Fd, Segment[i].FileOffset + Offset, VecLen);
+			}
+			break;
+#else
+			return SOCKET_ERROR;
+#endif
+		}
+#ifdef _WIN32
+		Vec[VecNum].buf = (char *)Segment[i].Base + Offset;
+		Vec[VecNum].len = VecLen;
+#else
+		Vec[VecNum].iov_base = (void *)(Segment[i].Base + Offset);
+		Vec[VecNum].iov_len = VecLen;
+#endif
+		if(MaxLen != -1){
+			MaxLen -= VecLen;
+		}
+		Total += VecLen;
+		Offset = 0;
+		VecNum ++;
+	}
+
+	if(VecNum == 0){
+		return 0;
+	}
+
+#ifdef _WIN32
+	if(WSASend(ClientSocket, Vec, VecNum, &SendRes, 0, NULL, NULL) == SOCKET_ERROR){
+		return SOCKET_ERROR;
+	}
+	return (int)SendRes;
+#else
+	memset(&Msg, 0x00, sizeof Msg);
+	Msg.msg_iov = Vec;
+	Msg.msg_iovlen = VecNum;
+
+	if(ZeroCopy != NULL && ZeroCopy->Enabled && Total >= NET_ZEROCOPY_THRESHOLD){
+		Flags |= MSG_ZEROCOPY;
+	}
+
+	SendRes = sendmsg(ClientSocket, &Msg, Flags);
+	// every zerocopy send that took bytes owes one completion, even a short one
+	if(SendRes > 0 && (Flags & MSG_ZEROCOPY)){
+		ZeroCopy->Sent ++;
+	}
+	return SendRes;
+#endif
+}
+
+// Blocking send of every segment. Holds to the byte rate limit, which is the
+// only reason it ever sleeps.
+int net_send_segments_all(SOCKET ClientSocket, const NET_SEGMENT *Segment, int SegmentNum){
+	unsigned long long WaitMs = 0;
+	int SendRes = 0;
+	int SendLen = 0;
+	int Allowed = 0;
+	int Len = 0;
+	int i = 0;
+
+	for(i = 0; i < SegmentNum; i ++){
+		Len += Segment[i].Len;
+	}
+
+	while(SendLen < Len){
+		Allowed = rate_limit_bytes(Len - SendLen, &WaitMs);
+		if(Allowed == 0){
+			net_sleep_ms((int)WaitMs);
+			continue;
+		}
+
+		SendRes = net_send_segments(ClientSocket, Segment, SegmentNum, SendLen, Allowed);
+		if(SendRes == SOCKET_ERROR || SendRes == 0){
+			rate_limit_refund(Allowed);
+			return -1;
+		}
+		rate_limit_refund(Allowed - SendRes);
+		SendLen += SendRes;
+	}
+	return SendLen;
+}
+
+// Returns 1 once the socket is writable, 0 on timeout and -1 on error.
+int net_wait_writable(SOCKET ClientSocket, int Timeout){
+#ifdef _WIN32
+	fd_set WriteSet, ExceptSet;
+	struct timeval TimeVal;
+	int Ret = 0;
+
+	FD_ZERO(&WriteSet);
+	FD_ZERO(&ExceptSet);
+	FD_SET(ClientSocket, &WriteSet);
+	FD_SET(ClientSocket, &ExceptSet);
+	TimeVal.tv_sec = Timeout / 1000;
+	TimeVal.tv_usec = (Timeout % 1000) * 1000;
+
+	Ret = select(0, NULL, &WriteSet, &ExceptSet, &TimeVal);
+	if(Ret == SOCKET_ERROR){
+		return -1;
+	}
+	// a refused connect shows up in the except set only
+	if(FD_ISSET(ClientSocket, &ExceptSet)){
+		return -1;
+	}
+	return Ret > 0 ? 1 : 0;
+#else
+	struct pollfd PollFd;
+	int Ret = 0;
+
+	PollFd.fd = ClientSocket;
+	PollFd.events = POLLOUT;
+	PollFd.revents = 0;
+
+	do{
+		Ret = poll(&PollFd, 1, Timeout);
+	}while(Ret == -1 && errno == EINTR);
+
+	if(Ret == -1){
+		return -1;
+	}
+	return Ret > 0 ? 1 : 0;
+#endif
+}
+
+// 1 once a recv would not block, which includes a closed or failed socket
+int net_wait_readable(SOCKET ClientSocket, int Timeout){
+#ifdef _WIN32
+	fd_set ReadSet, ExceptSet;
+	struct timeval TimeVal;
+	int Ret = 0;
+
+	FD_ZERO(&ReadSet);
+	FD_ZERO(&ExceptSet);
+	FD_SET(ClientSocket, &ReadSet);
+	FD_SET(ClientSocket, &ExceptSet);
+	TimeVal.tv_sec = Timeout / 1000;
+	TimeVal.tv_usec = (Timeout % 1000) * 1000;
+
+	Ret = select(0, &ReadSet, NULL, &ExceptSet, &TimeVal);
+	if(Ret == SOCKET_ERROR){
+		return -1;
+	}
+	return Ret > 0 ? 1 : 0;
+#else
+	struct pollfd PollFd;
+	int Ret = 0;
+
+	PollFd.fd = ClientSocket;
+	PollFd.events = POLLIN;
+	PollFd.revents = 0;
+
+	do{
+		Ret = poll(&PollFd, 1, Timeout);
+	}while(Ret == -1 && errno == EINTR);
+
+	if(Ret == -1){
+		return -1;
+	}
+	return Ret > 0 ? 1 : 0;
+#endif
+}
+
+// Bounds every blocking send and recv on the socket; 0 leaves one unbounded.
+int net_set_timeout(SOCKET ClientSocket, int SendTimeout, int RecvTimeout){
+#ifdef _WIN32
+	DWORD SendValue = SendTimeout;
+	DWORD RecvValue = RecvTimeout;
+#else
+	struct timeval SendValue, RecvValue;
+
+	SendValue.tv_sec = SendTimeout / 1000;
+	SendValue.tv_usec = (SendTimeout % 1000) * 1000;
+	RecvValue.tv_sec = RecvTimeout / 1000;
+	RecvValue.tv_usec = (RecvTimeout % 1000) * 1000;
+#endif
+
+	if(setsockopt(ClientSocket, SOL_SOCKET, SO_SNDTIMEO, (const char *)&SendValue, sizeof SendValue) == SOCKET_ERROR){
+		return -1;
+	}
+	if(setsockopt(ClientSocket, SOL_SOCKET, SO_RCVTIMEO, (const char *)&RecvValue, sizeof RecvValue) == SOCKET_ERROR){
+		return -1;
+	}
+	return 0;
+}
+
+int net_set_nonblocking(SOCKET ClientSocket, int NonBlocking){
+#ifdef _WIN32
+	u_long Mode = NonBlocking ? 1 : 0;
+
+	if(ioctlsocket(ClientSocket, FIONBIO, &Mode) == SOCKET_ERROR){
+		return -1;
+	}
+#else
+	int Flags;
+
+	Flags = fcntl(ClientSocket, F_GETFL, 0);
+	if(Flags == -1){
+		return -1;
+	}
+	Flags = NonBlocking ? (Flags | O_NONBLOCK) : (Flags & ~O_NONBLOCK);
+	if(fcntl(ClientSocket, F_SETFL, Flags) == -1){
+		return -1;
+	}
+#endif
+	return 0;
+}
+
+// An idle keep-alive socket must have nothing to read. If it is readable the
+// server either closed it (recv returns 0), reset it, or sent bytes we never
+// asked for; none of those can carry another request.
+int net_is_alive(SOCKET ClientSocket){
+	char Peek;
+	int Ret = 0;
+
+#ifdef _WIN32
+	fd_set ReadSet;
+	struct timeval Timeout;
+
+	FD_ZERO(&ReadSet);
+	FD_SET(ClientSocket, &ReadSet);
+	Timeout.tv_sec = 0;
+	Timeout.tv_usec = 0;
+
+	Ret = select(0, &ReadSet, NULL, NULL, &Timeout);
+#else
+	struct pollfd Pfd;
+
+	Pfd.fd = ClientSocket;
+	Pfd.events = POLLIN;
+	Pfd.revents = 0;
+
+	Ret = poll(&Pfd, 1, 0);
+	if(Ret > 0 && (Pfd.revents & (POLLERR | POLLHUP | POLLNVAL))){
+		return 0;
+	}
+#endif
+	if(Ret == SOCKET_ERROR){
+		return 0;
+	}
+	if(Ret == 0){
+		return 1;
+	}
+
+	Ret = recv(ClientSocket, &Peek, 1, MSG_PEEK);
+	if(Ret == SOCKET_ERROR && net_would_block(net_last_error())){
+		return 1;
+	}
+	return 0;
+}
+
+// Asks the kernel to pin rather than copy big sends on this socket. Where it
+// cannot, ZeroCopy stays disabled and every send copies as before.
+int net_zerocopy_enable(SOCKET ClientSocket, NET_ZEROCOPY *ZeroCopy){
+	memset(ZeroCopy, 0x00, sizeof *ZeroCopy);
+
+#ifdef __linux__
+	int One = 1;
+
+	if(NET_ZEROCOPY_THRESHOLD > 0 && setsockopt(ClientSocket, SOL_SOCKET, SO_ZEROCOPY, &One, sizeof One) == 0){
+		ZeroCopy->Enabled = 1;
+		return 0;
+	}
+#endif
+	return -1;
+}
+
+// Takes the completions that are in without waiting. Each one covers a range
+// of sends. Returns how many sends are still waiting for theirs.
+int net_zerocopy_reap(SOCKET ClientSocket, NET_ZEROCOPY *ZeroCopy){
+#ifdef __linux__
+	char Control[128];
+	struct msghdr Msg;
+	struct cmsghdr *Cmsg;
+	struct sock_extended_err *Err;
+
+	while(ZeroCopy->Done != ZeroCopy->Sent){
+		memset(&Msg, 0x00, sizeof Msg);
+		Msg.msg_control = Control;
+		Msg.msg_controllen = sizeof Control;
+
+		if(recvmsg(ClientSocket, &Msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1){
+			if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR){
+				break;
+			}
+			return -1;
+		}
+
+		for(Cmsg = CMSG_FIRSTHDR(&Msg); Cmsg != NULL; Cmsg = CMSG_NXTHDR(&Msg, Cmsg)){
+			if(!((Cmsg->cmsg_level == SOL_IP && Cmsg->cmsg_type == IP_RECVERR) || (Cmsg->cmsg_level == SOL_IPV6 && Cmsg->cmsg_type == IPV6_RECVERR))){
+				continue;
+			}
+			Err = (struct sock_extended_err *)CMSG_DATA(Cmsg);
+			if(Err->ee_errno == 0 && Err->ee_origin == SO_EE_ORIGIN_ZEROCOPY){
+				ZeroCopy->Done += Err->ee_data - Err->ee_info + 1;
+			}
+		}
+	}
+#endif
+	return (int)(ZeroCopy->Sent - ZeroCopy->Done);
+}
+
+// Blocks up to Timeout milliseconds until every zerocopy send on the socket
+// is complete. Returns 0 then, 1 on timeout and -1 on error.
+int net_zerocopy_wait(SOCKET ClientSocket, NET_ZEROCOPY *ZeroCopy, int Timeout){
+#ifdef __linux__
+	unsigned long long Until = net_tick_ms() + Timeout;
+	unsigned long long Now = 0;
+	struct pollfd PollFd;
+	int Res = 0;
+
+	while(1){
+		Res = net_zerocopy_reap(ClientSocket, ZeroCopy);
+		if(Res <= 0){
+			return Res;
+		}
+		Now = net_tick_ms();
+		if(Now >= Until){
+			return 1;
+		}
+
+		// the error queue shows up as POLLERR whatever is asked for
+		PollFd.fd = ClientSocket;
+		PollFd.events = 0;
+		PollFd.revents = 0;
+		if(poll(&PollFd, 1, (int)(Until - Now)) == -1 && errno != EINTR){
+			return -1;
+		}
+	}
+#else
+	return 0;
+#endif
+}
+
+int net_last_error(){
+#ifdef _WIN32
+	return WSAGetLastError();
+#else
+	return errno;
+#endif
+}
+
+int net_would_block(int Error){
+#ifdef _WIN32
+	return Error == WSAEWOULDBLOCK || Error == WSAEINPROGRESS;
+#else
+	return Error == EWOULDBLOCK || Error == EAGAIN || Error == EINPROGRESS;
+#endif
+}
+
+unsigned long long net_tick_ms(){
+#ifdef _WIN32
+	return (unsigned long long)GetTickCount64();
+#else
+	struct timespec Now;
+
+	clock_gettime(CLOCK_MONOTONIC, &Now);
+	return (unsigned long long)Now.tv_sec * 1000 + Now.tv_nsec / 1000000;
+#endif
+}
+
+unsigned long long net_tick_us(){
+#ifdef _WIN32
+	LARGE_INTEGER Frequency, Counter;
+
+	QueryPerformanceFrequency(&Frequency);
+	QueryPerformanceCounter(&Counter);
+	return (unsigned long long)(Counter.QuadPart / Frequency.QuadPart) * 1000000 + (unsigned long long)(Counter.QuadPart % Frequency.QuadPart) * 1000000 / Frequency.QuadPart;
+#else
+	struct timespec Now;
+
+	clock_gettime(CLOCK_MONOTONIC, &Now);
+	return (unsigned long long)Now.tv_sec * 1000000 + Now.tv_nsec / 1000;
+#endif
+}
+
+void net_sleep_ms(int Milliseconds){
+#ifdef _WIN32
+	Sleep(Milliseconds);
+#else
+	usleep(Milliseconds * 1000);
+#endif
+}
\ No newline at end of file
@@ -0,0 +1,50 @@
+#ifndef __NET_SOCKET__
+#define __NET_SOCKET__
+
+#include "define.h"
+
+#define NET_MAX_SEGMENT 8
+
+// A segment with no Base is Len bytes of the open file Fd from FileOffset on,
+// sent straight from the page cache where the platform allows it.
+typedef struct{
+	const char *Base;
+	int Len;
+	int Fd;
+	long long FileOffset;
+}NET_SEGMENT;
+
+// MSG_ZEROCOPY sends on one socket: a buffer handed to the kernel must stay
+// untouched until as many completions have been reaped as sends were made
+typedef struct{
+	int Enabled;
+	unsigned int Sent;
+	unsigned int Done;
+}NET_ZEROCOPY;
+
+int net_startup();
+int net_cleanup();
+
+SOCKET net_connect(const char *IpAddress, u_short Port, int NonBlocking);
+int net_close(SOCKET ClientSocket);
+int net_send_segments(SOCKET ClientSocket, const NET_SEGMENT *Segment, int SegmentNum, int Offset, int MaxLen);
+int net_send_segments_zerocopy(SOCKET ClientSocket, const NET_SEGMENT *Segment, int SegmentNum, int Offset, int MaxLen, NET_ZEROCOPY *ZeroCopy);
+int net_send_segments_all(SOCKET ClientSocket, const NET_SEGMENT *Segment, int SegmentNum);
+int net_set_nonblocking(SOCKET ClientSocket, int NonBlocking);
+int net_wait_writable(SOCKET ClientSocket, int Timeout);
+int net_wait_readable(SOCKET ClientSocket, int Timeout);
+int net_set_timeout(SOCKET ClientSocket, int SendTimeout, int RecvTimeout);
+int net_is_alive(SOCKET ClientSocket);
+
+int net_zerocopy_enable(SOCKET ClientSocket, NET_ZEROCOPY *ZeroCopy);
+int net_zerocopy_reap(SOCKET ClientSocket, NET_ZEROCOPY *ZeroCopy);
+int net_zerocopy_wait(SOCKET ClientSocket, NET_ZEROCOPY *ZeroCopy, int Timeout);
+
+int net_last_error();
+int net_would_block(int Error);
+
+unsigned long long net_tick_ms();
+unsigned long long net_tick_us();
+void net_sleep_ms(int Milliseconds);
+
+#endif // __NET_SOCKET__
\ No newline at end of file
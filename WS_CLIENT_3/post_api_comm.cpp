@@ -1,73 +1,68 @@
 #include "post_api_comm.h"
 
 int post_api_comm(const char *IpAddress, u_short Port, char *SendBuffer){
-	WSADATA  Ws;
 	SOCKET ClientSocket;
-	HANDLE hThread = NULL;
-	struct sockaddr_in ServerAddr;
-	int AddrLen = 0;
+	int PoolRes = 0;
 	int Ret = 0;
-	
-	if(WSAStartup(MAKEWORD(2, 2), &Ws) != 0){
-		return -1;
-	}
 
-	ClientSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-	if(ClientSocket == INVALID_SOCKET){
+	PoolRes = conn_pool_acquire_lane(IpAddress, Port, CONN_POOL_LANE_CONTROL, 0, &ClientSocket);
+	if(PoolRes == -1){
 		return -1;
 	}
 
-	ServerAddr.sin_family = AF_INET;
-	ServerAddr.sin_addr.s_addr = inet_addr(IpAddress);
-	ServerAddr.sin_port = htons(Port);
-	memset(ServerAddr.sin_zero, 0x00, 8);
-
-	Ret = connect(ClientSocket, (struct sockaddr *)&ServerAddr, sizeof(ServerAddr));
-	if(Ret == SOCKET_ERROR){
-		return -1;
+	Ret = post_api_comm_communcation(ClientSocket, IpAddress, Port, SendBuffer);
+	if(Ret == -1 && PoolRes == CONN_POOL_REUSED){
+		// the server may have dropped the idle connection after our health check
+		conn_pool_release(IpAddress, Port, ClientSocket, 0);
+		if(conn_pool_acquire_lane(IpAddress, Port, CONN_POOL_LANE_CONTROL, 0, &ClientSocket) == -1){
+			return -1;
+		}
+		Ret = post_api_comm_communcation(ClientSocket, IpAddress, Port, SendBuffer);
 	}
 
-	Ret = post_api_comm_communcation(ClientSocket, IpAddress, Port, SendBuffer);
+	conn_pool_release(IpAddress, Port, ClientSocket, Ret == 1);
 	if(Ret == -1){
 		return -1;
 	}
 
-	closesocket(ClientSocket);
-	WSACleanup();
 	return 0;
 }
 
 int post_api_comm_communcation(SOCKET ClientSocket, const char *IpAddress, u_short Port, char *SendBuffer){
 	//char *SendBuffer, *RecvBuffer;
-	char RecvBuffer[SOCKET_MAX_BUF];
-	int SendRes = 0, RecvRes = 0;
-	int SendLen = 0, RecvLen = 0;
-	int RecvBufferIsEmpty = 0;
+	HTTP_REQUEST Request;
+	HTTP_RESPONSE Response;
+	int SendRes = 0;
+	int SendLen = 0;
+	int KeepAlive = 0;
 	int ParseRes = 0;
 
-	SendRes = send(ClientSocket, SendBuffer, SendLen, 0);
-	if(SendRes == SOCKET_ERROR){
+	SendLen = construct_http(IpAddress, Port, POST_API_ACTION_COMM, &Request, SendBuffer, SEND_MAX_BUF, NULL, NULL, NULL, NULL, 0);
+	if(SendLen == -1){
 		return -1;
 	}
 
-	while(1){
-		RecvRes = recv(ClientSocket, RecvBuffer, SOCKET_MAX_BUF, 0);
-		if(RecvRes == 0 || RecvRes == SOCKET_ERROR){
-			break;
-		}
+	SendRes = net_send_segments_all(ClientSocket, Request.Segment, Request.SegmentNum);
+	if(SendRes == -1){
+		return -1;
+	}
 
-		if((int)strlen(RecvBuffer) != 0){
-			RecvBufferIsEmpty = 0;
-		}
+	if(http_response_init(&Response) == -1){
+		return -1;
+	}
 
-		if(RecvBufferIsEmpty == 0){
-			ParseRes = ParseRecvBuffer(RecvBuffer, RecvRes, POST_API_ACTION_COMM);
-			if(ParseRes != -1){
-				// undo
-			}
-		}
+	KeepAlive = http_response_recv(ClientSocket, &Response);
+	if(KeepAlive == -1){
+		http_response_free(&Response);
+		return -1;
+	}
+
+	ParseRes = ParseRecvBody(Response.Buffer + Response.Parser.BodyStart, Response.Parser.BodyLen, POST_API_ACTION_COMM);
+	if(ParseRes != -1){
+		// undo
 	}
+	http_response_free(&Response);
 
 	//undo
-	return 1; 
+	return KeepAlive; 
 }
\ No newline at end of file
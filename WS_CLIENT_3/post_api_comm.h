@@ -4,6 +4,7 @@
 #include "define.h"
 #include "http_request.h"
 #include "http_response.h"
+#include "conn_pool.h"
 
 int post_api_comm(const char *IpAddress, u_short Port, char *SendBuffer);
 int post_api_comm_communcation(SOCKET ClientSocket, const char *IpAddress, u_short Port, char *SendBuffer);
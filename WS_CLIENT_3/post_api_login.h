@@ -4,6 +4,7 @@
 #include "define.h"
 #include "http_request.h"
 #include "http_response.h"
+#include "conn_pool.h"
 
 int post_api_login(const char *IpAddress, u_short Port, char *SendBuffer, char *UserName, char *Password);
 int post_api_login_connect(const char *IpAddress, u_short Port, char *SendBuffer, char *UserName, char *Password);
@@ -0,0 +1,342 @@
+#include "post_api_session.h"
+
+#include <Poco/Mutex.h>
+#include <Poco/Event.h>
+#include <Poco/Runnable.h>
+#include <Poco/Thread.h>
+
+// The optional persistent session: the same BSON documents the HTTP bodies
+// carry, with the action inside the document instead of in the URL, on one
+// connection to the session's endpoint. It is either upgraded to a WebSocket
+// with a document per binary frame, or plain TCP with the documents back to
+// back. A request gets a seq the server copies into its reply, so requests
+// can be pipelined, up to SESSION_MAX_PENDING of them: a reader thread hands
+// every reply to its request by seq, and anything without one is a cmd the
+// server pushed, which is queued on the control lane where a comm poll's
+// reply would have been handled. Once the connection fails the session stays
+// down and callers go back to plain HTTP.
+
+class PostApiSessionReader : public Poco::Runnable{
+public:
+	void run();
+};
+
+static int SessionTransport = SESSION_TRANSPORT_HTTP;
+static WS_CHANNEL SessionWs;
+static BSON_CHANNEL SessionBson;
+static int SessionOpen = 0;
+static int SessionStop = 0;
+static char SessionIpAddress[MARK_MAX_BUF];
+static u_short SessionPort = 0;
+static int SessionSeq = 0;
+static SESSION_PENDING SessionPending[SESSION_MAX_PENDING];
+static Poco::Event SessionPendingDone[SESSION_MAX_PENDING];
+static Poco::FastMutex SessionMutex;
+
+static PostApiSessionReader Reader;
+static Poco::Thread *ReaderThread = NULL;
+
+static int post_api_session_cmd(char *, void *HandlerArg){
+	SESSION_PUSH *Push = (SESSION_PUSH *)HandlerArg;
+
+	ParseRecvBody(Push->Body, Push->BodyLen, POST_API_ACTION_COMM);
+	free(Push);
+	return 0;
+}
+
+// every waiting request is woken without a reply
+static void post_api_session_fail_locked(){
+	int i = 0;
+
+	SessionOpen = 0;
+	for(i = 0; i < SESSION_MAX_PENDING; i ++){
+		if(SessionPending[i].InUse){
+			SessionPendingDone[i].set();
+		}
+	}
+}
+
+// one whole message, 0 on timeout, -1 once the connection is gone
+static int post_api_session_recv(char **Message, int *MessageLen){
+	if(SessionTransport == SESSION_TRANSPORT_WEBSOCKET){
+		return ws_channel_recv(&SessionWs, Message, MessageLen);
+	}
+	return bson_channel_recv(&SessionBson, Message, MessageLen);
+}
+
+// SendBuffer may be scrambled afterwards, the WebSocket masks in place
+static int post_api_session_write(char *SendBuffer, int Len){
+	if(SessionTransport == SESSION_TRANSPORT_WEBSOCKET){
+		return ws_channel_send(&SessionWs, WS_OPCODE_BINARY, SendBuffer, Len);
+	}
+	return bson_channel_send(&SessionBson, SendBuffer, Len);
+}
+
+void PostApiSessionReader::run(){
+	SESSION_PUSH *Push;
+	char *Message;
+	int MessageLen = 0;
+	int Res = 0;
+	int Seq = 0;
+	int i = 0;
+
+	while(1){
+		SessionMutex.lock();
+		if(SessionStop){
+			SessionMutex.unlock();
+			break;
+		}
+		SessionMutex.unlock();
+
+		// returns every SESSION_READ_SLICE at the latest so a stop is noticed
+		Res = post_api_session_recv(&Message, &MessageLen);
+		if(Res == 0){
+			continue;
+		}
+		if(Res == -1){
+			Poco::FastMutex::ScopedLock Lock(SessionMutex);
+			post_api_session_fail_locked();
+			break;
+		}
+
+		Seq = ParseRecvSeq(Message, MessageLen);
+		SessionMutex.lock();
+		for(i = 0; Seq != -1 && i < SESSION_MAX_PENDING; i ++){
+			if(SessionPending[i].InUse && SessionPending[i].Seq == Seq && SessionPending[i].Reply == NULL){
+				SessionPending[i].Reply = (char *)malloc(MessageLen);
+				if(SessionPending[i].Reply != NULL){
+					memcpy(SessionPending[i].Reply, Message, MessageLen);
+					SessionPending[i].ReplyLen = MessageLen;
+				}
+				SessionPendingDone[i].set();
+				break;
+			}
+		}
+		SessionMutex.unlock();
+		if(Seq != -1){
+			// a reply nobody waits for any more is dropped
+			continue;
+		}
+
+		Push = (SESSION_PUSH *)malloc(sizeof(SESSION_PUSH) + MessageLen);
+		if(Push == NULL){
+			continue;
+		}
+		Push->Body = (char *)(Push + 1);
+		Push->BodyLen = MessageLen;
+		memcpy(Push->Body, Message, MessageLen);
+		if(traffic_lane_post(TRAFFIC_LANE_CONTROL, post_api_session_cmd, Push) == -1){
+			post_api_session_cmd(NULL, Push);
+		}
+	}
+}
+
+int post_api_session_open(const char *IpAddress, u_short Port, int Transport){
+	Poco::FastMutex::ScopedLock Lock(SessionMutex);
+	int Res = -1;
+
+	if(ReaderThread != NULL){
+		return SessionOpen ? 0 : -1;
+	}
+
+	switch(Transport){
+	case SESSION_TRANSPORT_WEBSOCKET:
+		Res = ws_channel_open(&SessionWs, IpAddress, Port, WS_PATH, SESSION_READ_SLICE);
+		break;
+	case SESSION_TRANSPORT_BSON:
+		Res = bson_channel_open(&SessionBson, IpAddress, Port, SESSION_READ_SLICE);
+		break;
+	}
+	if(Res == -1){
+		printf("session to %s:%d failed, staying on http\n", IpAddress, (int)Port);
+		return -1;
+	}
+
+	SessionTransport = Transport;
+	memset(SessionIpAddress, 0x00, sizeof SessionIpAddress);
+	strncpy(SessionIpAddress, IpAddress, MARK_MAX_BUF - 1);
+	SessionPort = Port;
+	memset(SessionPending, 0x00, sizeof SessionPending);
+	SessionOpen = 1;
+	SessionStop = 0;
+
+	ReaderThread = new Poco::Thread();
+	ReaderThread->start(Reader);
+	return 0;
+}
+
+int post_api_session_close(){
+	SessionMutex.lock();
+	if(ReaderThread == NULL){
+		SessionMutex.unlock();
+		return 0;
+	}
+	SessionStop = 1;
+	post_api_session_fail_locked();
+	SessionMutex.unlock();
+
+	ReaderThread->join();
+	delete ReaderThread;
+	ReaderThread = NULL;
+
+	if(SessionTransport == SESSION_TRANSPORT_WEBSOCKET){
+		ws_channel_close(&SessionWs);
+	}
+	else{
+		bson_channel_close(&SessionBson);
+	}
+	return 0;
+}
+
+// Whether the session is up and, given an endpoint, whether it is that one;
+// uploads placed on another endpoint keep going there over HTTP.
+int post_api_session_active(const char *IpAddress, u_short Port){
+	Poco::FastMutex::ScopedLock Lock(SessionMutex);
+
+	if(!SessionOpen){
+		return 0;
+	}
+	if(IpAddress != NULL && (Port != SessionPort || strcmp(IpAddress, SessionIpAddress) != 0)){
+		return 0;
+	}
+	return 1;
+}
+
+// Sends HttpContent with a fresh seq without waiting for the reply. Returns
+// the slot to hand to post_api_session_wait, or -1 when nothing was sent.
+// SendBuffer is scratch for the encoding and free again on return.
+int post_api_session_send(char *SendBuffer, int SendBufferLen, uma::bson::Document &HttpContent){
+	int Index = -1;
+	int Seq = 0;
+	int Len = 0;
+	int i = 0;
+
+	SessionMutex.lock();
+	for(i = 0; SessionOpen && i < SESSION_MAX_PENDING; i ++){
+		if(!SessionPending[i].InUse){
+			Index = i;
+			break;
+		}
+	}
+	if(Index == -1){
+		SessionMutex.unlock();
+		return -1;
+	}
+	Seq = ++ SessionSeq;
+	memset(&SessionPending[Index], 0x00, sizeof SessionPending[Index]);
+	SessionPending[Index].InUse = 1;
+	SessionPending[Index].Seq = Seq;
+	SessionPendingDone[Index].reset();
+	SessionMutex.unlock();
+
+	HttpContent.set("seq", Seq);
+	Len = bson_write_document(HttpContent, SendBuffer, SendBufferLen);
+	if(Len == -1 || post_api_session_write(SendBuffer, Len) == -1){
+		Poco::FastMutex::ScopedLock Lock(SessionMutex);
+		if(Len != -1){
+			post_api_session_fail_locked();
+		}
+		SessionPending[Index].InUse = 0;
+		return -1;
+	}
+	return Index;
+}
+
+// Waits for the reply to a sent request and frees its slot. On success
+// *Reply is a malloc'd copy of the reply document for the caller to free.
+int post_api_session_wait(int Slot, char **Reply, int *ReplyLen){
+	unsigned long long Deadline = 0;
+	unsigned long long Now = 0;
+
+	*Reply = NULL;
+	*ReplyLen = 0;
+
+	if(Slot < 0 || Slot >= SESSION_MAX_PENDING){
+		return -1;
+	}
+
+	// in slices, control requests queued meanwhile run in between
+	Now = net_tick_ms();
+	Deadline = Now + REQUEST_TIMEOUT_FIRST_BYTE;
+	while(!SessionPendingDone[Slot].tryWait(traffic_lane_slice((int)(Deadline - Now)))){
+		Now = net_tick_ms();
+		if(Now >= Deadline){
+			break;
+		}
+		traffic_lane_yield();
+	}
+
+	Poco::FastMutex::ScopedLock Lock(SessionMutex);
+	*Reply = SessionPending[Slot].Reply;
+	*ReplyLen = SessionPending[Slot].ReplyLen;
+	SessionPending[Slot].InUse = 0;
+	SessionPending[Slot].Reply = NULL;
+	// a reply that came in after the wait gave up must not wake the next user
+	SessionPendingDone[Slot].reset();
+
+	return (*Reply == NULL) ? -1 : 0;
+}
+
+int post_api_session_request(char *SendBuffer, int SendBufferLen, uma::bson::Document &HttpContent, char **Reply, int *ReplyLen){
+	int Slot = 0;
+
+	*Reply = NULL;
+	*ReplyLen = 0;
+
+	Slot = post_api_session_send(SendBuffer, SendBufferLen, HttpContent);
+	if(Slot == -1){
+		return -1;
+	}
+	return post_api_session_wait(Slot, Reply, ReplyLen);
+}
+
+int post_api_session_login(char *SendBuffer, char *UserName, char *Password){
+	using std::string;
+
+	uma::bson::Document HttpContent;
+	char *Reply;
+	int ReplyLen = 0;
+
+	construct_http_content_base(HttpContent, POST_API_ACTION_LOGIN);
+	HttpContent.set("username", (string)UserName);
+	HttpContent.set("password", (string)Password);
+
+	if(post_api_session_request(SendBuffer, SEND_MAX_BUF, HttpContent, &Reply, &ReplyLen) == -1){
+		return -1;
+	}
+	ParseRecvBody(Reply, ReplyLen, POST_API_ACTION_LOGIN);
+	free(Reply);
+
+	return 0;
+}
+
+// Sends a batch without waiting for its acknowledgement, *Slot is what
+// post_api_session_upload_ack takes. Returns an UPLOAD_RESULT.
+int post_api_session_upload(char *SendBuffer, HTTP_UPLOAD_ITEM *Item, int ItemNum, int *Slot){
+	uma::bson::Document HttpContent;
+
+	*Slot = -1;
+	if(construct_http_content_batch(HttpContent, Item, ItemNum) == -1){
+		return UPLOAD_RESULT_LOCAL;
+	}
+
+	*Slot = post_api_session_send(SendBuffer, SEND_MAX_BUF, HttpContent);
+	return (*Slot == -1) ? UPLOAD_RESULT_FAILED : UPLOAD_RESULT_OK;
+}
+
+// Waits for a batch's acknowledgement and fills Result[i] with 0 for the
+// items the server acked and -1 for the rest. Returns an UPLOAD_RESULT for
+// the batch as a whole.
+int post_api_session_upload_ack(int Slot, int *Result, int ItemNum){
+	char *Reply;
+	int ReplyLen = 0;
+	int AckNum = 0;
+
+	if(post_api_session_wait(Slot, &Reply, &ReplyLen) == -1){
+		return post_api_session_active(NULL, 0) ? UPLOAD_RESULT_TIMEOUT : UPLOAD_RESULT_FAILED;
+	}
+	AckNum = ParseRecvBatch(Reply, ReplyLen, Result, ItemNum);
+	free(Reply);
+
+	return AckNum == -1 ? UPLOAD_RESULT_REJECTED : UPLOAD_RESULT_OK;
+}
\ No newline at end of file
@@ -0,0 +1,39 @@
+#ifndef __POST_API_SESSION__
+#define __POST_API_SESSION__
+
+#include "define.h"
+#include "http_request.h"
+#include "http_response.h"
+#include "ws_channel.h"
+#include "bson_channel.h"
+#include "traffic_lane.h"
+#include "upload_engine.h"
+
+#define SESSION_TRANSPORT_HTTP 0
+#define SESSION_TRANSPORT_WEBSOCKET 1
+#define SESSION_TRANSPORT_BSON 2
+
+typedef struct{
+	int InUse;
+	int Seq;
+	char *Reply;
+	int ReplyLen;
+}SESSION_PENDING;
+
+typedef struct{
+	char *Body;
+	int BodyLen;
+}SESSION_PUSH;
+
+int post_api_session_open(const char *IpAddress, u_short Port, int Transport);
+int post_api_session_close();
+int post_api_session_active(const char *IpAddress, u_short Port);
+
+int post_api_session_send(char *SendBuffer, int SendBufferLen, uma::bson::Document &HttpContent);
+int post_api_session_wait(int Slot, char **Reply, int *ReplyLen);
+int post_api_session_request(char *SendBuffer, int SendBufferLen, uma::bson::Document &HttpContent, char **Reply, int *ReplyLen);
+int post_api_session_login(char *SendBuffer, char *UserName, char *Password);
+int post_api_session_upload(char *SendBuffer, HTTP_UPLOAD_ITEM *Item, int ItemNum, int *Slot);
+int post_api_session_upload_ack(int Slot, int *Result, int ItemNum);
+
+#endif // __POST_API_SESSION__
\ No newline at end of file
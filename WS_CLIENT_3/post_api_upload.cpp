@@ -1,122 +1,198 @@
 #include "post_api_upload.h"
 
-int post_api_upload(const char *IpAddress, u_short Port, char *SendBuffer, char Command, char *Path, char *Folder){
-	FILE *PP;
-	
+static UPLOAD_ENGINE UploadEngine;
+static char *SendEmlPath = NULL;
+static char *UploadSendBuffer = NULL;
+static std::deque<UPLOAD_JOB> UploadResumeJobs;
+static UPLOAD_JOB UploadProbeJob[UPLOAD_PROBE_COUNT];
+static int UploadProbeNum = 0;
+static int UploadDedup = 0;
+static std::set<std::string> UploadDigestSeen;
+static std::vector<UPLOAD_JOB> UploadSessionJobs;
+static int UploadSessionBytes = 0;
+static int UploadSessionEndpoint = -1;
+static std::deque<std::pair<int, std::vector<UPLOAD_JOB> > > UploadSessionInFlight;
+
+int post_api_upload(char *SendBuffer, char Command, char *Path, char *Folder){
 	//char CurrentPath[FILE_NAME_LEN];
 	//int CurrentPathLen = 0;
 
-	char SendEml[EML_MAX_NUM][FILE_NAME_LEN];
-	int SendEmlNum;
+	char RetryQueueName[FILE_NAME_LEN];
+	char JournalName[FILE_NAME_LEN];
+	int Res = 0;
 	
 	//memset(CurrentPath, 0x00, sizeof CurrentPath);
 	//CurrentPathLen = get_current_path(CurrentPath);
 
-	memset(SendEml, 0x00, sizeof SendEml);
+	SendEmlPath = Path;
+	UploadSendBuffer = SendBuffer;
+
 	//SendEmlNum = load_already_send_eml(CurrentPath, SendEml);
-	SendEmlNum = load_already_send_eml(Path, SendEml);
-	PP = fopen(BakFile, "w");
-	fclose(PP);
+	if(load_already_send_eml(Path) == -1){
+		return -1;
+	}
+	// progress from here on is journaled; acks a crash left there go into
+	// the index now
+	memset(JournalName, 0x00, sizeof JournalName);
+	strcat(JournalName, Path);
+	strcat(JournalName, UploadJournalFileName);
+	if(upload_journal_open(JournalName) == -1){
+		sent_index_close();
+		return -1;
+	}
+
+	// retries left over from an earlier run come back from their own file
+	memset(RetryQueueName, 0x00, sizeof RetryQueueName);
+	strcat(RetryQueueName, Path);
+	strcat(RetryQueueName, RetryQueueFileName);
+	retry_queue_open(RetryQueueName);
 
 	switch(Command){
 	case 'a':
-		post_api_upload_send_file(Path, Folder, IpAddress, Port, SendBuffer, SendEml, SendEmlNum);
+		post_api_upload_send_file(Path, Folder, SendBuffer);
 		break;
 	case 'u':
-		post_api_upload_scan_file(Path, Folder, IpAddress, Port, SendBuffer, SendEml, SendEmlNum);
+	case 'm':
+		// the files opened above are closed below all the same
+		if(upload_engine_init(&UploadEngine, UPLOAD_ENGINE_INFLIGHT, post_api_upload_complete, Path) == -1){
+			Res = -1;
+			break;
+		}
+		upload_engine_set_batch(&UploadEngine, UPLOAD_BATCH_COUNT, UPLOAD_BATCH_BYTES);
+		upload_engine_set_pipeline(&UploadEngine, UPLOAD_PIPELINE_DEPTH);
+		UploadDedup = UPLOAD_DEDUP;
+		UploadProbeNum = 0;
+		UploadDigestSeen.clear();
+		// the watch goes up first, a file landing while the scan runs is
+		// caught by one or the other
+		if(Command == 'm' && dir_watch_start(Path, ".eml") == -1){
+			printf("watch: %s can not be watched\n", Path);
+			Command = 'u';
+		}
+		post_api_upload_scan_file(Path, Folder);
+		post_api_upload_probe_flush();
+		post_api_upload_session_flush();
+		upload_engine_flush(&UploadEngine);
+		post_api_upload_resume_flush();
+		if(Command == 'm'){
+			post_api_upload_watch_file(Folder);
+			dir_watch_stop();
+		}
+		post_api_upload_retry(1);
+		printf("upload window: %d\n", upload_engine_window(&UploadEngine));
+		printf("upload retries left: %d\n", retry_queue_size());
+		upload_engine_cleanup(&UploadEngine);
 		break;
 	default:
 		printf("h\n");
 		break;
 	}
+	retry_queue_close();
+	upload_journal_close();
+	sent_index_close();
 	//post_api_upload_scan_file(CurrentPath, IpAddress, Port, SendBuffer, SendEml, SendEmlNum);
 	
-	return 0;
+	return Res;
 }
 
-int post_api_upload_send_file(char *CurrentPath, char *Folder, const char *IpAddress, u_short Port, char *SendBuffer, char SendEml[][FILE_NAME_LEN], int SendEmlNum){
-	FILE *PP;
-	char FileName[FILE_NAME_LEN];
+int post_api_upload_send_file(char *CurrentPath, char *Folder, char *SendBuffer){
 	char FilePathAndFileName[FILE_NAME_LEN];
 	int Res;
 
-	PP = fopen(BakFile, "a+");
-	memset(FileName, 0x00, sizeof FileName);
-	strcpy(FileName, Folder);
-	fprintf(PP, "%s\n", FileName);
-	fclose(PP);
+	memset(FilePathAndFileName, 0x00, sizeof FilePathAndFileName);
+	strcat(FilePathAndFileName, CurrentPath);
+	strcat(FilePathAndFileName, Folder);
+	upload_journal_scan(FilePathAndFileName);
 
-	Res = find_in_send_eml(Folder, SendEml, SendEmlNum);
+	Res = find_in_send_eml(Folder);
 	if(Res == 1){
 		return Res;
 	}
 
-	memset(FilePathAndFileName, 0x00, sizeof FilePathAndFileName);
-	strcat(FilePathAndFileName, CurrentPath);
-	strcat(FilePathAndFileName, Folder);
-
-	Res = post_api_upload_connect(IpAddress, Port, SendBuffer, Folder, FilePathAndFileName, UPLOAD_TYPE_EMAIL);
+	Res = post_api_upload_connect(SendBuffer, Folder, FilePathAndFileName, UPLOAD_TYPE_EMAIL);
 	return Res;
 }
 
-int post_api_upload_scan_file(char *CurrentPath, char *Folder, const char *IpAddress, u_short Port, char *SendBuffer, char SendEml[][FILE_NAME_LEN], int SendEmlNum){
-	FILE *PP;
-	struct _finddata_t FindFile;
-	long FHandle;
-
-	char CurrentPath_1[FILE_NAME_LEN];
-	char CurrentPath_2[FILE_NAME_LEN];
-
-	char FileName[FILE_NAME_LEN];
+// The directory walk runs on DIR_SCAN_THREADS threads of its own while this
+// one takes the emails it finds and sends them on; a full queue holds the
+// walk back, a slow upload no longer holds it up.
+int post_api_upload_scan_file(char *CurrentPath, char *Folder){
 	char FilePathAndFileName[FILE_NAME_LEN];
+	const char *FileName;
+
+	UPLOAD_JOB Job;
 
-	int FileLen = 0;
 	int Res = 0;
 
-	memset(CurrentPath_1, 0x00, sizeof CurrentPath);
-	strcat(CurrentPath_1, CurrentPath);
-	strcat(CurrentPath_1, "\\*.*");
-
-	FHandle = _findfirst(CurrentPath_1, &FindFile);
-	do{
-		if((FindFile.attrib & _A_SUBDIR) && (FindFile.name[0] != '.')){
-			memset(CurrentPath_2, 0x00, sizeof CurrentPath_2);
-			sprintf(CurrentPath_2, "%s", CurrentPath);
-			strcat(CurrentPath_2, "\\");
-			strcat(CurrentPath_2, FindFile.name);
-			post_api_upload_scan_file(CurrentPath_2, Folder, IpAddress, Port, SendBuffer, SendEml, SendEmlNum);
+	if(dir_scan_start(CurrentPath, ".eml", DIR_SCAN_THREADS, DIR_SCAN_QUEUE) == -1){
+		return -1;
+	}
+
+	while(dir_scan_next(FilePathAndFileName) == 1){
+		FileName = get_file_name(FilePathAndFileName);
+		upload_journal_scan(FilePathAndFileName);
+
+		Res = find_in_send_eml(FileName);
+		if(Res == 1){
+			continue;
+		}
+
+		// the retry queue hands this one out when it is due
+		if(retry_queue_contains(FilePathAndFileName)){
+			continue;
 		}
-		else if(!(FindFile.attrib & _A_SUBDIR)){
-
-			FileLen = strlen(FindFile.name);
-			if(FileLen > 4 
-				&& FindFile.name[FileLen - 4] == '.'
-				&& FindFile.name[FileLen - 3] == 'e'
-				&& FindFile.name[FileLen - 2] == 'm'
-				&& FindFile.name[FileLen - 1] == 'l'){
-				
-				PP = fopen(BakFile, "a+");
-				memset(FileName, 0x00, sizeof FileName);
-				strcpy(FileName, FindFile.name);
-				fprintf(PP, "%s\n", FileName);
-				fclose(PP);
-
-				Res = find_in_send_eml(FindFile.name, SendEml, SendEmlNum);
-				if(Res == 1){
-					continue;
-				}
-
-				memset(FilePathAndFileName, 0x00, sizeof FilePathAndFileName);
-				strcat(FilePathAndFileName, CurrentPath);
-				strcat(FilePathAndFileName, EmlPath);
-				strcat(FilePathAndFileName, FindFile.name);
-
-				Res = post_api_upload_connect(IpAddress, Port, SendBuffer, Folder, FilePathAndFileName, UPLOAD_TYPE_EMAIL);
+
+		memset(&Job, 0x00, sizeof Job);
+		strcpy(Job.FilePath, Folder);
+		strcpy(Job.FilePathAndFileName, FilePathAndFileName);
+		Job.UploadType = UPLOAD_TYPE_EMAIL;
+
+		Res = post_api_upload_probe_add(&Job);
+	}
+
+	dir_scan_stop();
+	return 0;
+}
+
+// Watch mode: after the first pass only what the watchers report is looked
+// at, never the whole tree again. A file is taken once it has settled, and
+// again whenever it is written over; sendeml.txt is not asked, an unchanged
+// copy of something sent already goes up as a reference to it. Whatever is
+// gathered goes out as soon as no file is ready within DIR_WATCH_IDLE.
+int post_api_upload_watch_file(char *Folder){
+	char FilePathAndFileName[FILE_NAME_LEN];
+	UPLOAD_JOB Job;
+	int Gathered = 0;
+	int Res = 0;
+
+	while((Res = dir_watch_next(FilePathAndFileName, DIR_WATCH_IDLE)) != -1){
+		traffic_lane_yield();
+
+		if(Res == 0){
+			if(Gathered){
+				post_api_upload_probe_flush();
+				post_api_upload_session_flush();
+				upload_engine_flush(&UploadEngine);
+				post_api_upload_resume_flush();
+				Gathered = 0;
 			}
+			post_api_upload_retry(0);
+			continue;
 		}
-	}while(_findnext(FHandle, &FindFile) == 0);
-	_findclose(FHandle);
 
+		upload_journal_scan(FilePathAndFileName);
+
+		if(retry_queue_contains(FilePathAndFileName)){
+			continue;
+		}
+
+		memset(&Job, 0x00, sizeof Job);
+		strcpy(Job.FilePath, Folder);
+		strcpy(Job.FilePathAndFileName, FilePathAndFileName);
+		Job.UploadType = UPLOAD_TYPE_EMAIL;
+		post_api_upload_probe_add(&Job);
+		Gathered = 1;
+	}
 	return 0;
 }
 
@@ -179,80 +255,445 @@ int post_api_upload(const char *IpAddress, u_short Port, char *SendBuffer){
 }
 */
 
-int post_api_upload_connect(const char *IpAddress, u_short Port, char *SendBuffer, char *FilePath, char *FilePathAndFileName, int UPLOAD_TYPE){
-	WSADATA  Ws;
+static void post_api_upload_session_send();
+
+// Big files go through the resumable protocol on this thread once the engine
+// is done. Everything else, references included, goes to the engine, or in
+// batches over the persistent session when that is up and the email is
+// placed on the session's endpoint.
+int post_api_upload_submit(UPLOAD_JOB *Job){
+	struct stat FileStat;
+	char IpAddress[MARK_MAX_BUF];
+	u_short Port = 0;
+	int Endpoint = 0;
+	int Size = 0;
+
+	if(stat(Job->FilePathAndFileName, &FileStat) == 0){
+		Size = Job->Have ? 0 : (int)FileStat.st_size;
+		if(!Job->Have && FileStat.st_size > UPLOAD_RESUME_THRESHOLD){
+			UploadResumeJobs.push_back(*Job);
+			return 0;
+		}
+	}
+	else if(errno == EOVERFLOW && !Job->Have){
+		// past 2 GB on Windows, where only the resumable upload can take it
+		UploadResumeJobs.push_back(*Job);
+		return 0;
+	}
+
+	if(post_api_session_active(NULL, 0)){
+		Endpoint = endpoint_pick(Job->FilePath, IpAddress, &Port);
+		if(Endpoint != -1 && post_api_session_active(IpAddress, Port)){
+			if(!UploadSessionJobs.empty() && (UploadSessionBytes + Size > UPLOAD_BATCH_BYTES || (int)UploadSessionJobs.size() >= UPLOAD_BATCH_COUNT)){
+				post_api_upload_session_send();
+			}
+			UploadSessionJobs.push_back(*Job);
+			UploadSessionBytes += Size;
+			UploadSessionEndpoint = Endpoint;
+			return 0;
+		}
+	}
+	return upload_engine_submit(&UploadEngine, Job);
+}
+
+// Failures that say nothing about the endpoint itself do not count against it.
+static void post_api_upload_report(int Endpoint, int Result){
+	switch(Result){
+	case UPLOAD_RESULT_FAILED:
+	case UPLOAD_RESULT_TIMEOUT:
+	case UPLOAD_RESULT_CONNECT:
+	case UPLOAD_RESULT_SERVER:
+		endpoint_failure(Endpoint);
+		break;
+	case UPLOAD_RESULT_LOCAL:
+		break;
+	default:
+		endpoint_success(Endpoint);
+		break;
+	}
+}
+
+// Scanned emails wait here in groups until the server has been asked which
+// of their contents it stores already.
+int post_api_upload_probe_add(UPLOAD_JOB *Job){
+	if(!UploadDedup || upload_dedup_digest(Job->FilePathAndFileName, Job->Digest) == -1){
+		Job->Digest[0] = 0x00;
+		return post_api_upload_submit(Job);
+	}
+
+	UploadProbeJob[UploadProbeNum ++] = *Job;
+	if(UploadProbeNum == UPLOAD_PROBE_COUNT){
+		post_api_upload_probe_flush();
+	}
+	return 0;
+}
+
+int post_api_upload_probe_flush(){
+	char IpAddress[MARK_MAX_BUF];
+	u_short Port = 0;
+	int Endpoint = 0;
+	int Res = 0;
+	int i = 0;
+
+	if(UploadProbeNum == 0){
+		return 0;
+	}
+
+	// another copy of a message already on its way in this run needs no probe
+	for(i = 0; i < UploadProbeNum; i ++){
+		if(!UploadDigestSeen.insert(UploadProbeJob[i].Digest).second){
+			UploadProbeJob[i].Have = 1;
+		}
+	}
+
+	// a scan group shares its folder and so its endpoint
+	Endpoint = endpoint_pick(UploadProbeJob[0].FilePath, IpAddress, &Port);
+	Res = (Endpoint == -1) ? -1 : upload_dedup_probe(IpAddress, Port, UploadSendBuffer, SEND_MAX_BUF, UploadProbeJob, UploadProbeNum);
+	post_api_upload_report(Endpoint, Res == -1 ? UPLOAD_RESULT_FAILED : UPLOAD_RESULT_OK);
+	if(Res == UPLOAD_DEDUP_UNSUPPORTED){
+		// the server would not understand references either
+		UploadDedup = 0;
+		for(i = 0; i < UploadProbeNum; i ++){
+			UploadProbeJob[i].Digest[0] = 0x00;
+			UploadProbeJob[i].Have = 0;
+		}
+	}
+
+	for(i = 0; i < UploadProbeNum; i ++){
+		post_api_upload_submit(&UploadProbeJob[i]);
+	}
+	UploadProbeNum = 0;
+	return 0;
+}
+
+int post_api_upload_resume_flush(){
+	UPLOAD_JOB Job;
+	char IpAddress[MARK_MAX_BUF];
+	u_short Port = 0;
+	int Endpoint = 0;
+	int Result = 0;
+
+	while(!UploadResumeJobs.empty()){
+		Job = UploadResumeJobs.front();
+		UploadResumeJobs.pop_front();
+
+		Endpoint = endpoint_pick(Job.FilePath, IpAddress, &Port);
+		Result = (Endpoint == -1) ? UPLOAD_RESULT_CONNECT : upload_resume_file(IpAddress, Port, UploadSendBuffer, SEND_MAX_BUF, Job.FilePath, Job.FilePathAndFileName, Job.UploadType);
+		post_api_upload_report(Endpoint, Result);
+		post_api_upload_complete(&Job, Result, NULL, 0, SendEmlPath);
+	}
+	return 0;
+}
+
+// Settles the oldest batch on the session the way the engine settles a batch.
+static void post_api_upload_session_settle(){
+	int Ack[UPLOAD_BATCH_MAX_COUNT];
+	int Slot = UploadSessionInFlight.front().first;
+	std::vector<UPLOAD_JOB> Job;
+	int Result = 0;
+	int i = 0;
+
+	Job.swap(UploadSessionInFlight.front().second);
+	UploadSessionInFlight.pop_front();
+
+	Result = post_api_session_upload_ack(Slot, Ack, (int)Job.size());
+	post_api_upload_report(UploadSessionEndpoint, Result);
+	for(i = 0; i < (int)Job.size(); i ++){
+		post_api_upload_complete(&Job[i], (Result == UPLOAD_RESULT_OK && Ack[i] != 0) ? UPLOAD_RESULT_REJECTED : Result, NULL, 0, SendEmlPath);
+	}
+}
+
+// Sends the batch gathered for the session. Up to SESSION_PIPELINE_DEPTH
+// batches stay unacknowledged on the connection; past that the oldest is
+// waited for first.
+static void post_api_upload_session_send(){
+	HTTP_UPLOAD_ITEM Item[UPLOAD_BATCH_MAX_COUNT];
+	int ItemNum = (int)UploadSessionJobs.size();
+	int Result = 0;
+	int Slot = -1;
+	int i = 0;
+
+	if(ItemNum == 0){
+		return;
+	}
+
+	while((int)UploadSessionInFlight.size() >= SESSION_PIPELINE_DEPTH){
+		post_api_upload_session_settle();
+	}
+
+	for(i = 0; i < ItemNum; i ++){
+		Item[i].FilePath = UploadSessionJobs[i].FilePath;
+		Item[i].FilePathAndFileName = UploadSessionJobs[i].FilePathAndFileName;
+		Item[i].Digest = UploadSessionJobs[i].Digest;
+		Item[i].Have = UploadSessionJobs[i].Have;
+	}
+
+	Result = post_api_session_upload(UploadSendBuffer, Item, ItemNum, &Slot);
+	if(Result == UPLOAD_RESULT_OK){
+		UploadSessionInFlight.push_back(std::make_pair(Slot, std::vector<UPLOAD_JOB>()));
+		UploadSessionInFlight.back().second.swap(UploadSessionJobs);
+	}
+	else{
+		post_api_upload_report(UploadSessionEndpoint, Result);
+		for(i = 0; i < ItemNum; i ++){
+			post_api_upload_complete(&UploadSessionJobs[i], Result, NULL, 0, SendEmlPath);
+		}
+	}
+
+	UploadSessionJobs.clear();
+	UploadSessionBytes = 0;
+}
+
+// sends what is gathered and waits until every batch on the session is acked
+int post_api_upload_session_flush(){
+	post_api_upload_session_send();
+	while(!UploadSessionInFlight.empty()){
+		post_api_upload_session_settle();
+	}
+	return 0;
+}
+
+int post_api_upload_connect(char *SendBuffer, char *FilePath, char *FilePathAndFileName, int UPLOAD_TYPE){
 	SOCKET ClientSocket;
-	HANDLE hThread = NULL;
-	struct sockaddr_in ServerAddr;
-	int AddrLen = 0;
+	UPLOAD_JOB Job;
+	struct stat FileStat;
+	char IpAddress[MARK_MAX_BUF];
+	u_short Port = 0;
+	int Endpoint = 0;
+	int PoolRes = 0;
+	int Error = 0;
 	int Ret = 0;
-	
-	if(WSAStartup(MAKEWORD(2, 2), &Ws) != 0){
-		return -1;
-	}
 
-	ClientSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-	if(ClientSocket == INVALID_SOCKET){
+	memset(&Job, 0x00, sizeof Job);
+	strcpy(Job.FilePath, FilePath);
+	strcpy(Job.FilePathAndFileName, FilePathAndFileName);
+	Job.UploadType = UPLOAD_TYPE;
+
+	Endpoint = endpoint_pick(FilePath, IpAddress, &Port);
+	if(Endpoint == -1){
+		post_api_upload_complete(&Job, UPLOAD_RESULT_CONNECT, NULL, 0, SendEmlPath);
 		return -1;
 	}
 
-	ServerAddr.sin_family = AF_INET;
-	ServerAddr.sin_addr.s_addr = inet_addr(IpAddress);
-	ServerAddr.sin_port = htons(Port);
-	memset(ServerAddr.sin_zero, 0x00, 8);
+	if(stat(FilePathAndFileName, &FileStat) == -1 ? errno == EOVERFLOW : FileStat.st_size > UPLOAD_RESUME_THRESHOLD){
+		Ret = upload_resume_file(IpAddress, Port, SendBuffer, SEND_MAX_BUF, FilePath, FilePathAndFileName, UPLOAD_TYPE);
+		post_api_upload_report(Endpoint, Ret);
+		post_api_upload_complete(&Job, Ret, NULL, 0, SendEmlPath);
+		return Ret == UPLOAD_RESULT_OK ? 0 : -1;
+	}
 
-	Ret = connect(ClientSocket, (struct sockaddr *)&ServerAddr, sizeof(ServerAddr));
-	if(Ret == SOCKET_ERROR){
+	PoolRes = conn_pool_acquire(IpAddress, Port, 0, &ClientSocket);
+	if(PoolRes == -1){
+		endpoint_failure(Endpoint);
+		post_api_upload_complete(&Job, UPLOAD_RESULT_CONNECT, NULL, 0, SendEmlPath);
 		return -1;
 	}
 
 	Ret = post_api_upload_communcation(ClientSocket, IpAddress, Port, SendBuffer, FilePath, FilePathAndFileName, UPLOAD_TYPE);
+	if(Ret == -1 && PoolRes == CONN_POOL_REUSED){
+		// the server may have dropped the idle connection after our health check
+		conn_pool_release(IpAddress, Port, ClientSocket, 0);
+		if(conn_pool_acquire(IpAddress, Port, 0, &ClientSocket) == -1){
+			endpoint_failure(Endpoint);
+			post_api_upload_complete(&Job, UPLOAD_RESULT_CONNECT, NULL, 0, SendEmlPath);
+			return -1;
+		}
+		Ret = post_api_upload_communcation(ClientSocket, IpAddress, Port, SendBuffer, FilePath, FilePathAndFileName, UPLOAD_TYPE);
+	}
+
+	// taken before the release, closing the socket may set another one
+	Error = net_last_error();
+	conn_pool_release(IpAddress, Port, ClientSocket, Ret == 1);
+	if(Ret == UPLOAD_RESULT_LOCAL){
+		// the file could not be read, no retry will change that
+		post_api_upload_complete(&Job, UPLOAD_RESULT_LOCAL, NULL, 0, SendEmlPath);
+		return -1;
+	}
 	if(Ret == -1){
+		endpoint_failure(Endpoint);
+		// the reply never made it back; the server may or may not have the file
+		post_api_upload_complete(&Job, net_would_block(Error) ? UPLOAD_RESULT_TIMEOUT : UPLOAD_RESULT_FAILED, NULL, 0, SendEmlPath);
 		return -1;
 	}
 
-	closesocket(ClientSocket);
-	WSACleanup();
+	endpoint_success(Endpoint);
 	return 0;
 }
 
+// Returns whether the connection may be kept, -1 when the exchange failed
+// and UPLOAD_RESULT_LOCAL when the request could not even be made.
 int post_api_upload_communcation(SOCKET ClientSocket, const char *IpAddress, u_short Port, char *SendBuffer, char *FilePath, char *FilePathAndFileName, int UPLOAD_TYPE){
 	//char *SendBuffer, *RecvBuffer;
-	char RecvBuffer[SOCKET_MAX_BUF];
-	int SendRes = 0, RecvRes = 0;
-	int SendLen = 0, RecvLen = 0;
-	int RecvBufferIsEmpty = 0;
-	int ParseRes = 0;
+	HTTP_REQUEST Request;
+	HTTP_RESPONSE Response;
+	HTTP_STREAM Stream;
+	struct stat FileStat;
+	unsigned long long WaitMs = 0;
+	int SendRes = 0;
+	int SendLen = 0;
+	int StreamRes = 0;
+	int KeepAlive = 0;
+	int Result = 0;
+
+	UPLOAD_JOB Job;
+
+	memset(&Job, 0x00, sizeof Job);
+	strcpy(Job.FilePath, FilePath);
+	strcpy(Job.FilePathAndFileName, FilePathAndFileName);
+	Job.UploadType = UPLOAD_TYPE;
+
+	if(stat(FilePathAndFileName, &FileStat) == -1){
+		return UPLOAD_RESULT_LOCAL;
+	}
+
+	while(rate_limit_request(&WaitMs) == 0){
+		traffic_lane_sleep((int)WaitMs);
+	}
+
+	// big files go out as chunks read through SendBuffer one block at a time,
+	// or straight from the page cache where the socket can send from a file
+	if(FileStat.st_size > UPLOAD_STREAM_THRESHOLD){
+		SendLen = http_stream_open(&Stream, IpAddress, Port, &Request, SendBuffer, UPLOAD_STREAM_BLOCK, FilePath, FilePathAndFileName);
+		if(SendLen == -1){
+			return UPLOAD_RESULT_LOCAL;
+		}
 
-	SendLen = construct_http(IpAddress, Port, POST_API_ACTION_INIT, SendBuffer, NULL, NULL, FilePath, FilePathAndFileName, UPLOAD_TYPE);
+		do{
+			SendRes = net_send_segments_all(ClientSocket, Request.Segment, Request.SegmentNum);
+			if(SendRes == -1){
+				http_stream_close(&Stream);
+				return -1;
+			}
+			traffic_lane_yield();
+			StreamRes = http_stream_next(&Stream, &Request);
+		}while(StreamRes == 1);
+
+		http_stream_close(&Stream);
+		if(StreamRes == -1){
+			return UPLOAD_RESULT_LOCAL;
+		}
+	}
+	else{
+		SendLen = construct_http(IpAddress, Port, POST_API_ACTION_UPLOAD, &Request, SendBuffer, SEND_MAX_BUF, NULL, NULL, FilePath, FilePathAndFileName, UPLOAD_TYPE);
+		if(SendLen == -1){
+			return UPLOAD_RESULT_LOCAL;
+		}
+
+		SendRes = net_send_segments_all(ClientSocket, Request.Segment, Request.SegmentNum);
+		if(SendRes == -1){
+			return -1;
+		}
+	}
+
+	if(http_response_init(&Response) == -1){
+		return UPLOAD_RESULT_LOCAL;
+	}
 
-	SendRes = send(ClientSocket, SendBuffer, SendLen, 0);
-	if(SendRes == SOCKET_ERROR){
+	// control requests go ahead while the server takes its time
+	if(traffic_lane_wait_readable(ClientSocket, REQUEST_TIMEOUT_FIRST_BYTE) != 1){
+		http_response_free(&Response);
+		return -1;
+	}
+	KeepAlive = http_response_recv(ClientSocket, &Response);
+	if(KeepAlive == -1){
+		http_response_free(&Response);
 		return -1;
 	}
 
-	memset(RecvBuffer, 0x00, sizeof RecvBuffer);
+	Result = upload_engine_status(Response.Parser.StatusCode);
+	if(Result == UPLOAD_RESULT_OK && ParseRecvError(Response.Buffer + Response.Parser.BodyStart, Response.Parser.BodyLen) != 0){
+		Result = UPLOAD_RESULT_REJECTED;
+	}
 
-	while(1){
-		RecvRes = recv(ClientSocket, RecvBuffer, SOCKET_MAX_BUF, 0);
-		if(RecvRes == 0 || RecvRes == SOCKET_ERROR){
-			break;
-		}
+	post_api_upload_complete(&Job, Result, Response.Buffer + Response.Parser.BodyStart, Response.Parser.BodyLen, SendEmlPath);
+	http_response_free(&Response);
+
+	return KeepAlive; 
+}
+
+static int post_api_upload_retry_class(int Result){
+	switch(Result){
+	case UPLOAD_RESULT_FAILED:
+	case UPLOAD_RESULT_CONNECT:
+		return RETRY_CLASS_CONNECT;
+	case UPLOAD_RESULT_TIMEOUT:
+		return RETRY_CLASS_TIMEOUT;
+	case UPLOAD_RESULT_SERVER:
+		return RETRY_CLASS_SERVER;
+	case UPLOAD_RESULT_REJECTED:
+		return RETRY_CLASS_ERROR;
+	}
+	return RETRY_CLASS_NONE;
+}
+
+// Completion callback shared by the event-loop engine and the blocking path.
+// A file only goes into the sent list once the server has answered for it;
+// a failure worth retrying goes into the retry queue instead.
+void post_api_upload_complete(UPLOAD_JOB *Job, int Result, const char *Body, int BodyLen, void *CallbackArg){
+	int ParseRes = 0;
 
-		if((int)strlen(RecvBuffer) != 0){
-			RecvBufferIsEmpty = 0;
+	if(Result != UPLOAD_RESULT_OK){
+		// the new entry is on disk before the old one is dropped, so a crash
+		// in between retries the file twice rather than never
+		if(retry_queue_add(post_api_upload_retry_class(Result), Job->Attempts + 1, Job->RetryDelay, Job->FilePath, Job->FilePathAndFileName, Job->UploadType) == -1){
+			printf("upload failed: %s (%d)\n", Job->FilePathAndFileName, Result);
 		}
+		if(Job->RetryId != 0){
+			retry_queue_done(Job->RetryId);
+		}
+		return;
+	}
 
-		if(RecvBufferIsEmpty == 0){
-			ParseRes = ParseRecvBuffer(RecvBuffer, RecvRes, POST_API_ACTION_UPLOAD);
-			if(ParseRes != -1){
-				// undo
-			}
+	if(Job->RetryId != 0){
+		retry_queue_done(Job->RetryId);
+	}
+
+	// items of a batch come without a body, the engine already checked their ack
+	if(Body != NULL){
+		ParseRes = ParseRecvBody(Body, BodyLen, POST_API_ACTION_UPLOAD);
+		if(ParseRes == -1){
+			return;
 		}
 	}
 
-	//undo
-	return 1; 
+	if(CallbackArg != NULL){
+		add_to_send_eml(get_file_name(Job->FilePathAndFileName));
+	}
+}
+
+// Hands the retries that are due to the engine. With Drain set it keeps at it
+// until none is left, waiting for the ones due soon; anything further out
+// stays in the queue for the next run.
+int post_api_upload_retry(int Drain){
+	RETRY_ENTRY Entry;
+	UPLOAD_JOB Job;
+	int WaitMs = 0;
+
+	while(1){
+		while(retry_queue_next(&Entry) == 1){
+			memset(&Job, 0x00, sizeof Job);
+			strcpy(Job.FilePath, Entry.FilePath);
+			strcpy(Job.FilePathAndFileName, Entry.FilePathAndFileName);
+			Job.UploadType = Entry.UploadType;
+			Job.Attempts = Entry.Attempts;
+			Job.RetryId = Entry.Id;
+			Job.RetryDelay = Entry.Delay;
+			post_api_upload_submit(&Job);
+		}
+		if(!Drain){
+			return 0;
+		}
+
+		// retries in flight may fail again and queue up once more
+		post_api_upload_session_flush();
+		upload_engine_flush(&UploadEngine);
+		post_api_upload_resume_flush();
+		WaitMs = retry_queue_wait();
+		if(WaitMs == -1 || WaitMs > RETRY_DRAIN_MAX_WAIT){
+			return 0;
+		}
+		traffic_lane_sleep(WaitMs);
+	}
 }
 
 int get_current_path(char *CurrentPath){
@@ -274,68 +715,40 @@ int get_find_file_class(char *CurrentPath, char *FindFileClass){
 	return len;
 }
 
-int load_already_send_eml(char *Path, char SendEml[][FILE_NAME_LEN]){
-	FILE * PFile = NULL;
+// The emails sent already are looked up in a hashed index beside
+// sendeml.txt; the list itself is only read to fill a new index.
+int load_already_send_eml(char *Path){
 	char SendEmlName[FILE_NAME_LEN];
-	int SendEmlNum = 0;
-
-	int i = 0;
+	char SentIndexName[FILE_NAME_LEN];
 
 	memset(SendEmlName, 0x00, sizeof SendEmlName);
+	memset(SentIndexName, 0x00, sizeof SentIndexName);
 
 	strcat(SendEmlName, Path);
 	strcat(SendEmlName, SendEmlFileName);
+	strcat(SentIndexName, Path);
+	strcat(SentIndexName, SendEmlIndexFileName);
 
-	PFile = fopen(SendEmlName, "r");
-	if(PFile == NULL){
-		PFile = fopen(SendEmlName, "w");
-		fclose(PFile);
-	}
-	else{
-		SendEmlNum = 0;
-		while(fgets(SendEml[SendEmlNum], FILE_NAME_LEN, PFile)){
-			for(i = 0; i < strlen(SendEml[SendEmlNum]); i ++){
-				if(SendEml[SendEmlNum][i] >= 'A' && SendEml[SendEmlNum][i] <= 'Z'){
-					SendEml[SendEmlNum][i] = SendEml[SendEmlNum][i] - 'A' + 'a';
-				}
-			}
-			SendEml[SendEmlNum][i - 1] = 0;
-			SendEmlNum ++;
-		}
-
-		qsort(SendEml, SendEmlNum, sizeof SendEml[0], StringCmp);
-
-	}
-	return 0;
+	return sent_index_open(SentIndexName, SendEmlName);
 }
 
-int find_in_send_eml(char *FileName, char SendEml[][FILE_NAME_LEN], int SendEmlNum){
-	char TempString[FILE_NAME_LEN];
-
-	int Res = 0;
-	int i = 0;
+// an ack is in the journal until the next compaction moves it to the index
+int find_in_send_eml(const char *FileName){
+	return sent_index_contains(FileName) || upload_journal_acked(FileName);
+}
 
-	memset(TempString, 0x00, sizeof TempString);
-	strcpy(TempString, FileName);
+int add_to_send_eml(const char *FileName){
+	return upload_journal_ack(FileName);
+}
 
-	for(i = 0; i < strlen(TempString); i ++){
-		if(TempString[i] >= 'A' && TempString[i] <= 'Z'){
-			TempString[i] = TempString[i] - 'A' + 'a';
-		}
-	}
+const char *get_file_name(const char *FilePathAndFileName){
+	const char *FileName = FilePathAndFileName;
+	const char *Pos = NULL;
 
-	for(int i = 0; i < SendEmlNum; i ++){
-		if(strcmp(SendEml[i], TempString) == 0){
-			Res = 1;
-			break;
+	for(Pos = FilePathAndFileName; *Pos; Pos ++){
+		if(*Pos == '\\' || *Pos == '/'){
+			FileName = Pos + 1;
 		}
 	}
-
-	return Res;
-}
-
-int StringCmp(const void *a, const void *b){
-	int result = 0;
-	result = strcmp((char *)a, (char *)b);
-	return result;
+	return FileName;
 }
\ No newline at end of file
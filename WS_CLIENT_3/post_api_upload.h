@@ -4,24 +4,48 @@
 #include "define.h"
 #include "http_request.h"
 #include "http_response.h"
+#include "conn_pool.h"
+#include "upload_engine.h"
+#include "retry_queue.h"
+#include "upload_resume.h"
+#include "upload_dedup.h"
+#include "post_api_session.h"
+#include "dir_scan.h"
+#include "dir_watch.h"
+#include "sent_index.h"
+#include "upload_journal.h"
+
+#include <deque>
+#include <set>
+#include <vector>
 
 const char SendEmlFileName[] = "\\sendeml.txt";
+const char SendEmlIndexFileName[] = "\\sendeml.idx";
 const char EmlPath[] = "\\eml\\";
 const char EmlSuffix[] = "*.eml";
-const char BakFile[] = "copy.txt";
+const char UploadJournalFileName[] = "\\upload.jnl";
+const char RetryQueueFileName[] = "\\retry.dat";
 
-int post_api_upload(const char *IpAddress, u_short Port, char *SendBuffer, char Command, char *Path, char *Folder);
-int post_api_upload_send_file(char *CurrentPath, char *Folder, const char *IpAddress, u_short Port, char *SendBuffer, char SendEml[][FILE_NAME_LEN], int SendEmlNum);
-int post_api_upload_scan_file(char *CurrentPath, char *Folder, const char *IpAddress, u_short Port, char *SendBuffer, char SendEml[][FILE_NAME_LEN], int SendEmlNum);
-int post_api_upload_connect(const char *IpAddress, u_short Port, char *SendBuffer, char *FilePath, char *FilePathAndFileName, int UPLOAD_TYPE);
+int post_api_upload(char *SendBuffer, char Command, char *Path, char *Folder);
+int post_api_upload_send_file(char *CurrentPath, char *Folder, char *SendBuffer);
+int post_api_upload_scan_file(char *CurrentPath, char *Folder);
+int post_api_upload_watch_file(char *Folder);
+int post_api_upload_connect(char *SendBuffer, char *FilePath, char *FilePathAndFileName, int UPLOAD_TYPE);
 int post_api_upload_communcation(SOCKET ClientSocket, const char *IpAddress, u_short Port, char *SendBuffer, char *FilePath, char *FilePathAndFileName, int UPLOAD_TYPE);
+void post_api_upload_complete(UPLOAD_JOB *Job, int Result, const char *Body, int BodyLen, void *CallbackArg);
+int post_api_upload_submit(UPLOAD_JOB *Job);
+int post_api_upload_probe_add(UPLOAD_JOB *Job);
+int post_api_upload_probe_flush();
+int post_api_upload_resume_flush();
+int post_api_upload_session_flush();
+int post_api_upload_retry(int Drain);
 
 int get_current_path(char *CurrentPath);
 int get_find_file_class(char *CurrentPath, char *FindFileClass);
 
-int load_already_send_eml(char *Path, char SendEml[][FILE_NAME_LEN]);
-int find_in_send_eml(char *FileName, char SendEml[][FILE_NAME_LEN], int SendEmlNum);
-
-int StringCmp(const void *a, const void *b);
+int load_already_send_eml(char *Path);
+int find_in_send_eml(const char *FileName);
+int add_to_send_eml(const char *FileName);
+const char *get_file_name(const char *FilePathAndFileName);
 
 #endif // __POST_API_UPLOAD__
\ No newline at end of file
@@ -0,0 +1,88 @@
+#include "rate_limit.h"
+
+#include <Poco/Mutex.h>
+
+static RATE_BUCKET RateLimitBytes;
+static RATE_BUCKET RateLimitRequests;
+static Poco::FastMutex RateLimitMutex;
+
+static void rate_bucket_init(RATE_BUCKET *Bucket, int Rate, int Burst){
+	Bucket->Rate = Rate;
+	Bucket->Burst = (Burst > 0) ? Burst : (Rate > 0 ? Rate : 1);
+	Bucket->Tokens = Bucket->Burst;
+	Bucket->Last = net_tick_us();
+}
+
+// Hands out up to Want tokens, but waits for at least Need of them so a
+// nearly empty bucket does not turn into a stream of tiny sends. The clock
+// is only read when the tokens already in the bucket do not cover Want, so
+// traffic under the limit costs a compare and a subtraction.
+static int rate_bucket_take(RATE_BUCKET *Bucket, int Want, int Need, unsigned long long *WaitMs){
+	unsigned long long Now;
+	int Granted = 0;
+
+	*WaitMs = 0;
+
+	if(Bucket->Rate <= 0 || Want <= 0){
+		return Want;
+	}
+	if(Bucket->Tokens >= Want){
+		Bucket->Tokens -= Want;
+		return Want;
+	}
+
+	Now = net_tick_us();
+	Bucket->Tokens += Bucket->Rate * (double)(Now - Bucket->Last) / 1000000;
+	Bucket->Last = Now;
+	if(Bucket->Tokens > Bucket->Burst){
+		Bucket->Tokens = Bucket->Burst;
+	}
+
+	if(Need > Bucket->Burst){
+		Need = (int)Bucket->Burst;
+	}
+	if(Need > Want){
+		Need = Want;
+	}
+	if(Bucket->Tokens < Need){
+		*WaitMs = (unsigned long long)((Need - Bucket->Tokens) * 1000 / Bucket->Rate) + 1;
+		return 0;
+	}
+
+	Granted = (Bucket->Tokens >= Want) ? Want : (int)Bucket->Tokens;
+	Bucket->Tokens -= Granted;
+	return Granted;
+}
+
+// A rate of 0 leaves that limit off. A burst of 0 allows one second's worth.
+int rate_limit_init(int BytesPerSecond, int ByteBurst, int RequestsPerSecond, int RequestBurst){
+	Poco::FastMutex::ScopedLock Lock(RateLimitMutex);
+
+	rate_bucket_init(&RateLimitBytes, BytesPerSecond, ByteBurst);
+	rate_bucket_init(&RateLimitRequests, RequestsPerSecond, RequestBurst);
+	return 0;
+}
+
+// Returns 1 when a request may start now, otherwise 0 and how long to wait.
+int rate_limit_request(unsigned long long *WaitMs){
+	Poco::FastMutex::ScopedLock Lock(RateLimitMutex);
+
+	return rate_bucket_take(&RateLimitRequests, 1, 1, WaitMs);
+}
+
+// Returns how many of Want bytes may be sent now, 0 with WaitMs set when
+// none. Whatever the send did not take must be given back with
+// rate_limit_refund.
+int rate_limit_bytes(int Want, unsigned long long *WaitMs){
+	Poco::FastMutex::ScopedLock Lock(RateLimitMutex);
+
+	return rate_bucket_take(&RateLimitBytes, Want, RATE_LIMIT_QUANTUM, WaitMs);
+}
+
+void rate_limit_refund(int Bytes){
+	Poco::FastMutex::ScopedLock Lock(RateLimitMutex);
+
+	if(RateLimitBytes.Rate > 0 && Bytes > 0){
+		RateLimitBytes.Tokens += Bytes;
+	}
+}
\ No newline at end of file
@@ -0,0 +1,20 @@
+#ifndef __RATE_LIMIT__
+#define __RATE_LIMIT__
+
+#include "define.h"
+#include "net_socket.h"
+
+typedef struct{
+	double Rate;
+	double Burst;
+	double Tokens;
+	unsigned long long Last;
+}RATE_BUCKET;
+
+int rate_limit_init(int BytesPerSecond, int ByteBurst, int RequestsPerSecond, int RequestBurst);
+
+int rate_limit_request(unsigned long long *WaitMs);
+int rate_limit_bytes(int Want, unsigned long long *WaitMs);
+void rate_limit_refund(int Bytes);
+
+#endif // __RATE_LIMIT__
\ No newline at end of file
@@ -0,0 +1,428 @@
+#include "retry_queue.h"
+
+#include <Poco/Mutex.h>
+
+// Failed uploads wait here for their next attempt. The queue lives in memory
+// and in an append-only file of add and done records, so a restart picks the
+// retries up again without rescanning the tree. The file is rewritten with
+// only the live entries when it is opened and whenever done records pile up.
+//
+// Record: u8 type, u32 id, and for an add: u8 class, u8 attempts,
+// u16 upload type, u32 delay, u64 due, u16 folder length, u16 file length,
+// folder, file.
+
+static std::map<unsigned int, RETRY_ENTRY> *RetryLive = NULL;
+static std::multimap<unsigned long long, unsigned int> *RetrySchedule = NULL;
+static std::map<std::string, unsigned int> *RetryPath = NULL;
+static FILE *RetryFile = NULL;
+static char RetryFileName[FILE_NAME_LEN];
+static unsigned int RetryNextId = 1;
+static int RetryDoneNum = 0;
+static unsigned long long RetrySeed = 0;
+static Poco::FastMutex RetryMutex;
+
+static const char RetryMagic[4] = {'R', 'T', 'Q', '1'};
+
+// wall clock, since a due time has to survive a restart
+static unsigned long long retry_now_ms(){
+	return (unsigned long long)time(NULL) * 1000;
+}
+
+static unsigned int retry_random(){
+	RetrySeed ^= RetrySeed << 13;
+	RetrySeed ^= RetrySeed >> 7;
+	RetrySeed ^= RetrySeed << 17;
+	return (unsigned int)(RetrySeed >> 32);
+}
+
+static int retry_base_delay(int Class){
+	switch(Class){
+	case RETRY_CLASS_CONNECT:
+		return RETRY_BASE_CONNECT;
+	case RETRY_CLASS_TIMEOUT:
+		return RETRY_BASE_TIMEOUT;
+	case RETRY_CLASS_SERVER:
+		return RETRY_BASE_SERVER;
+	case RETRY_CLASS_ERROR:
+		return RETRY_BASE_ERROR;
+	}
+	return -1;
+}
+
+// decorrelated jitter: uniform between the base and three times the last wait
+static int retry_next_delay(int Class, int PrevDelay){
+	int Base = retry_base_delay(Class);
+	int Upper = 0;
+
+	if(PrevDelay < Base){
+		PrevDelay = Base;
+	}
+	Upper = (PrevDelay > RETRY_MAX_DELAY / 3) ? RETRY_MAX_DELAY : PrevDelay * 3;
+	if(Upper <= Base){
+		return Base;
+	}
+	return Base + (int)(retry_random() % (unsigned int)(Upper - Base + 1));
+}
+
+static int retry_write_add(FILE *PFile, const RETRY_ENTRY *Entry){
+	unsigned char Type = RETRY_RECORD_ADD;
+	unsigned char Class = (unsigned char)Entry->Class;
+	unsigned char Attempts = (unsigned char)Entry->Attempts;
+	unsigned short UploadType = (unsigned short)Entry->UploadType;
+	unsigned short FolderLen = (unsigned short)strlen(Entry->FilePath);
+	unsigned short FileLen = (unsigned short)strlen(Entry->FilePathAndFileName);
+	unsigned int Delay = (unsigned int)Entry->Delay;
+
+	fwrite(&Type, 1, 1, PFile);
+	fwrite(&Entry->Id, 4, 1, PFile);
+	fwrite(&Class, 1, 1, PFile);
+	fwrite(&Attempts, 1, 1, PFile);
+	fwrite(&UploadType, 2, 1, PFile);
+	fwrite(&Delay, 4, 1, PFile);
+	fwrite(&Entry->Due, 8, 1, PFile);
+	fwrite(&FolderLen, 2, 1, PFile);
+	fwrite(&FileLen, 2, 1, PFile);
+	fwrite(Entry->FilePath, 1, FolderLen, PFile);
+	if(fwrite(Entry->FilePathAndFileName, 1, FileLen, PFile) != FileLen){
+		return -1;
+	}
+	return 0;
+}
+
+static int retry_write_done(FILE *PFile, unsigned int Id){
+	unsigned char Type = RETRY_RECORD_DONE;
+
+	fwrite(&Type, 1, 1, PFile);
+	if(fwrite(&Id, 4, 1, PFile) != 1){
+		return -1;
+	}
+	return 0;
+}
+
+// Returns 1 with Entry filled for an add, 2 with only Id for a done, 0 at a
+// clean end of file and -1 on a torn or damaged record.
+static int retry_read_record(FILE *PFile, RETRY_ENTRY *Entry){
+	unsigned char Type = 0;
+	unsigned char Class = 0;
+	unsigned char Attempts = 0;
+	unsigned short UploadType = 0;
+	unsigned short FolderLen = 0;
+	unsigned short FileLen = 0;
+	unsigned int Delay = 0;
+
+	if(fread(&Type, 1, 1, PFile) != 1){
+		return 0;
+	}
+	if(fread(&Entry->Id, 4, 1, PFile) != 1){
+		return -1;
+	}
+	if(Type == RETRY_RECORD_DONE){
+		return 2;
+	}
+	if(Type != RETRY_RECORD_ADD){
+		return -1;
+	}
+
+	if(fread(&Class, 1, 1, PFile) != 1 || fread(&Attempts, 1, 1, PFile) != 1 || fread(&UploadType, 2, 1, PFile) != 1
+		|| fread(&Delay, 4, 1, PFile) != 1 || fread(&Entry->Due, 8, 1, PFile) != 1
+		|| fread(&FolderLen, 2, 1, PFile) != 1 || fread(&FileLen, 2, 1, PFile) != 1){
+		return -1;
+	}
+	if(FolderLen >= FILE_NAME_LEN || FileLen >= FILE_NAME_LEN){
+		return -1;
+	}
+	if(fread(Entry->FilePath, 1, FolderLen, PFile) != FolderLen || fread(Entry->FilePathAndFileName, 1, FileLen, PFile) != FileLen){
+		return -1;
+	}
+	Entry->FilePath[FolderLen] = 0x00;
+	Entry->FilePathAndFileName[FileLen] = 0x00;
+	Entry->Class = Class;
+	Entry->Attempts = Attempts;
+	Entry->UploadType = UploadType;
+	Entry->Delay = (int)Delay;
+	return 1;
+}
+
+// replaces To with From in one step, a crash leaves one file or the other
+static int retry_replace(const char *From, const char *To){
+#ifdef _WIN32
+	return MoveFileExA(From, To, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) ? 0 : -1;
+#else
+	return rename(From, To);
+#endif
+}
+
+static int retry_sync(FILE *PFile){
+	if(fflush(PFile) != 0){
+		return -1;
+	}
+#ifdef _WIN32
+	return _commit(_fileno(PFile));
+#else
+	return fsync(fileno(PFile));
+#endif
+}
+
+// rewrites the file with the live entries only, through a temporary file
+static int retry_queue_compact(){
+	char TempFileName[FILE_NAME_LEN + 8];
+	std::map<unsigned int, RETRY_ENTRY>::iterator it;
+	FILE *PFile;
+
+	sprintf(TempFileName, "%s.tmp", RetryFileName);
+
+	PFile = fopen(TempFileName, "wb");
+	if(PFile == NULL){
+		return -1;
+	}
+	fwrite(RetryMagic, 1, sizeof RetryMagic, PFile);
+	for(it = RetryLive->begin(); it != RetryLive->end(); ++ it){
+		if(retry_write_add(PFile, &it->second) == -1){
+			fclose(PFile);
+			remove(TempFileName);
+			return -1;
+		}
+	}
+	// the new file is on the disk before it takes the old one's place
+	if(retry_sync(PFile) != 0){
+		fclose(PFile);
+		remove(TempFileName);
+		return -1;
+	}
+	if(fclose(PFile) != 0){
+		remove(TempFileName);
+		return -1;
+	}
+
+	if(RetryFile != NULL){
+		fclose(RetryFile);
+		RetryFile = NULL;
+	}
+	if(retry_replace(TempFileName, RetryFileName) != 0){
+		remove(TempFileName);
+		RetryFile = fopen(RetryFileName, "ab");
+		return -1;
+	}
+
+	RetryFile = fopen(RetryFileName, "ab");
+	if(RetryFile == NULL){
+		return -1;
+	}
+	RetryDoneNum = 0;
+	return 0;
+}
+
+static void retry_queue_schedule(const RETRY_ENTRY *Entry){
+	(*RetryLive)[Entry->Id] = *Entry;
+	(*RetryPath)[Entry->FilePathAndFileName] = Entry->Id;
+	RetrySchedule->insert(std::make_pair(Entry->Due, Entry->Id));
+	if(Entry->Id >= RetryNextId){
+		RetryNextId = Entry->Id + 1;
+	}
+}
+
+static void retry_queue_erase(unsigned int Id){
+	std::map<unsigned int, RETRY_ENTRY>::iterator it = RetryLive->find(Id);
+	std::map<std::string, unsigned int>::iterator PathIt;
+
+	if(it == RetryLive->end()){
+		return;
+	}
+	// a newer retry of the same file may own the path already
+	PathIt = RetryPath->find(it->second.FilePathAndFileName);
+	if(PathIt != RetryPath->end() && PathIt->second == Id){
+		RetryPath->erase(PathIt);
+	}
+	RetryLive->erase(it);
+}
+
+// Loads the retries a previous run left behind. Everything that was in
+// flight when it stopped is simply due again.
+int retry_queue_open(const char *FileName){
+	Poco::FastMutex::ScopedLock Lock(RetryMutex);
+	RETRY_ENTRY Entry;
+	char Magic[4];
+	FILE *PFile;
+	int Res = 0;
+
+	if(RetryLive != NULL){
+		return -1;
+	}
+
+	RetryLive = new std::map<unsigned int, RETRY_ENTRY>();
+	RetrySchedule = new std::multimap<unsigned long long, unsigned int>();
+	RetryPath = new std::map<std::string, unsigned int>();
+	RetryNextId = 1;
+	RetryDoneNum = 0;
+	RetrySeed = (net_tick_us() ^ ((unsigned long long)time(NULL) << 20)) | 1;
+	strncpy(RetryFileName, FileName, FILE_NAME_LEN - 1);
+	RetryFileName[FILE_NAME_LEN - 1] = 0x00;
+
+	PFile = fopen(RetryFileName, "rb");
+	if(PFile != NULL){
+		if(fread(Magic, 1, sizeof Magic, PFile) == sizeof Magic && memcmp(Magic, RetryMagic, sizeof Magic) == 0){
+			memset(&Entry, 0x00, sizeof Entry);
+			while((Res = retry_read_record(PFile, &Entry)) > 0){
+				if(Res == 1){
+					(*RetryLive)[Entry.Id] = Entry;
+				}
+				else{
+					RetryLive->erase(Entry.Id);
+				}
+				if(Entry.Id >= RetryNextId){
+					RetryNextId = Entry.Id + 1;
+				}
+			}
+		}
+		fclose(PFile);
+	}
+
+	for(std::map<unsigned int, RETRY_ENTRY>::iterator it = RetryLive->begin(); it != RetryLive->end(); ++ it){
+		RetrySchedule->insert(std::make_pair(it->second.Due, it->first));
+		(*RetryPath)[it->second.FilePathAndFileName] = it->first;
+	}
+
+	// a torn tail from a crash is dropped here as well
+	return retry_queue_compact();
+}
+
+int retry_queue_close(){
+	Poco::FastMutex::ScopedLock Lock(RetryMutex);
+
+	if(RetryLive == NULL){
+		return 0;
+	}
+
+	if(RetryDoneNum > 0){
+		retry_queue_compact();
+	}
+	if(RetryFile != NULL){
+		fclose(RetryFile);
+		RetryFile = NULL;
+	}
+
+	delete RetryLive;
+	delete RetrySchedule;
+	delete RetryPath;
+	RetryLive = NULL;
+	RetrySchedule = NULL;
+	RetryPath = NULL;
+	return 0;
+}
+
+// Schedules another attempt for a failed upload. Attempts is how many were
+// made so far and PrevDelay the wait before the last one. Returns -1 when
+// the class is not worth retrying or the attempts are used up.
+int retry_queue_add(int Class, int Attempts, int PrevDelay, const char *FilePath, const char *FilePathAndFileName, int UploadType){
+	Poco::FastMutex::ScopedLock Lock(RetryMutex);
+	RETRY_ENTRY Entry;
+
+	if(RetryLive == NULL || retry_base_delay(Class) == -1 || Attempts >= RETRY_MAX_ATTEMPTS){
+		return -1;
+	}
+
+	memset(&Entry, 0x00, sizeof Entry);
+	Entry.Id = RetryNextId;
+	Entry.Class = Class;
+	Entry.Attempts = Attempts;
+	Entry.UploadType = UploadType;
+	Entry.Delay = retry_next_delay(Class, PrevDelay);
+	Entry.Due = retry_now_ms() + Entry.Delay;
+	strncpy(Entry.FilePath, FilePath, FILE_NAME_LEN - 1);
+	strncpy(Entry.FilePathAndFileName, FilePathAndFileName, FILE_NAME_LEN - 1);
+
+	retry_queue_schedule(&Entry);
+
+	if(RetryFile != NULL){
+		retry_write_add(RetryFile, &Entry);
+		fflush(RetryFile);
+	}
+	return (int)Entry.Id;
+}
+
+// Hands out the earliest retry if it is due: 1 with Entry filled, 0 if none
+// is. The entry stays in the file until retry_queue_done, so a crash in the
+// middle of the attempt runs it again.
+int retry_queue_next(RETRY_ENTRY *Entry){
+	Poco::FastMutex::ScopedLock Lock(RetryMutex);
+	std::multimap<unsigned long long, unsigned int>::iterator it;
+	std::map<unsigned int, RETRY_ENTRY>::iterator Live;
+
+	if(RetrySchedule == NULL){
+		return 0;
+	}
+
+	// a schedule item whose entry is gone is stale and only dropped
+	while(!RetrySchedule->empty()){
+		it = RetrySchedule->begin();
+		if(it->first > retry_now_ms()){
+			return 0;
+		}
+
+		Live = RetryLive->find(it->second);
+		RetrySchedule->erase(it);
+		if(Live != RetryLive->end()){
+			*Entry = Live->second;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// milliseconds until the next retry is due, -1 when none is waiting
+int retry_queue_wait(){
+	Poco::FastMutex::ScopedLock Lock(RetryMutex);
+	unsigned long long Due;
+	unsigned long long Now;
+
+	if(RetrySchedule == NULL || RetrySchedule->empty()){
+		return -1;
+	}
+
+	Due = RetrySchedule->begin()->first;
+	Now = retry_now_ms();
+	if(Due <= Now){
+		return 0;
+	}
+	return (int)(Due - Now);
+}
+
+int retry_queue_done(unsigned int Id){
+	Poco::FastMutex::ScopedLock Lock(RetryMutex);
+
+	if(RetryLive == NULL || RetryLive->find(Id) == RetryLive->end()){
+		return -1;
+	}
+	retry_queue_erase(Id);
+
+	if(RetryFile != NULL){
+		retry_write_done(RetryFile, Id);
+		fflush(RetryFile);
+	}
+
+	RetryDoneNum ++;
+	if(RetryDoneNum > RETRY_COMPACT_THRESHOLD && RetryDoneNum > (int)RetryLive->size()){
+		retry_queue_compact();
+	}
+	return 0;
+}
+
+// whether the file already has a retry pending, so a scan leaves it alone
+int retry_queue_contains(const char *FilePathAndFileName){
+	Poco::FastMutex::ScopedLock Lock(RetryMutex);
+
+	if(RetryPath == NULL){
+		return 0;
+	}
+	return RetryPath->find(FilePathAndFileName) != RetryPath->end();
+}
+
+// retries not finished yet, waiting or in flight
+int retry_queue_size(){
+	Poco::FastMutex::ScopedLock Lock(RetryMutex);
+
+	if(RetryLive == NULL){
+		return 0;
+	}
+	return (int)RetryLive->size();
+}
\ No newline at end of file
@@ -0,0 +1,40 @@
+#ifndef __RETRY_QUEUE__
+#define __RETRY_QUEUE__
+
+#include "define.h"
+#include "net_socket.h"
+
+#include <map>
+#include <string>
+
+#define RETRY_CLASS_NONE 0
+#define RETRY_CLASS_CONNECT 1
+#define RETRY_CLASS_TIMEOUT 2
+#define RETRY_CLASS_SERVER 3
+#define RETRY_CLASS_ERROR 4
+
+#define RETRY_RECORD_ADD 1
+#define RETRY_RECORD_DONE 2
+
+typedef struct{
+	unsigned int Id;
+	int Class;
+	int Attempts;
+	int UploadType;
+	int Delay;
+	unsigned long long Due;
+	char FilePath[FILE_NAME_LEN];
+	char FilePathAndFileName[FILE_NAME_LEN];
+}RETRY_ENTRY;
+
+int retry_queue_open(const char *FileName);
+int retry_queue_close();
+
+int retry_queue_add(int Class, int Attempts, int PrevDelay, const char *FilePath, const char *FilePathAndFileName, int UploadType);
+int retry_queue_next(RETRY_ENTRY *Entry);
+int retry_queue_wait();
+int retry_queue_done(unsigned int Id);
+int retry_queue_contains(const char *FilePathAndFileName);
+int retry_queue_size();
+
+#endif // __RETRY_QUEUE__
\ No newline at end of file
@@ -0,0 +1,401 @@
+#include "sent_index.h"
+
+#include <Poco/Mutex.h>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+// What has been sent is kept as an open addressing hash table in a file that
+// is mapped, not read: opening it costs the same for ten entries or ten
+// million, and a lookup touches one or two slots. A slot holds the 128 bit
+// digest of the case folded key, never the key itself, and all zero marks it
+// free. Entries are only ever added. Once the table is SENT_INDEX_LOAD
+// percent full it is rehashed into a file twice the size, which then
+// replaces the old one, so a crash leaves one table or the other whole.
+//
+// File: u32 magic, u32 slot size, u64 capacity, u64 count, 40 bytes spare,
+// then capacity slots of u64 high, u64 low.
+
+#define SENT_INDEX_HEADER 64
+
+typedef struct{
+	unsigned int Magic;
+	unsigned int SlotSize;
+	unsigned long long Capacity;
+	unsigned long long Count;
+	unsigned char Spare[40];
+}SENT_INDEX_HEADER_DATA;
+
+typedef struct{
+	unsigned long long High;
+	unsigned long long Low;
+}SENT_INDEX_SLOT;
+
+typedef struct{
+#ifdef _WIN32
+	HANDLE File;
+	HANDLE Mapping;
+#else
+	int File;
+#endif
+	unsigned char *Base;
+	unsigned long long Size;
+}SENT_INDEX_MAP;
+
+static SENT_INDEX_MAP SentIndexMap;
+static SENT_INDEX_HEADER_DATA *SentIndexHeader = NULL;
+static SENT_INDEX_SLOT *SentIndexSlot = NULL;
+static char SentIndexFileName[FILE_NAME_LEN];
+static Poco::FastMutex SentIndexMutex;
+
+static const unsigned int SentIndexMagic = 0x31584953;	// "SIX1"
+
+// Maps FileName read-write, created or grown to Size bytes first when Size
+// is not 0.
+static int sent_index_map(SENT_INDEX_MAP *Map, const char *FileName, unsigned long long Size){
+#ifdef _WIN32
+	LARGE_INTEGER Length;
+
+	Map->File = CreateFileA(FileName, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if(Map->File == INVALID_HANDLE_VALUE){
+		return -1;
+	}
+	if(Size != 0){
+		Length.QuadPart = (LONGLONG)Size;
+		if(!SetFilePointerEx(Map->File, Length, NULL, FILE_BEGIN) || !SetEndOfFile(Map->File)){
+			CloseHandle(Map->File);
+			return -1;
+		}
+	}
+	if(!GetFileSizeEx(Map->File, &Length) || Length.QuadPart < SENT_INDEX_HEADER){
+		CloseHandle(Map->File);
+		return -1;
+	}
+	Map->Size = (unsigned long long)Length.QuadPart;
+	Map->Mapping = CreateFileMappingA(Map->File, NULL, PAGE_READWRITE, 0, 0, NULL);
+	if(Map->Mapping == NULL){
+		CloseHandle(Map->File);
+		return -1;
+	}
+	Map->Base = (unsigned char *)MapViewOfFile(Map->Mapping, FILE_MAP_WRITE, 0, 0, 0);
+	if(Map->Base == NULL){
+		CloseHandle(Map->Mapping);
+		CloseHandle(Map->File);
+		return -1;
+	}
+#else
+	struct stat FileStat;
+	void *Base;
+
+	Map->File = open(FileName, O_RDWR | O_CREAT, 0644);
+	if(Map->File == -1){
+		return -1;
+	}
+	if(Size != 0 && ftruncate(Map->File, (off_t)Size) == -1){
+		close(Map->File);
+		return -1;
+	}
+	if(fstat(Map->File, &FileStat) == -1 || FileStat.st_size < SENT_INDEX_HEADER){
+		close(Map->File);
+		return -1;
+	}
+	Map->Size = (unsigned long long)FileStat.st_size;
+	Base = mmap(NULL, (size_t)Map->Size, PROT_READ | PROT_WRITE, MAP_SHARED, Map->File, 0);
+	if(Base == MAP_FAILED){
+		close(Map->File);
+		return -1;
+	}
+	Map->Base = (unsigned char *)Base;
+#endif
+	return 0;
+}
+
+static void sent_index_unmap(SENT_INDEX_MAP *Map, int Sync){
+	if(Map->Base == NULL){
+		return;
+	}
+#ifdef _WIN32
+	if(Sync){
+		FlushViewOfFile(Map->Base, 0);
+		FlushFileBuffers(Map->File);
+	}
+	UnmapViewOfFile(Map->Base);
+	CloseHandle(Map->Mapping);
+	CloseHandle(Map->File);
+#else
+	if(Sync){
+		msync(Map->Base, (size_t)Map->Size, MS_SYNC);
+	}
+	munmap(Map->Base, (size_t)Map->Size);
+	close(Map->File);
+#endif
+	Map->Base = NULL;
+}
+
+static int sent_index_replace(const char *From, const char *To){
+#ifdef _WIN32
+	return MoveFileExA(From, To, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) ? 0 : -1;
+#else
+	return rename(From, To);
+#endif
+}
+
+// two independent 64 bit hashes of the key with A-Z folded to a-z, the same
+// folding sendeml.txt was matched with
+static void sent_index_digest(const char *Key, SENT_INDEX_SLOT *Digest){
+	unsigned long long High = 0xcbf29ce484222325ULL;
+	unsigned long long Low = 0x9e3779b97f4a7c15ULL;
+	unsigned char Char;
+
+	for(; *Key; Key ++){
+		Char = (unsigned char)*Key;
+		if(Char >= 'A' && Char <= 'Z'){
+			Char = Char - 'A' + 'a';
+		}
+		High = (High ^ Char) * 0x100000001b3ULL;
+		Low = (Low ^ Char) * 0xff51afd7ed558ccdULL;
+		Low ^= Low >> 32;
+	}
+	Low ^= Low >> 33;
+	Low *= 0xc4ceb9fe1a85ec53ULL;
+	Low ^= Low >> 33;
+
+	Digest->High = High;
+	Digest->Low = (High == 0 && Low == 0) ? 1 : Low;
+}
+
+// The slot holding Digest, or the free one it would go into.
+static SENT_INDEX_SLOT *sent_index_probe(SENT_INDEX_SLOT *Slot, unsigned long long Capacity, const SENT_INDEX_SLOT *Digest){
+	unsigned long long Mask = Capacity - 1;
+	unsigned long long i = Digest->Low & Mask;
+
+	while(Slot[i].High != 0 || Slot[i].Low != 0){
+		if(Slot[i].High == Digest->High && Slot[i].Low == Digest->Low){
+			break;
+		}
+		i = (i + 1) & Mask;
+	}
+	return &Slot[i];
+}
+
+// Builds an empty table of Capacity slots in FileName, filled from the
+// current one if there is one.
+static int sent_index_build(const char *FileName, unsigned long long Capacity){
+	SENT_INDEX_MAP Map;
+	SENT_INDEX_HEADER_DATA *Header;
+	SENT_INDEX_SLOT *Slot;
+	unsigned long long i = 0;
+
+	remove(FileName);
+	if(sent_index_map(&Map, FileName, SENT_INDEX_HEADER + Capacity * sizeof(SENT_INDEX_SLOT)) == -1){
+		return -1;
+	}
+	Header = (SENT_INDEX_HEADER_DATA *)Map.Base;
+	Slot = (SENT_INDEX_SLOT *)(Map.Base + SENT_INDEX_HEADER);
+
+	if(SentIndexHeader != NULL){
+		for(i = 0; i < SentIndexHeader->Capacity; i ++){
+			if(SentIndexSlot[i].High != 0 || SentIndexSlot[i].Low != 0){
+				*sent_index_probe(Slot, Capacity, &SentIndexSlot[i]) = SentIndexSlot[i];
+			}
+		}
+		Header->Count = SentIndexHeader->Count;
+	}
+	Header->SlotSize = sizeof(SENT_INDEX_SLOT);
+	Header->Capacity = Capacity;
+	// the magic goes in last, a table cut short never looks valid
+	Header->Magic = SentIndexMagic;
+	sent_index_unmap(&Map, 1);
+	return 0;
+}
+
+static int sent_index_attach(){
+	if(sent_index_map(&SentIndexMap, SentIndexFileName, 0) == -1){
+		return -1;
+	}
+	SentIndexHeader = (SENT_INDEX_HEADER_DATA *)SentIndexMap.Base;
+	SentIndexSlot = (SENT_INDEX_SLOT *)(SentIndexMap.Base + SENT_INDEX_HEADER);
+	if(SentIndexHeader->Magic != SentIndexMagic || SentIndexHeader->SlotSize != sizeof(SENT_INDEX_SLOT)
+		|| SentIndexHeader->Capacity == 0 || (SentIndexHeader->Capacity & (SentIndexHeader->Capacity - 1)) != 0
+		|| SENT_INDEX_HEADER + SentIndexHeader->Capacity * sizeof(SENT_INDEX_SLOT) > SentIndexMap.Size){
+		sent_index_unmap(&SentIndexMap, 0);
+		SentIndexHeader = NULL;
+		SentIndexSlot = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+static int sent_index_grow(){
+	char TempName[FILE_NAME_LEN];
+
+	memset(TempName, 0x00, sizeof TempName);
+	strcat(TempName, SentIndexFileName);
+	strcat(TempName, ".tmp");
+
+	if(sent_index_build(TempName, SentIndexHeader->Capacity * 2) == -1){
+		remove(TempName);
+		return -1;
+	}
+	sent_index_unmap(&SentIndexMap, 1);
+	SentIndexHeader = NULL;
+	SentIndexSlot = NULL;
+	if(sent_index_replace(TempName, SentIndexFileName) == -1){
+		remove(TempName);
+	}
+	return sent_index_attach();
+}
+
+static int sent_index_insert(const char *Key){
+	SENT_INDEX_SLOT Digest;
+	SENT_INDEX_SLOT *Slot;
+
+	sent_index_digest(Key, &Digest);
+	Slot = sent_index_probe(SentIndexSlot, SentIndexHeader->Capacity, &Digest);
+	if(Slot->High != 0 || Slot->Low != 0){
+		return 0;
+	}
+
+	if((SentIndexHeader->Count + 1) * 100 > SentIndexHeader->Capacity * SENT_INDEX_LOAD){
+		if(sent_index_grow() == -1){
+			return -1;
+		}
+		Slot = sent_index_probe(SentIndexSlot, SentIndexHeader->Capacity, &Digest);
+	}
+	*Slot = Digest;
+	SentIndexHeader->Count ++;
+	return 0;
+}
+
+// the list the index replaces is taken in when there is no index yet
+static int sent_index_import(const char *ImportName){
+	FILE *PFile = NULL;
+	char Line[FILE_NAME_LEN];
+	int Len = 0;
+	int Res = 0;
+
+	PFile = fopen(ImportName, "r");
+	if(PFile == NULL){
+		return 0;
+	}
+	while(Res == 0 && fgets(Line, sizeof Line, PFile)){
+		Len = (int)strlen(Line);
+		while(Len > 0 && (Line[Len - 1] == '\n' || Line[Len - 1] == '\r')){
+			Line[-- Len] = 0;
+		}
+		if(Len > 0){
+			Res = sent_index_insert(Line);
+		}
+	}
+	if(ferror(PFile)){
+		Res = -1;
+	}
+	fclose(PFile);
+	return Res;
+}
+
+// Builds a new index at FileName from ImportName. It is filled under a
+// temporary name and only then put in place, so a crash on the way leaves no
+// index at all, never one that holds part of the list.
+static int sent_index_create(const char *FileName, const char *ImportName){
+	int Res = 0;
+
+	sprintf(SentIndexFileName, "%s.tmp", FileName);
+	if(sent_index_build(SentIndexFileName, SENT_INDEX_CAPACITY) == -1 || sent_index_attach() == -1){
+		remove(SentIndexFileName);
+		strcpy(SentIndexFileName, FileName);
+		return -1;
+	}
+	if(ImportName != NULL){
+		Res = sent_index_import(ImportName);
+	}
+	sent_index_unmap(&SentIndexMap, 1);
+	SentIndexHeader = NULL;
+	SentIndexSlot = NULL;
+
+	if(Res == 0){
+		Res = sent_index_replace(SentIndexFileName, FileName);
+	}
+	if(Res == -1){
+		remove(SentIndexFileName);
+	}
+	strcpy(SentIndexFileName, FileName);
+	return Res;
+}
+
+int sent_index_open(const char *FileName, const char *ImportName){
+	struct stat FileStat;
+
+	Poco::FastMutex::ScopedLock Lock(SentIndexMutex);
+	if(SentIndexHeader != NULL || strlen(FileName) + 8 >= sizeof SentIndexFileName){
+		return -1;
+	}
+	strcpy(SentIndexFileName, FileName);
+
+	if(stat(FileName, &FileStat) == 0 && sent_index_attach() == 0){
+		return 0;
+	}
+
+	// none yet, or one a crash left unfinished: made again from the list
+	if(stat(FileName, &FileStat) == 0){
+		printf("sent index: %s is damaged, rebuilt from the list\n", FileName);
+	}
+	if(sent_index_create(FileName, ImportName) == -1 || sent_index_attach() == -1){
+		return -1;
+	}
+	return 0;
+}
+
+int sent_index_close(){
+	Poco::FastMutex::ScopedLock Lock(SentIndexMutex);
+	sent_index_unmap(&SentIndexMap, 1);
+	SentIndexHeader = NULL;
+	SentIndexSlot = NULL;
+	return 0;
+}
+
+// Writes the table through to the disk, what is in it survives a crash.
+int sent_index_sync(){
+	Poco::FastMutex::ScopedLock Lock(SentIndexMutex);
+	if(SentIndexMap.Base == NULL){
+		return -1;
+	}
+#ifdef _WIN32
+	if(!FlushViewOfFile(SentIndexMap.Base, 0) || !FlushFileBuffers(SentIndexMap.File)){
+		return -1;
+	}
+#else
+	if(msync(SentIndexMap.Base, (size_t)SentIndexMap.Size, MS_SYNC) == -1){
+		return -1;
+	}
+#endif
+	return 0;
+}
+
+int sent_index_contains(const char *Key){
+	SENT_INDEX_SLOT Digest;
+	SENT_INDEX_SLOT *Slot;
+
+	sent_index_digest(Key, &Digest);
+
+	Poco::FastMutex::ScopedLock Lock(SentIndexMutex);
+	if(SentIndexHeader == NULL){
+		return 0;
+	}
+	Slot = sent_index_probe(SentIndexSlot, SentIndexHeader->Capacity, &Digest);
+	return Slot->High != 0 || Slot->Low != 0;
+}
+
+int sent_index_add(const char *Key){
+	Poco::FastMutex::ScopedLock Lock(SentIndexMutex);
+	if(SentIndexHeader == NULL){
+		return -1;
+	}
+	return sent_index_insert(Key);
+}
+
+long long sent_index_size(){
+	Poco::FastMutex::ScopedLock Lock(SentIndexMutex);
+	return SentIndexHeader == NULL ? 0 : (long long)SentIndexHeader->Count;
+}
\ No newline at end of file
@@ -0,0 +1,14 @@
+#ifndef __SENT_INDEX__
+#define __SENT_INDEX__
+
+#include "define.h"
+
+int sent_index_open(const char *FileName, const char *ImportName);
+int sent_index_close();
+int sent_index_sync();
+
+int sent_index_contains(const char *Key);
+int sent_index_add(const char *Key);
+long long sent_index_size();
+
+#endif // __SENT_INDEX__
\ No newline at end of file
@@ -0,0 +1,206 @@
+#include "timer_wheel.h"
+
+// Hierarchical timing wheel: TIMER_WHEEL_LEVELS wheels of TIMER_WHEEL_SLOTS
+// lists each, level L holding the deadlines 64^L to 64^(L+1) ticks away.
+// Adding and removing a deadline is a list splice; each tick runs one
+// level 0 list, and every 64 ticks one higher slot is spread down a level.
+
+static void timer_list_init(TIMER_NODE *Head){
+	Head->Prev = Head;
+	Head->Next = Head;
+}
+
+static void timer_list_append(TIMER_NODE *Head, TIMER_NODE *Node){
+	Node->Prev = Head->Prev;
+	Node->Next = Head;
+	Head->Prev->Next = Node;
+	Head->Prev = Node;
+}
+
+static void timer_list_unlink(TIMER_NODE *Node){
+	Node->Prev->Next = Node->Next;
+	Node->Next->Prev = Node->Prev;
+	Node->Prev = NULL;
+	Node->Next = NULL;
+}
+
+// files the node by how far its expiry is from now, in 64-tick digits
+static void timer_wheel_place(TIMER_WHEEL *Wheel, TIMER_NODE *Node){
+	unsigned long long Limit = (1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1;
+	int Shift = 0;
+	int Level = 0;
+
+	if(Node->Expire <= Wheel->Now){
+		Node->Expire = Wheel->Now + 1;
+	}
+	if(Node->Expire - Wheel->Now > Limit){
+		Node->Expire = Wheel->Now + Limit;
+	}
+
+	for(Level = 0; Level < TIMER_WHEEL_LEVELS - 1; Level ++){
+		Shift = Level * TIMER_WHEEL_BITS;
+		if((Node->Expire >> Shift) - (Wheel->Now >> Shift) < TIMER_WHEEL_SLOTS){
+			break;
+		}
+	}
+	Shift = Level * TIMER_WHEEL_BITS;
+
+	timer_list_append(&Wheel->Slot[Level][(Node->Expire >> Shift) & TIMER_WHEEL_MASK], Node);
+}
+
+// moves one higher-level slot down now that its time range has come up
+static void timer_wheel_cascade(TIMER_WHEEL *Wheel, int Level){
+	TIMER_NODE Pending;
+	TIMER_NODE *Head;
+	TIMER_NODE *Node;
+
+	Head = &Wheel->Slot[Level][(Wheel->Now >> (Level * TIMER_WHEEL_BITS)) & TIMER_WHEEL_MASK];
+	if(Head->Next == Head){
+		return;
+	}
+
+	// detach the whole list first, placing can append to the same slot
+	Pending.Next = Head->Next;
+	Pending.Prev = Head->Prev;
+	Pending.Next->Prev = &Pending;
+	Pending.Prev->Next = &Pending;
+	timer_list_init(Head);
+
+	while(Pending.Next != &Pending){
+		Node = Pending.Next;
+		timer_list_unlink(Node);
+		timer_wheel_place(Wheel, Node);
+	}
+}
+
+void timer_wheel_init(TIMER_WHEEL *Wheel, int Tick, unsigned long long NowMs){
+	int Level = 0;
+	int i = 0;
+
+	for(Level = 0; Level < TIMER_WHEEL_LEVELS; Level ++){
+		for(i = 0; i < TIMER_WHEEL_SLOTS; i ++){
+			timer_list_init(&Wheel->Slot[Level][i]);
+		}
+	}
+
+	Wheel->Tick = (Tick > 0) ? Tick : 1;
+	Wheel->Origin = NowMs;
+	Wheel->Now = 0;
+	Wheel->Count = 0;
+}
+
+void timer_node_init(TIMER_NODE *Node, void *Data){
+	Node->Prev = NULL;
+	Node->Next = NULL;
+	Node->Expire = 0;
+	Node->Data = Data;
+}
+
+int timer_node_active(const TIMER_NODE *Node){
+	return Node->Next != NULL;
+}
+
+// (Re)arms Node to fire DelayMs after NowMs. The wheel only moves in
+// timer_wheel_advance, which an idle caller may not have run for a long
+// while, so the delay is counted from NowMs rather than from the wheel.
+void timer_wheel_add(TIMER_WHEEL *Wheel, TIMER_NODE *Node, int DelayMs, unsigned long long NowMs){
+	unsigned long long Target = Wheel->Now;
+
+	if(timer_node_active(Node)){
+		timer_wheel_remove(Wheel, Node);
+	}
+
+	if(NowMs >= Wheel->Origin && (NowMs - Wheel->Origin) / Wheel->Tick > Target){
+		Target = (NowMs - Wheel->Origin) / Wheel->Tick;
+	}
+	// an empty wheel has nothing to fire on the way, catch it up at once
+	if(Wheel->Count == 0){
+		Wheel->Now = Target;
+	}
+
+	Node->Expire = Target + (DelayMs + Wheel->Tick - 1) / Wheel->Tick;
+	timer_wheel_place(Wheel, Node);
+	Wheel->Count ++;
+}
+
+void timer_wheel_remove(TIMER_WHEEL *Wheel, TIMER_NODE *Node){
+	if(!timer_node_active(Node)){
+		return;
+	}
+
+	timer_list_unlink(Node);
+	Wheel->Count --;
+}
+
+// Runs the wheel forward to NowMs, calling Callback for each node that came
+// due; the node is already unlinked, so the callback may re-arm or free it.
+// Returns the number of nodes fired.
+int timer_wheel_advance(TIMER_WHEEL *Wheel, unsigned long long NowMs, TIMER_WHEEL_CALLBACK Callback, void *CallbackArg){
+	unsigned long long Target;
+	TIMER_NODE *Head;
+	TIMER_NODE *Node;
+	int Fired = 0;
+	int Level = 0;
+
+	if(NowMs < Wheel->Origin){
+		return 0;
+	}
+	Target = (NowMs - Wheel->Origin) / Wheel->Tick;
+
+	// nothing armed, nothing to walk through
+	if(Wheel->Count == 0){
+		if(Target > Wheel->Now){
+			Wheel->Now = Target;
+		}
+		return 0;
+	}
+
+	while(Wheel->Now < Target){
+		Wheel->Now ++;
+
+		for(Level = 1; Level < TIMER_WHEEL_LEVELS; Level ++){
+			if(((Wheel->Now >> ((Level - 1) * TIMER_WHEEL_BITS)) & TIMER_WHEEL_MASK) != 0){
+				break;
+			}
+			timer_wheel_cascade(Wheel, Level);
+		}
+
+		Head = &Wheel->Slot[0][Wheel->Now & TIMER_WHEEL_MASK];
+		while(Head->Next != Head){
+			Node = Head->Next;
+			timer_list_unlink(Node);
+			Wheel->Count --;
+			Fired ++;
+			Callback(Node, CallbackArg);
+		}
+
+		if(Wheel->Count == 0){
+			Wheel->Now = Target;
+		}
+	}
+
+	return Fired;
+}
+
+// Milliseconds until the wheel next has to be advanced, -1 when nothing is
+// armed. Exact for the next 64 ticks, otherwise the next cascade point.
+int timer_wheel_next(TIMER_WHEEL *Wheel){
+	unsigned long long Tick = 0;
+	int i = 0;
+
+	if(Wheel->Count == 0){
+		return -1;
+	}
+
+	for(i = 1; i <= TIMER_WHEEL_SLOTS; i ++){
+		Tick = Wheel->Now + i;
+		if((Tick & TIMER_WHEEL_MASK) == 0){
+			break;
+		}
+		if(Wheel->Slot[0][Tick & TIMER_WHEEL_MASK].Next != &Wheel->Slot[0][Tick & TIMER_WHEEL_MASK]){
+			break;
+		}
+	}
+
+	return (int)(Tick - Wheel->Now) * Wheel->Tick;
+}
\ No newline at end of file
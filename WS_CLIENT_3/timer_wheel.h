@@ -0,0 +1,37 @@
+#ifndef __TIMER_WHEEL__
+#define __TIMER_WHEEL__
+
+#include "define.h"
+
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_LEVELS 4
+
+typedef struct TIMER_NODE{
+	struct TIMER_NODE *Prev;
+	struct TIMER_NODE *Next;
+	unsigned long long Expire;
+	void *Data;
+}TIMER_NODE;
+
+typedef void (*TIMER_WHEEL_CALLBACK)(TIMER_NODE *Node, void *CallbackArg);
+
+typedef struct{
+	TIMER_NODE Slot[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+	unsigned long long Now;
+	unsigned long long Origin;
+	int Tick;
+	int Count;
+}TIMER_WHEEL;
+
+void timer_wheel_init(TIMER_WHEEL *Wheel, int Tick, unsigned long long NowMs);
+void timer_node_init(TIMER_NODE *Node, void *Data);
+int timer_node_active(const TIMER_NODE *Node);
+
+void timer_wheel_add(TIMER_WHEEL *Wheel, TIMER_NODE *Node, int DelayMs, unsigned long long NowMs);
+void timer_wheel_remove(TIMER_WHEEL *Wheel, TIMER_NODE *Node);
+int timer_wheel_advance(TIMER_WHEEL *Wheel, unsigned long long NowMs, TIMER_WHEEL_CALLBACK Callback, void *CallbackArg);
+int timer_wheel_next(TIMER_WHEEL *Wheel);
+
+#endif // __TIMER_WHEEL__
\ No newline at end of file
@@ -0,0 +1,252 @@
+#include "traffic_lane.h"
+#include "net_socket.h"
+
+#include <Poco/Mutex.h>
+#include <Poco/Event.h>
+#include <Poco/Runnable.h>
+#include <Poco/Thread.h>
+#include <Poco/AutoPtr.h>
+#include <Poco/Notification.h>
+#include <Poco/PriorityNotificationQueue.h>
+
+// Requests are queued by traffic class on a priority queue and run one at a
+// time by a single dispatcher thread, each lane with a send buffer of its own.
+// A bulk request is a whole upload run, so waiting for it to finish would put
+// a comm poll behind every file of it; instead the upload loop calls
+// traffic_lane_yield between rounds and queued control requests run right
+// there, ahead of anything else in the bulk lane.
+
+class TrafficLaneRequest : public Poco::Notification{
+public:
+	TrafficLaneRequest(int Lane, TRAFFIC_LANE_HANDLER Handler, void *HandlerArg)
+		: Lane(Lane), Handler(Handler), HandlerArg(HandlerArg), Result(-1){}
+
+	int Lane;
+	TRAFFIC_LANE_HANDLER Handler;
+	void *HandlerArg;
+	int Result;
+	Poco::Event Done;
+};
+
+class TrafficLaneDispatcher : public Poco::Runnable{
+public:
+	void run();
+};
+
+static Poco::PriorityNotificationQueue TrafficLaneQueue;
+static TrafficLaneDispatcher Dispatcher;
+static Poco::Thread *DispatcherThread = NULL;
+static Poco::FastMutex TrafficLaneMutex;
+static int TrafficLaneOutstanding[TRAFFIC_LANE_NUM];
+static int TrafficLaneInBulk = 0;
+static Poco::Event TrafficLaneIdle;
+static char TrafficLaneBuffer[TRAFFIC_LANE_NUM][SEND_MAX_BUF];
+
+static void traffic_lane_run(TrafficLaneRequest *Request){
+	Request->Result = Request->Handler(TrafficLaneBuffer[Request->Lane], Request->HandlerArg);
+
+	TrafficLaneMutex.lock();
+	TrafficLaneOutstanding[Request->Lane] --;
+	TrafficLaneMutex.unlock();
+
+	Request->Done.set();
+	TrafficLaneIdle.set();
+}
+
+void TrafficLaneDispatcher::run(){
+	Poco::AutoPtr<Poco::Notification> Notification;
+	TrafficLaneRequest *Request;
+
+	while(1){
+		// a NULL notification is the wakeUpAll of traffic_lane_cleanup
+		Notification = TrafficLaneQueue.waitDequeueNotification();
+		if(Notification.isNull()){
+			break;
+		}
+		Request = dynamic_cast<TrafficLaneRequest *>(Notification.get());
+		if(Request == NULL){
+			continue;
+		}
+		TrafficLaneInBulk = Request->Lane != TRAFFIC_LANE_CONTROL;
+		traffic_lane_run(Request);
+		TrafficLaneInBulk = 0;
+	}
+}
+
+int traffic_lane_init(){
+	Poco::FastMutex::ScopedLock Lock(TrafficLaneMutex);
+
+	if(DispatcherThread != NULL){
+		return 0;
+	}
+
+	memset(TrafficLaneOutstanding, 0x00, sizeof TrafficLaneOutstanding);
+	DispatcherThread = new Poco::Thread();
+	DispatcherThread->start(Dispatcher);
+	return 0;
+}
+
+// Requests still queued are dropped, their callers are not waiting anyway
+// once the program is on its way out.
+int traffic_lane_cleanup(){
+	TrafficLaneMutex.lock();
+	if(DispatcherThread == NULL){
+		TrafficLaneMutex.unlock();
+		return 0;
+	}
+	TrafficLaneMutex.unlock();
+
+	TrafficLaneQueue.clear();
+	TrafficLaneQueue.wakeUpAll();
+	DispatcherThread->join();
+
+	TrafficLaneMutex.lock();
+	delete DispatcherThread;
+	DispatcherThread = NULL;
+	memset(TrafficLaneOutstanding, 0x00, sizeof TrafficLaneOutstanding);
+	TrafficLaneMutex.unlock();
+	return 0;
+}
+
+static TrafficLaneRequest *traffic_lane_enqueue(int Lane, TRAFFIC_LANE_HANDLER Handler, void *HandlerArg){
+	TrafficLaneRequest *Request;
+
+	if(Lane < 0 || Lane >= TRAFFIC_LANE_NUM || Handler == NULL){
+		return NULL;
+	}
+
+	// counted and queued under one lock, so a count traffic_lane_yield sees
+	// is always backed by a queued request
+	Poco::FastMutex::ScopedLock Lock(TrafficLaneMutex);
+	if(DispatcherThread == NULL){
+		return NULL;
+	}
+	TrafficLaneOutstanding[Lane] ++;
+
+	Request = new TrafficLaneRequest(Lane, Handler, HandlerArg);
+	// the queue takes a reference of its own, the caller keeps this one
+	Request->duplicate();
+	TrafficLaneQueue.enqueueNotification(Request, Lane);
+	return Request;
+}
+
+// Queues a request and returns at once.
+int traffic_lane_post(int Lane, TRAFFIC_LANE_HANDLER Handler, void *HandlerArg){
+	TrafficLaneRequest *Request;
+
+	Request = traffic_lane_enqueue(Lane, Handler, HandlerArg);
+	if(Request == NULL){
+		return -1;
+	}
+	Request->release();
+	return 0;
+}
+
+// Queues a request and waits for it, returns what the handler returned.
+int traffic_lane_call(int Lane, TRAFFIC_LANE_HANDLER Handler, void *HandlerArg){
+	Poco::AutoPtr<TrafficLaneRequest> Request;
+
+	Request = traffic_lane_enqueue(Lane, Handler, HandlerArg);
+	if(Request.isNull()){
+		return -1;
+	}
+	Request->Done.wait();
+	return Request->Result;
+}
+
+// Runs the control requests queued so far. Only does anything on the
+// dispatcher thread in the middle of a bulk request, when no control request
+// can be running, so every outstanding one is in the queue and, having the
+// higher priority, comes out before any bulk request.
+int traffic_lane_yield(){
+	Poco::AutoPtr<Poco::Notification> Notification;
+	TrafficLaneRequest *Request;
+	int Ran = 0;
+
+	if(!TrafficLaneInBulk || Poco::Thread::current() != DispatcherThread){
+		return 0;
+	}
+
+	TrafficLaneInBulk = 0;
+	while(1){
+		TrafficLaneMutex.lock();
+		Notification = NULL;
+		if(TrafficLaneOutstanding[TRAFFIC_LANE_CONTROL] > 0){
+			Notification = TrafficLaneQueue.dequeueNotification();
+		}
+		TrafficLaneMutex.unlock();
+
+		Request = dynamic_cast<TrafficLaneRequest *>(Notification.get());
+		if(Request == NULL){
+			break;
+		}
+		traffic_lane_run(Request);
+		Ran ++;
+	}
+	TrafficLaneInBulk = 1;
+	return Ran;
+}
+
+// Waits until nothing of the lane is queued or running, up to Timeout ms
+// (forever when negative). Returns 0 once the lane is idle, -1 on timeout.
+int traffic_lane_wait(int Lane, int Timeout){
+	if(Lane < 0 || Lane >= TRAFFIC_LANE_NUM){
+		return -1;
+	}
+
+	while(1){
+		TrafficLaneMutex.lock();
+		if(TrafficLaneOutstanding[Lane] == 0){
+			TrafficLaneMutex.unlock();
+			return 0;
+		}
+		TrafficLaneMutex.unlock();
+
+		if(Timeout < 0){
+			TrafficLaneIdle.wait();
+		}
+		else if(!TrafficLaneIdle.tryWait(Timeout)){
+			return -1;
+		}
+	}
+}
+
+// Caps a wait of the bulk lane (-1 is forever) so queued control requests
+// are not held up longer than TRAFFIC_LANE_SLICE by an idle socket.
+int traffic_lane_slice(int Timeout){
+	if(!TrafficLaneInBulk || Poco::Thread::current() != DispatcherThread){
+		return Timeout;
+	}
+	if(Timeout < 0 || Timeout > TRAFFIC_LANE_SLICE){
+		return TRAFFIC_LANE_SLICE;
+	}
+	return Timeout;
+}
+
+// Sleeps in slices, running queued control requests in between.
+void traffic_lane_sleep(int Milliseconds){
+	unsigned long long Deadline = net_tick_ms() + Milliseconds;
+	unsigned long long Now;
+
+	while((Now = net_tick_ms()) < Deadline){
+		net_sleep_ms(traffic_lane_slice((int)(Deadline - Now)));
+		traffic_lane_yield();
+	}
+}
+
+// Waits up to Timeout for ClientSocket to have something to read, in slices
+// with queued control requests run in between. Returns as net_wait_readable.
+int traffic_lane_wait_readable(SOCKET ClientSocket, int Timeout){
+	unsigned long long Deadline = net_tick_ms() + Timeout;
+	unsigned long long Now;
+	int Res = 0;
+
+	while(1){
+		Now = net_tick_ms();
+		Res = net_wait_readable(ClientSocket, traffic_lane_slice(Now < Deadline ? (int)(Deadline - Now) : 0));
+		if(Res != 0 || net_tick_ms() >= Deadline){
+			return Res;
+		}
+		traffic_lane_yield();
+	}
+}
\ No newline at end of file
@@ -0,0 +1,24 @@
+#ifndef __TRAFFIC_LANE__
+#define __TRAFFIC_LANE__
+
+#include "define.h"
+
+// the lane is the queue priority, lower is served first
+#define TRAFFIC_LANE_CONTROL 0
+#define TRAFFIC_LANE_BULK 1
+#define TRAFFIC_LANE_NUM 2
+
+typedef int (*TRAFFIC_LANE_HANDLER)(char *SendBuffer, void *HandlerArg);
+
+int traffic_lane_init();
+int traffic_lane_cleanup();
+
+int traffic_lane_post(int Lane, TRAFFIC_LANE_HANDLER Handler, void *HandlerArg);
+int traffic_lane_call(int Lane, TRAFFIC_LANE_HANDLER Handler, void *HandlerArg);
+int traffic_lane_yield();
+int traffic_lane_wait(int Lane, int Timeout);
+int traffic_lane_slice(int Timeout);
+void traffic_lane_sleep(int Milliseconds);
+int traffic_lane_wait_readable(SOCKET ClientSocket, int Timeout);
+
+#endif // __TRAFFIC_LANE__
\ No newline at end of file
@@ -0,0 +1,117 @@
+#include "upload_dedup.h"
+
+#include <Poco/SHA1Engine.h>
+
+// Content addressing: every email is named by the SHA-1 of its bytes. Before
+// a group of emails goes up, their digests are sent to /api/upload/probe and
+// the server answers with the ones it stores already; those then travel as
+// a digest reference in the batch instead of their content.
+
+// hex SHA-1 of the file into Digest, which holds UPLOAD_DIGEST_LEN bytes
+int upload_dedup_digest(const char *FilePathAndFileName, char *Digest){
+	Poco::SHA1Engine Engine;
+	FILE *PFile = NULL;
+	char InBuffer[SOCKET_MAX_BUF];
+	size_t ReadLen = 0;
+
+	// read in fixed chunks, a file of any size costs the same memory
+	PFile = fopen(FilePathAndFileName, "rb");
+	if(PFile == NULL){
+		return -1;
+	}
+
+	while((ReadLen = fread(InBuffer, 1, sizeof InBuffer, PFile)) > 0){
+		Engine.update(InBuffer, (unsigned)ReadLen);
+	}
+	if(ferror(PFile)){
+		fclose(PFile);
+		return -1;
+	}
+	fclose(PFile);
+
+	std::string Hex = Poco::DigestEngine::digestToHex(Engine.digest());
+	strncpy(Digest, Hex.c_str(), UPLOAD_DIGEST_LEN - 1);
+	Digest[UPLOAD_DIGEST_LEN - 1] = 0x00;
+	return 0;
+}
+
+// Probes the jobs that have a digest and are not known to be on the server
+// yet, and sets Have on the ones it stores. Returns how many it has, -1 when
+// the probe could not be made and UPLOAD_DEDUP_UNSUPPORTED when the server
+// does not take probes at all.
+int upload_dedup_probe(const char *IpAddress, u_short Port, char *SendBuffer, int SendBufferLen, UPLOAD_JOB *Job, int JobNum){
+	HTTP_UPLOAD_ITEM Item[UPLOAD_PROBE_COUNT];
+	long long Size[UPLOAD_PROBE_COUNT];
+	int Index[UPLOAD_PROBE_COUNT];
+	int Have[UPLOAD_PROBE_COUNT];
+	HTTP_REQUEST Request;
+	HTTP_RESPONSE Response;
+	struct stat FileStat;
+	SOCKET Socket;
+	int ItemNum = 0;
+	int HaveNum = 0;
+	int KeepAlive = 0;
+	int PoolRes = 0;
+	int Result = 0;
+	int i = 0;
+
+	for(i = 0; i < JobNum && ItemNum < UPLOAD_PROBE_COUNT; i ++){
+		if(Job[i].Digest[0] == 0x00 || Job[i].Have || stat(Job[i].FilePathAndFileName, &FileStat) == -1){
+			continue;
+		}
+		Item[ItemNum].FilePath = Job[i].FilePath;
+		Item[ItemNum].FilePathAndFileName = Job[i].FilePathAndFileName;
+		Item[ItemNum].Digest = Job[i].Digest;
+		Item[ItemNum].Have = 0;
+		Size[ItemNum] = FileStat.st_size;
+		Index[ItemNum] = i;
+		ItemNum ++;
+	}
+	if(ItemNum == 0){
+		return 0;
+	}
+
+	if(construct_http_probe(IpAddress, Port, &Request, SendBuffer, SendBufferLen, Item, Size, ItemNum) == -1){
+		return -1;
+	}
+
+	PoolRes = conn_pool_acquire(IpAddress, Port, 0, &Socket);
+	if(PoolRes == -1){
+		return -1;
+	}
+
+	if(net_send_segments_all(Socket, Request.Segment, Request.SegmentNum) == -1 || http_response_init(&Response) == -1){
+		conn_pool_release(IpAddress, Port, Socket, 0);
+		return -1;
+	}
+
+	// control requests go ahead while the server looks the digests up
+	KeepAlive = traffic_lane_wait_readable(Socket, REQUEST_TIMEOUT_FIRST_BYTE) == 1 ? http_response_recv(Socket, &Response) : -1;
+	if(KeepAlive == -1){
+		http_response_free(&Response);
+		conn_pool_release(IpAddress, Port, Socket, 0);
+		return -1;
+	}
+	conn_pool_release(IpAddress, Port, Socket, KeepAlive);
+
+	// a 4xx or an error reply means the probe is not known there, a 5xx
+	// only that it is not available right now
+	Result = upload_engine_status(Response.Parser.StatusCode);
+	if(Result != UPLOAD_RESULT_OK){
+		http_response_free(&Response);
+		return Result == UPLOAD_RESULT_REFUSED ? UPLOAD_DEDUP_UNSUPPORTED : -1;
+	}
+
+	HaveNum = ParseRecvHave(Response.Buffer + Response.Parser.BodyStart, Response.Parser.BodyLen, Have, ItemNum);
+	http_response_free(&Response);
+	if(HaveNum == -1){
+		return UPLOAD_DEDUP_UNSUPPORTED;
+	}
+
+	for(i = 0; i < ItemNum; i ++){
+		if(Have[i]){
+			Job[Index[i]].Have = 1;
+		}
+	}
+	return HaveNum;
+}
\ No newline at end of file
@@ -0,0 +1,15 @@
+#ifndef __UPLOAD_DEDUP__
+#define __UPLOAD_DEDUP__
+
+#include "define.h"
+#include "conn_pool.h"
+#include "http_request.h"
+#include "http_response.h"
+#include "upload_engine.h"
+
+#define UPLOAD_DEDUP_UNSUPPORTED -2
+
+int upload_dedup_digest(const char *FilePathAndFileName, char *Digest);
+int upload_dedup_probe(const char *IpAddress, u_short Port, char *SendBuffer, int SendBufferLen, UPLOAD_JOB *Job, int JobNum);
+
+#endif // __UPLOAD_DEDUP__
\ No newline at end of file
@@ -0,0 +1,870 @@
+#include "upload_engine.h"
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+
+#define UPLOAD_EVENT_READ 1
+#define UPLOAD_EVENT_WRITE 2
+
+static int upload_engine_watch(UPLOAD_ENGINE *Engine, UPLOAD_SLOT *Slot, int Events){
+#ifdef __linux__
+	struct epoll_event Event;
+	int Op;
+
+	if(Events == Slot->Events){
+		return 0;
+	}
+
+	Op = (Slot->Events == 0) ? EPOLL_CTL_ADD : (Events == 0 ? EPOLL_CTL_DEL : EPOLL_CTL_MOD);
+
+	memset(&Event, 0x00, sizeof Event);
+	Event.events = ((Events & UPLOAD_EVENT_READ) ? (uint32_t)EPOLLIN : 0) | ((Events & UPLOAD_EVENT_WRITE) ? (uint32_t)EPOLLOUT : 0);
+	Event.data.ptr = Slot;
+
+	if(epoll_ctl(Engine->PollFd, Op, Slot->Socket, &Event) == -1){
+		return -1;
+	}
+#endif
+	// without epoll the select() sets are rebuilt from Slot->Events every round
+	Slot->Events = Events;
+	return 0;
+}
+
+static void upload_engine_fail(UPLOAD_ENGINE *Engine, UPLOAD_SLOT *Slot, UPLOAD_STAGE *Stage, int Result){
+	int i = 0;
+
+	for(i = 0; i < Stage->JobNum; i ++){
+		Engine->Callback(&Slot->Job[Stage->JobFirst + i], Result, NULL, 0, Engine->CallbackArg);
+	}
+	Stage->JobNum = 0;
+}
+
+// What the status line says about the attempt. Overload and gateway errors
+// are worth another try later, the rest of 4xx will not get better.
+int upload_engine_status(int StatusCode){
+	if(StatusCode >= 200 && StatusCode < 300){
+		return UPLOAD_RESULT_OK;
+	}
+	if(StatusCode == 408){
+		return UPLOAD_RESULT_TIMEOUT;
+	}
+	if(StatusCode == 429 || StatusCode >= 500){
+		return UPLOAD_RESULT_SERVER;
+	}
+	return UPLOAD_RESULT_REFUSED;
+}
+
+// Only the first request on a connection times a clean round trip; the ones
+// pipelined behind it waited in line, so their successes tell the window
+// nothing.
+static void upload_engine_sample(UPLOAD_ENGINE *Engine, UPLOAD_SLOT *Slot, int Success){
+	if(!Success){
+		upload_window_failure(&Engine->Window, Slot->StartTick, net_tick_ms());
+	}
+	else if(Slot->RecvStage == 0){
+		upload_window_success(&Engine->Window, Slot->StartTick, net_tick_ms());
+	}
+}
+
+// Settles the request at the head of the pipeline with what came back for it.
+static void upload_engine_complete(UPLOAD_ENGINE *Engine, UPLOAD_SLOT *Slot, UPLOAD_STAGE *Stage, int Result){
+	int BatchResult[UPLOAD_BATCH_MAX_COUNT];
+	UPLOAD_JOB *Job = &Slot->Job[Stage->JobFirst];
+	int AckNum = 0;
+	int Status = 0;
+	int i = 0;
+
+	// an endpoint that answered is up, whatever it said, unless it was
+	// too busy to take the request
+	Status = upload_engine_status(Slot->Response.Parser.StatusCode);
+	if(Result != UPLOAD_RESULT_OK || Status == UPLOAD_RESULT_SERVER || Status == UPLOAD_RESULT_TIMEOUT){
+		endpoint_failure(Slot->Endpoint);
+	}
+	else{
+		endpoint_success(Slot->Endpoint);
+	}
+
+	if(Result != UPLOAD_RESULT_OK){
+		upload_engine_sample(Engine, Slot, 0);
+		upload_engine_fail(Engine, Slot, Stage, Result);
+		return;
+	}
+
+	http_encoding_learn(Slot->Response.Buffer, Slot->Response.Parser.HeaderLen, Slot->Response.Parser.StatusCode);
+
+	Result = Status;
+	if(Result != UPLOAD_RESULT_OK){
+		upload_engine_sample(Engine, Slot, 0);
+		upload_engine_fail(Engine, Slot, Stage, Result);
+		return;
+	}
+
+	if(!Stage->Batched){
+		if(ParseRecvError(Slot->Response.Buffer + Slot->Response.Parser.BodyStart, Slot->Response.Parser.BodyLen) == 0){
+			upload_engine_sample(Engine, Slot, 1);
+		}
+		else{
+			upload_engine_sample(Engine, Slot, 0);
+			Result = UPLOAD_RESULT_REJECTED;
+		}
+		Engine->Callback(&Job[0], Result, Slot->Response.Buffer + Slot->Response.Parser.BodyStart, Slot->Response.Parser.BodyLen, Engine->CallbackArg);
+		Stage->JobNum = 0;
+		return;
+	}
+
+	// a batch is acknowledged item by item; the items have no body of their own
+	AckNum = ParseRecvBatch(Slot->Response.Buffer + Slot->Response.Parser.BodyStart, Slot->Response.Parser.BodyLen, BatchResult, Stage->JobNum);
+	upload_engine_sample(Engine, Slot, AckNum == Stage->JobNum);
+	for(i = 0; i < Stage->JobNum; i ++){
+		Engine->Callback(&Job[i], BatchResult[i] == 0 ? UPLOAD_RESULT_OK : UPLOAD_RESULT_REJECTED, NULL, 0, Engine->CallbackArg);
+	}
+	Stage->JobNum = 0;
+}
+
+// Closes the slot. Result is what became of the request at the head of the
+// pipeline, if one is still waiting for its answer; the requests behind it
+// were never answered and go back to the front of the queue, in order, to be
+// sent again on another connection.
+static void upload_engine_finish(UPLOAD_ENGINE *Engine, UPLOAD_SLOT *Slot, int Result){
+	int i = 0;
+
+	if(Slot->Streaming){
+		http_stream_close(&Slot->Stream);
+		Slot->Streaming = 0;
+	}
+
+	// the kernel may still read from send buffers it was lent; once the
+	// server has answered their completions are due any moment, and a socket
+	// that still owes some is not handed to anyone else
+	if(Result == UPLOAD_RESULT_OK && Slot->ZeroCopy.Done != Slot->ZeroCopy.Sent){
+		net_zerocopy_wait(Slot->Socket, &Slot->ZeroCopy, NET_ZEROCOPY_TIMEOUT);
+	}
+
+	upload_engine_watch(Engine, Slot, 0);
+	conn_pool_release(Slot->IpAddress, Slot->Port, Slot->Socket, Result == UPLOAD_RESULT_OK && Slot->KeepAlive && Slot->RecvStage == Slot->StageNum && Slot->ZeroCopy.Done == Slot->ZeroCopy.Sent);
+
+	timer_wheel_remove(&Engine->Wheel, &Slot->Deadline);
+	timer_wheel_remove(&Engine->Wheel, &Slot->TotalDeadline);
+	timer_wheel_remove(&Engine->Wheel, &Slot->Resume);
+
+	Slot->Socket = INVALID_SOCKET;
+	Slot->State = UPLOAD_SLOT_IDLE;
+	Engine->InFlight --;
+
+	if(Slot->RecvStage == Slot->StageNum){
+		Slot->JobNum = 0;
+		return;
+	}
+
+	// a pooled socket the server closed while it sat idle fails before any
+	// response byte arrives; that is not the job's fault, so run it again once
+	if(Result != UPLOAD_RESULT_OK && Slot->Reused && Slot->RecvStage == 0 && Slot->Response.Len == 0 && Slot->Job[0].Requeued == 0){
+		for(i = Slot->JobNum - 1; i >= 0; i --){
+			Slot->Job[i].Requeued ++;
+			Engine->Pending->push_front(Slot->Job[i]);
+		}
+		Slot->JobNum = 0;
+		return;
+	}
+
+	// a server may close after any answer, so a request behind an answered
+	// one with nothing of its own answer in yet is not the one to blame
+	if(Result != UPLOAD_RESULT_OK && (Slot->RecvStage == 0 || Slot->Response.Len > 0)){
+		upload_engine_complete(Engine, Slot, &Slot->Stage[Slot->RecvStage], Result);
+		Slot->RecvStage ++;
+	}
+
+	if(Slot->RecvStage < Slot->StageNum){
+		for(i = Slot->JobNum - 1; i >= Slot->Stage[Slot->RecvStage].JobFirst; i --){
+			Engine->Pending->push_front(Slot->Job[i]);
+		}
+	}
+	Slot->JobNum = 0;
+}
+
+// Fills Stage, whose first job is in place already at the end of the slot's
+// jobs, with as many of the pending jobs behind it as fit in the count and
+// byte budget and builds its request. TotalSize is what the first job adds to
+// the body. On failure the stage's jobs have been reported to the callback.
+static int upload_engine_build(UPLOAD_ENGINE *Engine, UPLOAD_SLOT *Slot, UPLOAD_STAGE *Stage, long long TotalSize){
+	struct stat FileStat;
+	HTTP_UPLOAD_ITEM Item[UPLOAD_BATCH_MAX_COUNT];
+	UPLOAD_JOB *Job = &Slot->Job[Stage->JobFirst];
+	char *NewBuffer;
+	long long FileSize = 0;
+	int BufferSize = 0;
+	int i = 0;
+
+	// a batch goes to a single endpoint, so it holds a single folder
+	while(!Slot->Streaming && Stage->JobNum < Engine->BatchCount && !Engine->Pending->empty()){
+		if(strcmp(Engine->Pending->front().FilePath, Job[0].FilePath) != 0){
+			break;
+		}
+		if(stat(Engine->Pending->front().FilePathAndFileName, &FileStat) == -1){
+			break;
+		}
+		FileSize = Engine->Pending->front().Have ? 0 : FileStat.st_size;
+		if(FileSize > UPLOAD_STREAM_THRESHOLD || TotalSize + FileSize > Engine->BatchBytes){
+			break;
+		}
+		TotalSize += FileSize;
+		Job[Stage->JobNum ++] = Engine->Pending->front();
+		Slot->JobNum ++;
+		Engine->Pending->pop_front();
+	}
+
+	// each request in flight needs its own body buffer, sized for its files
+	// only, with room behind it for the compressed copy; big files are
+	// streamed through a single block instead
+	if(Slot->Streaming){
+		BufferSize = UPLOAD_STREAM_BLOCK;
+	}
+	else{
+		BufferSize = (int)TotalSize * (http_encoding_active() ? 2 : 1) + SOCKET_MAX_BUF;
+	}
+	if(BufferSize > Stage->SendBufferSize){
+		NewBuffer = (char *)realloc(Stage->SendBuffer, BufferSize);
+		if(NewBuffer == NULL){
+			Slot->Streaming = 0;
+			upload_engine_fail(Engine, Slot, Stage, UPLOAD_RESULT_LOCAL);
+			return -1;
+		}
+		Stage->SendBuffer = NewBuffer;
+		Stage->SendBufferSize = BufferSize;
+	}
+
+	// only the batch format carries digests, so a lone job with one is a
+	// batch of one
+	Stage->Batched = !Slot->Streaming && (Stage->JobNum > 1 || Job[0].Digest[0] != 0x00);
+
+	if(Slot->Streaming){
+		Stage->SendLen = http_stream_open(&Slot->Stream, Slot->IpAddress, Slot->Port, &Stage->Request, Stage->SendBuffer, UPLOAD_STREAM_BLOCK, Job[0].FilePath, Job[0].FilePathAndFileName);
+	}
+	else if(Stage->Batched){
+		for(i = 0; i < Stage->JobNum; i ++){
+			Item[i].FilePath = Job[i].FilePath;
+			Item[i].FilePathAndFileName = Job[i].FilePathAndFileName;
+			Item[i].Digest = Job[i].Digest;
+			Item[i].Have = Job[i].Have;
+		}
+		Stage->SendLen = construct_http_batch(Slot->IpAddress, Slot->Port, &Stage->Request, Stage->SendBuffer, Stage->SendBufferSize, Item, Stage->JobNum);
+	}
+	else{
+		Stage->SendLen = construct_http(Slot->IpAddress, Slot->Port, POST_API_ACTION_UPLOAD, &Stage->Request, Stage->SendBuffer, Stage->SendBufferSize, NULL, NULL, Job[0].FilePath, Job[0].FilePathAndFileName, Job[0].UploadType);
+	}
+	if(Stage->SendLen == -1){
+		Slot->Streaming = 0;
+		upload_engine_fail(Engine, Slot, Stage, UPLOAD_RESULT_LOCAL);
+		return -1;
+	}
+	return 0;
+}
+
+// Takes Job plus, when batching, as many of the pending jobs behind it as fit
+// in the count and byte budget. With pipelining, more requests for the same
+// folder are queued behind it on the connection, up to the pipeline depth,
+// each one taking a request token. Big files always travel alone as a stream.
+// On failure every job taken has been reported to the callback.
+static int upload_engine_start(UPLOAD_ENGINE *Engine, UPLOAD_SLOT *Slot, UPLOAD_JOB *Job){
+	unsigned long long WaitMs = 0;
+	struct stat FileStat;
+	UPLOAD_STAGE *Stage;
+	long long FileSize = 0;
+	int PoolRes = 0;
+	int i = 0;
+
+	Slot->Job[0] = *Job;
+	Slot->JobNum = 1;
+	Slot->Stage[0].JobFirst = 0;
+	Slot->Stage[0].JobNum = 1;
+	Slot->StageNum = 1;
+	Slot->SendStage = 0;
+	Slot->RecvStage = 0;
+	Slot->SendPos = 0;
+	Slot->KeepAlive = 0;
+	Slot->StartTick = net_tick_ms();
+	Slot->Response.Len = 0;
+	http_parser_init(&Slot->Response.Parser);
+
+	if(stat(Slot->Job[0].FilePathAndFileName, &FileStat) == -1){
+		upload_engine_fail(Engine, Slot, &Slot->Stage[0], UPLOAD_RESULT_LOCAL);
+		return -1;
+	}
+	Slot->Endpoint = endpoint_pick(Slot->Job[0].FilePath, Slot->IpAddress, &Slot->Port);
+	if(Slot->Endpoint == -1){
+		upload_engine_fail(Engine, Slot, &Slot->Stage[0], UPLOAD_RESULT_CONNECT);
+		return -1;
+	}
+
+	// a reference to content the server has is next to nothing on the wire,
+	// however big the file
+	FileSize = Slot->Job[0].Have ? 0 : FileStat.st_size;
+	Slot->Streaming = (FileSize > UPLOAD_STREAM_THRESHOLD);
+
+	if(upload_engine_build(Engine, Slot, &Slot->Stage[0], FileSize) == -1){
+		return -1;
+	}
+
+	// a folder maps to one endpoint, so its pending jobs may share the
+	// connection; a job that cannot be stat'ed is left for its own start to
+	// report
+	while(!Slot->Streaming && Slot->StageNum < Engine->PipelineDepth && !Engine->Pending->empty()){
+		if(strcmp(Engine->Pending->front().FilePath, Slot->Job[0].FilePath) != 0){
+			break;
+		}
+		if(stat(Engine->Pending->front().FilePathAndFileName, &FileStat) == -1){
+			break;
+		}
+		FileSize = Engine->Pending->front().Have ? 0 : FileStat.st_size;
+		if(FileSize > UPLOAD_STREAM_THRESHOLD){
+			break;
+		}
+		if(rate_limit_request(&WaitMs) == 0){
+			break;
+		}
+
+		Stage = &Slot->Stage[Slot->StageNum];
+		Stage->JobFirst = Slot->JobNum;
+		Stage->JobNum = 1;
+		Slot->Job[Slot->JobNum ++] = Engine->Pending->front();
+		Engine->Pending->pop_front();
+
+		if(upload_engine_build(Engine, Slot, Stage, FileSize) == -1){
+			Slot->JobNum = Stage->JobFirst;
+			continue;
+		}
+		Slot->StageNum ++;
+	}
+
+	PoolRes = conn_pool_acquire(Slot->IpAddress, Slot->Port, 1, &Slot->Socket);
+	if(PoolRes == -1){
+		endpoint_failure(Slot->Endpoint);
+		upload_window_failure(&Engine->Window, Slot->StartTick, net_tick_ms());
+		if(Slot->Streaming){
+			http_stream_close(&Slot->Stream);
+			Slot->Streaming = 0;
+		}
+		for(i = 0; i < Slot->StageNum; i ++){
+			upload_engine_fail(Engine, Slot, &Slot->Stage[i], UPLOAD_RESULT_CONNECT);
+		}
+		Slot->JobNum = 0;
+		return -1;
+	}
+
+	Slot->Reused = (PoolRes == CONN_POOL_REUSED);
+
+	// a streamed file goes from the page cache already; the bodies built in
+	// memory are lent to the kernel instead of copied where it can
+	if(Slot->Streaming){
+		memset(&Slot->ZeroCopy, 0x00, sizeof Slot->ZeroCopy);
+	}
+	else{
+		net_zerocopy_enable(Slot->Socket, &Slot->ZeroCopy);
+	}
+	Slot->State = (PoolRes == CONN_POOL_CONNECTING) ? UPLOAD_SLOT_CONNECTING : UPLOAD_SLOT_SENDING;
+	Slot->Events = 0;
+	Engine->InFlight ++;
+
+	timer_wheel_add(&Engine->Wheel, &Slot->TotalDeadline, REQUEST_TIMEOUT_TOTAL, net_tick_ms());
+	timer_wheel_add(&Engine->Wheel, &Slot->Deadline, Slot->State == UPLOAD_SLOT_CONNECTING ? REQUEST_TIMEOUT_CONNECT : REQUEST_TIMEOUT_SEND, net_tick_ms());
+
+	if(upload_engine_watch(Engine, Slot, UPLOAD_EVENT_WRITE) == -1){
+		upload_engine_finish(Engine, Slot, UPLOAD_RESULT_FAILED);
+	}
+	return 0;
+}
+
+static void upload_engine_dispatch(UPLOAD_ENGINE *Engine){
+	unsigned long long WaitMs = 0;
+	UPLOAD_JOB Job;
+	int i = 0;
+
+	// held back by the request rate until then
+	if(Engine->DispatchResume != 0){
+		if(net_tick_ms() < Engine->DispatchResume){
+			return;
+		}
+		Engine->DispatchResume = 0;
+	}
+
+	for(i = 0; i < Engine->MaxInFlight && !Engine->Pending->empty(); i ++){
+		if(Engine->InFlight >= upload_window_get(&Engine->Window)){
+			break;
+		}
+		if(Engine->Slot[i].State != UPLOAD_SLOT_IDLE){
+			continue;
+		}
+		if(rate_limit_request(&WaitMs) == 0){
+			Engine->DispatchResume = net_tick_ms() + WaitMs;
+			break;
+		}
+
+		Job = Engine->Pending->front();
+		Engine->Pending->pop_front();
+
+		upload_engine_start(Engine, &Engine->Slot[i], &Job);
+	}
+}
+
+static void upload_engine_handle(UPLOAD_ENGINE *Engine, UPLOAD_SLOT *Slot){
+	unsigned long long WaitMs = 0;
+	int SocketError = 0;
+	socklen_t SocketErrorLen = sizeof SocketError;
+	UPLOAD_STAGE *Stage;
+	char *RecvPos;
+	int Space = 0;
+	int Allowed = 0;
+	int ParseRes = 0;
+	int Res = 0;
+
+	// completions come in on the error queue and keep the socket flagged
+	// until they are taken
+	if(Slot->ZeroCopy.Done != Slot->ZeroCopy.Sent && net_zerocopy_reap(Slot->Socket, &Slot->ZeroCopy) == -1){
+		upload_engine_finish(Engine, Slot, UPLOAD_RESULT_FAILED);
+		return;
+	}
+
+	switch(Slot->State){
+	case UPLOAD_SLOT_CONNECTING:
+		if(getsockopt(Slot->Socket, SOL_SOCKET, SO_ERROR, (char *)&SocketError, &SocketErrorLen) == SOCKET_ERROR || SocketError != 0){
+			upload_engine_finish(Engine, Slot, UPLOAD_RESULT_CONNECT);
+			return;
+		}
+		Slot->State = UPLOAD_SLOT_SENDING;
+		timer_wheel_add(&Engine->Wheel, &Slot->Deadline, REQUEST_TIMEOUT_SEND, net_tick_ms());
+		// fall through, the socket is writable already
+	case UPLOAD_SLOT_SENDING:
+		// pipelined requests go out back to back, without waiting for answers
+		while(Slot->SendStage < Slot->StageNum){
+			Stage = &Slot->Stage[Slot->SendStage];
+
+			// out of byte tokens: park the slot off the poll set until they
+			// refill; the wait is ours, so the send deadline stops meanwhile
+			Allowed = rate_limit_bytes(Stage->SendLen - Slot->SendPos, &WaitMs);
+			if(Allowed == 0){
+				if(upload_engine_watch(Engine, Slot, 0) == -1){
+					upload_engine_finish(Engine, Slot, UPLOAD_RESULT_FAILED);
+					return;
+				}
+				timer_wheel_remove(&Engine->Wheel, &Slot->Deadline);
+				timer_wheel_add(&Engine->Wheel, &Slot->Resume, (int)WaitMs, net_tick_ms());
+				return;
+			}
+
+			Res = net_send_segments_zerocopy(Slot->Socket, Stage->Request.Segment, Stage->Request.SegmentNum, Slot->SendPos, Allowed, &Slot->ZeroCopy);
+			if(Res == SOCKET_ERROR){
+				rate_limit_refund(Allowed);
+				if(net_would_block(net_last_error())){
+					return;
+				}
+				upload_engine_finish(Engine, Slot, UPLOAD_RESULT_FAILED);
+				return;
+			}
+			rate_limit_refund(Allowed - Res);
+			Slot->SendPos += Res;
+			timer_wheel_add(&Engine->Wheel, &Slot->Deadline, REQUEST_TIMEOUT_SEND, net_tick_ms());
+
+			if(Slot->SendPos < Stage->SendLen){
+				continue;
+			}
+
+			// the current chunk is out, so its block can be refilled
+			if(Slot->Streaming){
+				Res = http_stream_next(&Slot->Stream, &Stage->Request);
+				if(Res == -1){
+					upload_engine_finish(Engine, Slot, UPLOAD_RESULT_FAILED);
+					return;
+				}
+				if(Res == 1){
+					Slot->SendPos = 0;
+					Stage->SendLen = Stage->Request.Len;
+					continue;
+				}
+			}
+			Slot->SendStage ++;
+			Slot->SendPos = 0;
+		}
+		Slot->State = UPLOAD_SLOT_RECEIVING;
+		timer_wheel_add(&Engine->Wheel, &Slot->Deadline, REQUEST_TIMEOUT_FIRST_BYTE, net_tick_ms());
+		if(upload_engine_watch(Engine, Slot, UPLOAD_EVENT_READ) == -1){
+			upload_engine_finish(Engine, Slot, UPLOAD_RESULT_FAILED);
+		}
+		return;
+	case UPLOAD_SLOT_RECEIVING:
+		while(1){
+			RecvPos = http_response_reserve(&Slot->Response, &Space);
+			if(RecvPos == NULL){
+				upload_engine_finish(Engine, Slot, UPLOAD_RESULT_FAILED);
+				return;
+			}
+
+			Res = recv(Slot->Socket, RecvPos, Space, 0);
+			if(Res == SOCKET_ERROR){
+				if(net_would_block(net_last_error())){
+					return;
+				}
+				upload_engine_finish(Engine, Slot, UPLOAD_RESULT_FAILED);
+				return;
+			}
+			if(Res == 0){
+				Slot->KeepAlive = 0;
+				if(http_parser_finish(&Slot->Response.Parser, Slot->Response.Len) != 1){
+					upload_engine_finish(Engine, Slot, UPLOAD_RESULT_FAILED);
+					return;
+				}
+				upload_engine_complete(Engine, Slot, &Slot->Stage[Slot->RecvStage], UPLOAD_RESULT_OK);
+				Slot->RecvStage ++;
+				upload_engine_finish(Engine, Slot, UPLOAD_RESULT_OK);
+				return;
+			}
+
+			// the first byte is in, only the total deadline is left
+			timer_wheel_remove(&Engine->Wheel, &Slot->Deadline);
+
+			// answers come in the order the requests went out; one recv may
+			// hold the end of one and the start of the next
+			ParseRes = http_response_feed(&Slot->Response, Res);
+			while(ParseRes == 1){
+				Slot->KeepAlive = Slot->Response.Parser.KeepAlive;
+				upload_engine_complete(Engine, Slot, &Slot->Stage[Slot->RecvStage], UPLOAD_RESULT_OK);
+				Slot->RecvStage ++;
+
+				if(Slot->RecvStage == Slot->StageNum || !Slot->KeepAlive){
+					Slot->KeepAlive = Slot->KeepAlive && Slot->Response.Parser.ParsePos == Slot->Response.Len;
+					upload_engine_finish(Engine, Slot, UPLOAD_RESULT_OK);
+					return;
+				}
+
+				http_response_reset(&Slot->Response);
+				timer_wheel_add(&Engine->Wheel, &Slot->Deadline, REQUEST_TIMEOUT_FIRST_BYTE, net_tick_ms());
+				ParseRes = http_response_feed(&Slot->Response, 0);
+			}
+			if(ParseRes == -1){
+				upload_engine_finish(Engine, Slot, UPLOAD_RESULT_FAILED);
+				return;
+			}
+		}
+	}
+}
+
+int upload_engine_init(UPLOAD_ENGINE *Engine, int MaxInFlight, UPLOAD_ENGINE_CALLBACK Callback, void *CallbackArg){
+	int i = 0;
+
+	memset(Engine, 0x00, sizeof *Engine);
+
+	if(MaxInFlight <= 0 || MaxInFlight > UPLOAD_ENGINE_MAX_INFLIGHT){
+		MaxInFlight = UPLOAD_ENGINE_MAX_INFLIGHT;
+	}
+
+	Engine->MaxInFlight = MaxInFlight;
+	Engine->Callback = Callback;
+	Engine->CallbackArg = CallbackArg;
+
+#ifdef __linux__
+	Engine->PollFd = epoll_create(UPLOAD_ENGINE_MAX_INFLIGHT);
+	if(Engine->PollFd == -1){
+		return -1;
+	}
+#endif
+
+	timer_wheel_init(&Engine->Wheel, TIMER_WHEEL_TICK, net_tick_ms());
+
+	for(i = 0; i < UPLOAD_ENGINE_MAX_INFLIGHT; i ++){
+		Engine->Slot[i].State = UPLOAD_SLOT_IDLE;
+		Engine->Slot[i].Socket = INVALID_SOCKET;
+		timer_node_init(&Engine->Slot[i].Deadline, &Engine->Slot[i]);
+		timer_node_init(&Engine->Slot[i].TotalDeadline, &Engine->Slot[i]);
+		timer_node_init(&Engine->Slot[i].Resume, &Engine->Slot[i]);
+	}
+	Engine->BatchCount = 1;
+	Engine->BatchBytes = UPLOAD_STREAM_THRESHOLD;
+	Engine->PipelineDepth = 1;
+	Engine->StageSize = 1;
+
+	for(i = 0; i < MaxInFlight; i ++){
+		Engine->Slot[i].Job = (UPLOAD_JOB *)malloc(sizeof(UPLOAD_JOB));
+		Engine->Slot[i].Stage = (UPLOAD_STAGE *)calloc(1, sizeof(UPLOAD_STAGE));
+		if(Engine->Slot[i].Job == NULL || Engine->Slot[i].Stage == NULL || http_response_init(&Engine->Slot[i].Response) == -1){
+			upload_engine_cleanup(Engine);
+			return -1;
+		}
+	}
+	upload_window_init(&Engine->Window, 1, MaxInFlight, UPLOAD_WINDOW_INITIAL);
+
+	Engine->Pending = new std::deque<UPLOAD_JOB>();
+	return 0;
+}
+
+int upload_engine_cleanup(UPLOAD_ENGINE *Engine){
+	int i = 0;
+	int j = 0;
+
+	for(i = 0; i < UPLOAD_ENGINE_MAX_INFLIGHT; i ++){
+		if(Engine->Slot[i].Streaming){
+			http_stream_close(&Engine->Slot[i].Stream);
+			Engine->Slot[i].Streaming = 0;
+		}
+		if(Engine->Slot[i].State != UPLOAD_SLOT_IDLE){
+			upload_engine_watch(Engine, &Engine->Slot[i], 0);
+			conn_pool_release(Engine->Slot[i].IpAddress, Engine->Slot[i].Port, Engine->Slot[i].Socket, 0);
+			Engine->Slot[i].State = UPLOAD_SLOT_IDLE;
+		}
+		for(j = 0; Engine->Slot[i].Stage != NULL && j < Engine->StageSize; j ++){
+			free(Engine->Slot[i].Stage[j].SendBuffer);
+		}
+		free(Engine->Slot[i].Stage);
+		Engine->Slot[i].Stage = NULL;
+		free(Engine->Slot[i].Job);
+		Engine->Slot[i].Job = NULL;
+		http_response_free(&Engine->Slot[i].Response);
+	}
+
+#ifdef __linux__
+	if(Engine->PollFd > 0){
+		close(Engine->PollFd);
+	}
+#endif
+
+	delete Engine->Pending;
+	Engine->Pending = NULL;
+	Engine->InFlight = 0;
+	return 0;
+}
+
+// Lets one request carry up to MaxCount files whose sizes add up to no more
+// than MaxBytes. Only valid while nothing is in flight.
+int upload_engine_set_batch(UPLOAD_ENGINE *Engine, int MaxCount, int MaxBytes){
+	UPLOAD_JOB *NewJob;
+	int i = 0;
+
+	if(Engine->InFlight > 0){
+		return -1;
+	}
+	if(MaxCount <= 0 || MaxCount > UPLOAD_BATCH_MAX_COUNT){
+		MaxCount = UPLOAD_BATCH_MAX_COUNT;
+	}
+
+	for(i = 0; i < Engine->MaxInFlight; i ++){
+		NewJob = (UPLOAD_JOB *)realloc(Engine->Slot[i].Job, MaxCount * Engine->PipelineDepth * sizeof(UPLOAD_JOB));
+		if(NewJob == NULL){
+			return -1;
+		}
+		Engine->Slot[i].Job = NewJob;
+	}
+
+	Engine->BatchCount = MaxCount;
+	Engine->BatchBytes = MaxBytes;
+	return 0;
+}
+
+// Lets a connection carry up to Depth requests at once, written back to back
+// and answered in order. Only valid while nothing is in flight.
+int upload_engine_set_pipeline(UPLOAD_ENGINE *Engine, int Depth){
+	UPLOAD_STAGE *NewStage;
+	UPLOAD_JOB *NewJob;
+	int i = 0;
+
+	if(Engine->InFlight > 0){
+		return -1;
+	}
+	if(Depth <= 0 || Depth > UPLOAD_PIPELINE_MAX_DEPTH){
+		Depth = UPLOAD_PIPELINE_MAX_DEPTH;
+	}
+
+	for(i = 0; i < Engine->MaxInFlight; i ++){
+		NewJob = (UPLOAD_JOB *)realloc(Engine->Slot[i].Job, Engine->BatchCount * Depth * sizeof(UPLOAD_JOB));
+		if(NewJob == NULL){
+			return -1;
+		}
+		Engine->Slot[i].Job = NewJob;
+
+		// stages only grow, each keeps its send buffer for the next request
+		if(Depth > Engine->StageSize){
+			NewStage = (UPLOAD_STAGE *)realloc(Engine->Slot[i].Stage, Depth * sizeof(UPLOAD_STAGE));
+			if(NewStage == NULL){
+				return -1;
+			}
+			memset(NewStage + Engine->StageSize, 0x00, (Depth - Engine->StageSize) * sizeof(UPLOAD_STAGE));
+			Engine->Slot[i].Stage = NewStage;
+		}
+	}
+
+	if(Depth > Engine->StageSize){
+		Engine->StageSize = Depth;
+	}
+	Engine->PipelineDepth = Depth;
+	return 0;
+}
+
+// Queues a job and starts it as soon as a slot is free. When the backlog is
+// already as long as the number of slots the caller is held here, running
+// the event loop, so a fast directory scan cannot queue unbounded work.
+int upload_engine_submit(UPLOAD_ENGINE *Engine, UPLOAD_JOB *Job){
+	Engine->Pending->push_back(*Job);
+	upload_engine_dispatch(Engine);
+
+	// keep enough queued behind the slots to fill a batch on every stage
+	while((int)Engine->Pending->size() >= Engine->MaxInFlight * Engine->BatchCount * Engine->PipelineDepth){
+		if(upload_engine_poll(Engine, -1) == -1){
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// Shortens Timeout to the next deadline or the first moment the rate
+// limiter lets a parked slot or the dispatcher go on.
+static int upload_engine_timeout(UPLOAD_ENGINE *Engine, int Timeout){
+	unsigned long long Now = 0;
+	int Next = 0;
+
+	Next = timer_wheel_next(&Engine->Wheel);
+	if(Next != -1 && (Timeout < 0 || Next < Timeout)){
+		Timeout = Next;
+	}
+
+	if(Engine->DispatchResume != 0){
+		Now = net_tick_ms();
+		if(Engine->DispatchResume <= Now){
+			return 0;
+		}
+		if(Timeout < 0 || Engine->DispatchResume - Now < (unsigned long long)Timeout){
+			Timeout = (int)(Engine->DispatchResume - Now);
+		}
+	}
+	return Timeout;
+}
+
+// A parked slot may send again, or a deadline passed and its request fails.
+static void upload_engine_expire(TIMER_NODE *Node, void *CallbackArg){
+	UPLOAD_ENGINE *Engine = (UPLOAD_ENGINE *)CallbackArg;
+	UPLOAD_SLOT *Slot = (UPLOAD_SLOT *)Node->Data;
+
+	if(Slot->State == UPLOAD_SLOT_IDLE){
+		return;
+	}
+
+	if(Node == &Slot->Resume){
+		timer_wheel_add(&Engine->Wheel, &Slot->Deadline, REQUEST_TIMEOUT_SEND, net_tick_ms());
+		if(upload_engine_watch(Engine, Slot, UPLOAD_EVENT_WRITE) == -1){
+			upload_engine_finish(Engine, Slot, UPLOAD_RESULT_FAILED);
+			return;
+		}
+		upload_engine_handle(Engine, Slot);
+		return;
+	}
+
+	// a connect that never completes is a connect failure, not a slow server
+	upload_engine_finish(Engine, Slot, Slot->State == UPLOAD_SLOT_CONNECTING ? UPLOAD_RESULT_CONNECT : UPLOAD_RESULT_TIMEOUT);
+}
+
+// Waits up to Timeout milliseconds (-1 forever) for socket events, advances
+// every ready request and refills the freed slots from the pending queue.
+int upload_engine_poll(UPLOAD_ENGINE *Engine, int Timeout){
+	int Num = 0;
+	int i = 0;
+
+	// control requests queued behind this upload go first
+	traffic_lane_yield();
+	upload_engine_dispatch(Engine);
+	Timeout = traffic_lane_slice(upload_engine_timeout(Engine, Timeout));
+	if(Engine->InFlight == 0){
+		if(Engine->DispatchResume != 0 && Timeout > 0){
+			net_sleep_ms(Timeout);
+			upload_engine_dispatch(Engine);
+		}
+		return 0;
+	}
+
+#ifdef __linux__
+	struct epoll_event Events[UPLOAD_ENGINE_MAX_INFLIGHT];
+
+	Num = epoll_wait(Engine->PollFd, Events, UPLOAD_ENGINE_MAX_INFLIGHT, Timeout);
+	if(Num == -1){
+		return (errno == EINTR) ? 0 : -1;
+	}
+
+	for(i = 0; i < Num; i ++){
+		upload_engine_handle(Engine, (UPLOAD_SLOT *)Events[i].data.ptr);
+	}
+#else
+	fd_set ReadSet, WriteSet, ExceptSet;
+	struct timeval TimeVal;
+	SOCKET MaxSocket = 0;
+	int Watched = 0;
+
+	FD_ZERO(&ReadSet);
+	FD_ZERO(&WriteSet);
+	FD_ZERO(&ExceptSet);
+
+	for(i = 0; i < Engine->MaxInFlight; i ++){
+		UPLOAD_SLOT *Slot = &Engine->Slot[i];
+
+		if(Slot->State == UPLOAD_SLOT_IDLE || timer_node_active(&Slot->Resume)){
+			continue;
+		}
+		Watched ++;
+		if(Slot->Events & UPLOAD_EVENT_READ){
+			FD_SET(Slot->Socket, &ReadSet);
+		}
+		if(Slot->Events & UPLOAD_EVENT_WRITE){
+			FD_SET(Slot->Socket, &WriteSet);
+		}
+		// Winsock reports a failed non-blocking connect as an exception
+		if(Slot->State == UPLOAD_SLOT_CONNECTING){
+			FD_SET(Slot->Socket, &ExceptSet);
+		}
+		if(Slot->Socket > MaxSocket){
+			MaxSocket = Slot->Socket;
+		}
+	}
+
+	TimeVal.tv_sec = Timeout / 1000;
+	TimeVal.tv_usec = (Timeout % 1000) * 1000;
+
+	// Winsock refuses a select on three empty sets, so with every slot
+	// parked just sleep until the first one may go on
+	if(Watched == 0){
+		net_sleep_ms(Timeout < 0 ? 0 : Timeout);
+		Num = 0;
+	}
+	else{
+		Num = select((int)MaxSocket + 1, &ReadSet, &WriteSet, &ExceptSet, Timeout < 0 ? NULL : &TimeVal);
+		if(Num == SOCKET_ERROR){
+			return -1;
+		}
+	}
+
+	for(i = 0; i < Engine->MaxInFlight && Watched > 0; i ++){
+		UPLOAD_SLOT *Slot = &Engine->Slot[i];
+
+		if(Slot->State == UPLOAD_SLOT_IDLE || timer_node_active(&Slot->Resume)){
+			continue;
+		}
+		if(FD_ISSET(Slot->Socket, &ReadSet) || FD_ISSET(Slot->Socket, &WriteSet) || FD_ISSET(Slot->Socket, &ExceptSet)){
+			upload_engine_handle(Engine, Slot);
+		}
+	}
+#endif
+
+	timer_wheel_advance(&Engine->Wheel, net_tick_ms(), upload_engine_expire, Engine);
+	upload_engine_dispatch(Engine);
+	return Num;
+}
+
+int upload_engine_flush(UPLOAD_ENGINE *Engine){
+	upload_engine_dispatch(Engine);
+
+	while(Engine->InFlight > 0 || !Engine->Pending->empty()){
+		if(upload_engine_poll(Engine, -1) == -1){
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// how many requests the concurrency controller currently lets fly at once
+int upload_engine_window(UPLOAD_ENGINE *Engine){
+	return upload_window_get(&Engine->Window);
+}
\ No newline at end of file
@@ -0,0 +1,114 @@
+#ifndef __UPLOAD_ENGINE__
+#define __UPLOAD_ENGINE__
+
+#include "define.h"
+#include "conn_pool.h"
+#include "http_request.h"
+#include "http_response.h"
+#include "upload_window.h"
+#include "rate_limit.h"
+#include "timer_wheel.h"
+#include "endpoint.h"
+#include "traffic_lane.h"
+
+#include <deque>
+
+#define UPLOAD_ENGINE_MAX_INFLIGHT 64
+#define UPLOAD_PIPELINE_MAX_DEPTH 16
+
+#define UPLOAD_DIGEST_LEN 41
+
+#define UPLOAD_SLOT_IDLE 0
+#define UPLOAD_SLOT_CONNECTING 1
+#define UPLOAD_SLOT_SENDING 2
+#define UPLOAD_SLOT_RECEIVING 3
+
+#define UPLOAD_RESULT_OK 0
+#define UPLOAD_RESULT_FAILED -1
+#define UPLOAD_RESULT_TIMEOUT -2
+#define UPLOAD_RESULT_CONNECT -3
+#define UPLOAD_RESULT_SERVER -4
+#define UPLOAD_RESULT_REJECTED -5
+#define UPLOAD_RESULT_REFUSED -6
+#define UPLOAD_RESULT_LOCAL -7
+
+typedef struct{
+	char FilePath[FILE_NAME_LEN];
+	char FilePathAndFileName[FILE_NAME_LEN];
+	int UploadType;
+	int Attempts;
+	unsigned int RetryId;
+	int RetryDelay;
+	int Requeued;
+	char Digest[UPLOAD_DIGEST_LEN];
+	int Have;
+}UPLOAD_JOB;
+
+typedef void (*UPLOAD_ENGINE_CALLBACK)(UPLOAD_JOB *Job, int Result, const char *Body, int BodyLen, void *CallbackArg);
+
+// one request on a connection and the jobs it carries
+typedef struct{
+	HTTP_REQUEST Request;
+	char *SendBuffer;
+	int SendBufferSize;
+	int SendLen;
+	int JobFirst;
+	int JobNum;
+	int Batched;
+}UPLOAD_STAGE;
+
+typedef struct{
+	int State;
+	int Events;
+	int Endpoint;
+	char IpAddress[MARK_MAX_BUF];
+	u_short Port;
+	SOCKET Socket;
+	int Reused;
+	unsigned long long StartTick;
+	TIMER_NODE Deadline;
+	TIMER_NODE TotalDeadline;
+	TIMER_NODE Resume;
+	UPLOAD_JOB *Job;
+	int JobNum;
+	UPLOAD_STAGE *Stage;
+	int StageNum;
+	int SendStage;
+	int RecvStage;
+	int SendPos;
+	HTTP_STREAM Stream;
+	int Streaming;
+	NET_ZEROCOPY ZeroCopy;
+	HTTP_RESPONSE Response;
+	int KeepAlive;
+}UPLOAD_SLOT;
+
+typedef struct{
+	int MaxInFlight;
+	int InFlight;
+	UPLOAD_WINDOW Window;
+	unsigned long long DispatchResume;
+	TIMER_WHEEL Wheel;
+	int PollFd;
+	UPLOAD_SLOT Slot[UPLOAD_ENGINE_MAX_INFLIGHT];
+	int BatchCount;
+	int BatchBytes;
+	int PipelineDepth;
+	int StageSize;
+	std::deque<UPLOAD_JOB> *Pending;
+	UPLOAD_ENGINE_CALLBACK Callback;
+	void *CallbackArg;
+}UPLOAD_ENGINE;
+
+int upload_engine_init(UPLOAD_ENGINE *Engine, int MaxInFlight, UPLOAD_ENGINE_CALLBACK Callback, void *CallbackArg);
+int upload_engine_cleanup(UPLOAD_ENGINE *Engine);
+
+int upload_engine_set_batch(UPLOAD_ENGINE *Engine, int MaxCount, int MaxBytes);
+int upload_engine_set_pipeline(UPLOAD_ENGINE *Engine, int Depth);
+int upload_engine_submit(UPLOAD_ENGINE *Engine, UPLOAD_JOB *Job);
+int upload_engine_poll(UPLOAD_ENGINE *Engine, int Timeout);
+int upload_engine_flush(UPLOAD_ENGINE *Engine);
+int upload_engine_window(UPLOAD_ENGINE *Engine);
+int upload_engine_status(int StatusCode);
+
+#endif // __UPLOAD_ENGINE__
\ No newline at end of file
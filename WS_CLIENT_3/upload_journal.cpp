@@ -0,0 +1,395 @@
+#include "upload_journal.h"
+#include "net_socket.h"
+
+#include <Poco/Mutex.h>
+#include <Poco/Event.h>
+#include <Poco/Runnable.h>
+#include <Poco/Thread.h>
+
+#include <set>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <sys/types.h>
+#endif
+
+// Upload progress goes to an append-only journal of scan and ack records.
+// Appending only puts a record in memory; a writer thread commits what has
+// gathered with one write and one fsync once UPLOAD_JOURNAL_COMMIT_COUNT
+// records wait or the oldest has waited UPLOAD_JOURNAL_COMMIT_INTERVAL, so
+// the disk sees a group of records at a time and not a file open per email.
+// An ack counts as sent as soon as it is appended. Every
+// UPLOAD_JOURNAL_COMPACT_COUNT acks the writer moves the committed ones into
+// the sent index, syncs it and empties the journal; a crash in between
+// leaves them in the journal, and opening it moves them again. A record cut
+// off by a crash fails its checksum and ends the replay.
+//
+// Record: u8 type, u16 length, u32 checksum of type, length and text, text.
+
+#define UPLOAD_JOURNAL_RECORD_HEADER 7
+
+class UploadJournalWriter : public Poco::Runnable{
+public:
+	void run();
+};
+
+static UploadJournalWriter Writer;
+static Poco::Thread *UploadJournalThread = NULL;
+static Poco::FastMutex UploadJournalMutex;
+static Poco::FastMutex UploadJournalFileMutex;
+static Poco::Event UploadJournalWake;
+static int UploadJournalFile = -1;
+static int UploadJournalStop = 0;
+static std::vector<char> UploadJournalBuffer;
+static int UploadJournalBuffered = 0;
+static unsigned long long UploadJournalOldest = 0;
+static std::vector<std::string> UploadJournalCommitted;
+static std::set<std::string> UploadJournalAcked;
+
+static int upload_journal_fsync(int File){
+#ifdef _WIN32
+	return _commit(File);
+#else
+	return fsync(File);
+#endif
+}
+
+static void upload_journal_close_file(int File){
+#ifdef _WIN32
+	_close(File);
+#else
+	close(File);
+#endif
+}
+
+static int upload_journal_truncate(int File){
+#ifdef _WIN32
+	return _chsize_s(File, 0) == 0 ? 0 : -1;
+#else
+	return ftruncate(File, 0);
+#endif
+}
+
+static int upload_journal_write(int File, const char *Buffer, int Len){
+	int Ret = 0;
+
+	while(Len > 0){
+#ifdef _WIN32
+		Ret = _write(File, Buffer, (unsigned int)Len);
+#else
+		Ret = (int)write(File, Buffer, (size_t)Len);
+		if(Ret == -1 && errno == EINTR){
+			continue;
+		}
+#endif
+		if(Ret <= 0){
+			return -1;
+		}
+		Buffer += Ret;
+		Len -= Ret;
+	}
+	return 0;
+}
+
+static unsigned int upload_journal_checksum(unsigned int Sum, const unsigned char *Data, int Len){
+	int i = 0;
+
+	for(i = 0; i < Len; i ++){
+		Sum = (Sum ^ Data[i]) * 0x01000193;
+	}
+	return Sum;
+}
+
+// the same A-Z folding the sent index digests with
+static std::string upload_journal_fold(const char *Key){
+	std::string Folded(Key);
+	std::string::size_type i = 0;
+
+	for(i = 0; i < Folded.size(); i ++){
+		if(Folded[i] >= 'A' && Folded[i] <= 'Z'){
+			Folded[i] = Folded[i] - 'A' + 'a';
+		}
+	}
+	return Folded;
+}
+
+static int upload_journal_append(int Type, const char *Text){
+	unsigned char Header[UPLOAD_JOURNAL_RECORD_HEADER];
+	unsigned int Sum = 0;
+	int Len = (int)strlen(Text);
+
+	if(Len > 0xffff){
+		return -1;
+	}
+	Header[0] = (unsigned char)Type;
+	Header[1] = (unsigned char)(Len & 0xff);
+	Header[2] = (unsigned char)(Len >> 8);
+	Sum = upload_journal_checksum(0x811c9dc5, Header, 3);
+	Sum = upload_journal_checksum(Sum, (const unsigned char *)Text, Len);
+	Header[3] = (unsigned char)(Sum & 0xff);
+	Header[4] = (unsigned char)(Sum >> 8);
+	Header[5] = (unsigned char)(Sum >> 16);
+	Header[6] = (unsigned char)(Sum >> 24);
+
+	Poco::FastMutex::ScopedLock Lock(UploadJournalMutex);
+	if(UploadJournalFile == -1){
+		return -1;
+	}
+	if(UploadJournalBuffered == 0){
+		UploadJournalOldest = net_tick_ms();
+	}
+	UploadJournalBuffer.insert(UploadJournalBuffer.end(), (char *)Header, (char *)Header + sizeof Header);
+	UploadJournalBuffer.insert(UploadJournalBuffer.end(), Text, Text + Len);
+	UploadJournalBuffered ++;
+	if(Type == UPLOAD_JOURNAL_ACK){
+		UploadJournalAcked.insert(upload_journal_fold(Text));
+	}
+	if(UploadJournalBuffered >= UPLOAD_JOURNAL_COMMIT_COUNT){
+		UploadJournalWake.set();
+	}
+	return 0;
+}
+
+// Moves the committed acks into the sent index and empties the journal.
+// Runs with the file lock held.
+static void upload_journal_compact(){
+	std::vector<std::string> Keys;
+	int Res = 0;
+	int i = 0;
+
+	{
+		Poco::FastMutex::ScopedLock Lock(UploadJournalMutex);
+		Keys.swap(UploadJournalCommitted);
+	}
+	for(i = 0; i < (int)Keys.size() && Res == 0; i ++){
+		Res = sent_index_add(Keys[i].c_str());
+	}
+	if(Res == -1 || sent_index_sync() == -1){
+		// the journal keeps them until they are all in the index, synced
+		Poco::FastMutex::ScopedLock Lock(UploadJournalMutex);
+		UploadJournalCommitted.insert(UploadJournalCommitted.begin(), Keys.begin(), Keys.end());
+		return;
+	}
+
+	// records appended meanwhile are only buffered, the file holds nothing
+	// the index does not
+	Poco::FastMutex::ScopedLock Lock(UploadJournalMutex);
+	for(i = 0; i < (int)Keys.size(); i ++){
+		UploadJournalAcked.erase(Keys[i]);
+	}
+	upload_journal_truncate(UploadJournalFile);
+}
+
+// Writes and syncs what has gathered, as one group.
+static int upload_journal_flush(){
+	std::vector<char> Buffer;
+	std::vector<std::string> Keys;
+	int Pos = 0;
+	int Len = 0;
+	int Res = 0;
+	int Compact = 0;
+
+	Poco::FastMutex::ScopedLock FileLock(UploadJournalFileMutex);
+	{
+		Poco::FastMutex::ScopedLock Lock(UploadJournalMutex);
+		if(UploadJournalFile == -1){
+			return -1;
+		}
+		Buffer.swap(UploadJournalBuffer);
+		UploadJournalBuffered = 0;
+	}
+
+	if(!Buffer.empty()){
+		Res = upload_journal_write(UploadJournalFile, &Buffer[0], (int)Buffer.size());
+		if(Res == 0){
+			Res = upload_journal_fsync(UploadJournalFile);
+		}
+		if(Res == -1){
+			printf("upload journal: write failed\n");
+		}
+
+		for(Pos = 0; Pos < (int)Buffer.size(); Pos += UPLOAD_JOURNAL_RECORD_HEADER + Len){
+			Len = (unsigned char)Buffer[Pos + 1] | ((unsigned char)Buffer[Pos + 2] << 8);
+			if(Buffer[Pos] == UPLOAD_JOURNAL_ACK){
+				Keys.push_back(upload_journal_fold(std::string(&Buffer[Pos + UPLOAD_JOURNAL_RECORD_HEADER], Len).c_str()));
+			}
+		}
+
+		Poco::FastMutex::ScopedLock Lock(UploadJournalMutex);
+		UploadJournalCommitted.insert(UploadJournalCommitted.end(), Keys.begin(), Keys.end());
+		Compact = UploadJournalCommitted.size() >= UPLOAD_JOURNAL_COMPACT_COUNT;
+	}
+
+	if(Compact){
+		upload_journal_compact();
+	}
+	return Res;
+}
+
+void UploadJournalWriter::run(){
+	unsigned long long Now = 0;
+	long Wait = UPLOAD_JOURNAL_COMMIT_INTERVAL;
+
+	while(1){
+		UploadJournalWake.tryWait(Wait);
+
+		Wait = UPLOAD_JOURNAL_COMMIT_INTERVAL;
+		{
+			Poco::FastMutex::ScopedLock Lock(UploadJournalMutex);
+			if(UploadJournalStop){
+				break;
+			}
+			if(UploadJournalBuffered == 0){
+				continue;
+			}
+			Now = net_tick_ms();
+			if(UploadJournalBuffered < UPLOAD_JOURNAL_COMMIT_COUNT && Now - UploadJournalOldest < UPLOAD_JOURNAL_COMMIT_INTERVAL){
+				Wait = (long)(UploadJournalOldest + UPLOAD_JOURNAL_COMMIT_INTERVAL - Now);
+				continue;
+			}
+		}
+		upload_journal_flush();
+	}
+}
+
+// acks left by an earlier run go into the sent index before anything else
+static int upload_journal_replay(int File){
+	std::vector<unsigned char> Data;
+	unsigned char Chunk[65536];
+	unsigned int Sum = 0;
+	int Pos = 0;
+	int Len = 0;
+	int Ret = 0;
+	int Acks = 0;
+
+	while(1){
+#ifdef _WIN32
+		Ret = _read(File, Chunk, sizeof Chunk);
+#else
+		Ret = (int)read(File, Chunk, sizeof Chunk);
+		if(Ret == -1 && errno == EINTR){
+			continue;
+		}
+#endif
+		if(Ret <= 0){
+			break;
+		}
+		Data.insert(Data.end(), Chunk, Chunk + Ret);
+	}
+	if(Ret == -1){
+		return -1;
+	}
+
+	while(Pos + UPLOAD_JOURNAL_RECORD_HEADER <= (int)Data.size()){
+		Len = Data[Pos + 1] | (Data[Pos + 2] << 8);
+		if(Pos + UPLOAD_JOURNAL_RECORD_HEADER + Len > (int)Data.size()){
+			break;
+		}
+		Sum = Data[Pos + 3] | (Data[Pos + 4] << 8) | (Data[Pos + 5] << 16) | ((unsigned int)Data[Pos + 6] << 24);
+		if(upload_journal_checksum(upload_journal_checksum(0x811c9dc5, &Data[Pos], 3), &Data[Pos + UPLOAD_JOURNAL_RECORD_HEADER], Len) != Sum){
+			break;
+		}
+		if(Data[Pos] == UPLOAD_JOURNAL_ACK){
+			if(sent_index_add(std::string((char *)&Data[Pos + UPLOAD_JOURNAL_RECORD_HEADER], Len).c_str()) == -1){
+				return -1;
+			}
+			Acks ++;
+		}
+		Pos += UPLOAD_JOURNAL_RECORD_HEADER + Len;
+	}
+	if(Pos < (int)Data.size()){
+		printf("upload journal: %d bytes of a torn record dropped\n", (int)Data.size() - Pos);
+	}
+	return Acks;
+}
+
+// Opens the journal at FileName, after the sent index, and starts its
+// writer. Acks a crash left in it are moved to the index first.
+int upload_journal_open(const char *FileName){
+	int File = -1;
+	int Acks = 0;
+
+#ifdef _WIN32
+	File = _open(FileName, _O_RDWR | _O_CREAT | _O_APPEND | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+	File = open(FileName, O_RDWR | O_CREAT | O_APPEND, 0644);
+#endif
+	if(File == -1){
+		return -1;
+	}
+	// emptied only once every ack in it is safe in the index; until then the
+	// journal is left as it is and not written to
+	Acks = upload_journal_replay(File);
+	if(Acks == -1 || (Acks > 0 && sent_index_sync() == -1)){
+		printf("upload journal: %s could not be moved to the sent index\n", FileName);
+		upload_journal_close_file(File);
+		return -1;
+	}
+	upload_journal_truncate(File);
+
+	{
+		Poco::FastMutex::ScopedLock Lock(UploadJournalMutex);
+		if(UploadJournalFile != -1){
+			upload_journal_close_file(File);
+			return -1;
+		}
+		UploadJournalFile = File;
+		UploadJournalStop = 0;
+		UploadJournalBuffer.clear();
+		UploadJournalBuffered = 0;
+		UploadJournalCommitted.clear();
+		UploadJournalAcked.clear();
+	}
+
+	UploadJournalThread = new Poco::Thread();
+	UploadJournalThread->start(Writer);
+	return 0;
+}
+
+// Commits what is left and moves every ack into the sent index.
+int upload_journal_close(){
+	{
+		Poco::FastMutex::ScopedLock Lock(UploadJournalMutex);
+		if(UploadJournalFile == -1){
+			return 0;
+		}
+		UploadJournalStop = 1;
+	}
+	UploadJournalWake.set();
+	UploadJournalThread->join();
+	delete UploadJournalThread;
+	UploadJournalThread = NULL;
+
+	upload_journal_flush();
+	{
+		Poco::FastMutex::ScopedLock FileLock(UploadJournalFileMutex);
+		upload_journal_compact();
+	}
+
+	Poco::FastMutex::ScopedLock Lock(UploadJournalMutex);
+	upload_journal_close_file(UploadJournalFile);
+	UploadJournalFile = -1;
+	UploadJournalAcked.clear();
+	return 0;
+}
+
+int upload_journal_scan(const char *FilePathAndFileName){
+	return upload_journal_append(UPLOAD_JOURNAL_SCAN, FilePathAndFileName);
+}
+
+int upload_journal_ack(const char *Key){
+	return upload_journal_append(UPLOAD_JOURNAL_ACK, Key);
+}
+
+// Whether Key was acked but has not reached the sent index yet.
+int upload_journal_acked(const char *Key){
+	Poco::FastMutex::ScopedLock Lock(UploadJournalMutex);
+	return UploadJournalAcked.count(upload_journal_fold(Key)) != 0;
+}
+
+// Commits now, without waiting for the group to fill.
+int upload_journal_commit(){
+	return upload_journal_flush();
+}
\ No newline at end of file
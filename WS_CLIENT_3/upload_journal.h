@@ -0,0 +1,18 @@
+#ifndef __UPLOAD_JOURNAL__
+#define __UPLOAD_JOURNAL__
+
+#include "define.h"
+#include "sent_index.h"
+
+#define UPLOAD_JOURNAL_SCAN 1
+#define UPLOAD_JOURNAL_ACK 2
+
+int upload_journal_open(const char *FileName);
+int upload_journal_close();
+
+int upload_journal_scan(const char *FilePathAndFileName);
+int upload_journal_ack(const char *Key);
+int upload_journal_acked(const char *Key);
+int upload_journal_commit();
+
+#endif // __UPLOAD_JOURNAL__
\ No newline at end of file
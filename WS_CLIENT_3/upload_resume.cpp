@@ -0,0 +1,219 @@
+#include "upload_resume.h"
+
+using uma::bson::Document;
+using uma::bson::BinaryData;
+using uma::bson::Long;
+
+// Resumable upload protocol. A big file goes up as numbered segments of an
+// upload the server knows by id:
+//
+//   /api/upload/begin    data{uploadid, folder, size, type}
+//                        -> {error, offset}
+//   /api/upload/segment  data{uploadid, seq, offset, last, content}
+//                        -> {error, offset}
+//
+// offset in a reply is how much of the file the server has committed. The id
+// is derived from the file itself, so after a dropped connection, or a
+// restart, begin tells the client where to carry on and only the segments
+// past that point are sent again.
+
+// md5 of path, size and modification time in hex; a changed file starts over
+static void upload_resume_id(char *UploadId, const char *FilePathAndFileName, long long Size, long long MTime){
+	char Key[FILE_NAME_LEN + MARK_MAX_BUF];
+	unsigned char Digest[16];
+	int i = 0;
+
+	sprintf(Key, "%s|%lld|%lld", FilePathAndFileName, Size, MTime);
+	MD5Digest(Key, strlen(Key), (char *)Digest);
+
+	for(i = 0; i < 16; i ++){
+		sprintf(UploadId + i * 2, "%02x", Digest[i]);
+	}
+}
+
+// Sends one request and reads the reply into Result and Offset. Returns the
+// keep-alive flag of the reply, or -1 when the connection failed.
+static int upload_resume_exchange(SOCKET Socket, HTTP_REQUEST *Request, long long *Offset, int *Result){
+	HTTP_RESPONSE Response;
+	int KeepAlive = 0;
+
+	if(net_send_segments_all(Socket, Request->Segment, Request->SegmentNum) == -1){
+		return -1;
+	}
+
+	if(http_response_init(&Response) == -1){
+		return -1;
+	}
+
+	KeepAlive = http_response_recv(Socket, &Response);
+	if(KeepAlive == -1){
+		http_response_free(&Response);
+		return -1;
+	}
+
+	*Result = upload_engine_status(Response.Parser.StatusCode);
+	if(*Result == UPLOAD_RESULT_OK && ParseRecvOffset(Response.Buffer + Response.Parser.BodyStart, Response.Parser.BodyLen, Offset) != 0){
+		*Result = UPLOAD_RESULT_REJECTED;
+	}
+
+	http_response_free(&Response);
+	return KeepAlive;
+}
+
+// long is 32 bits on Windows, offsets past 2 GB need the 64 bit seek
+static int upload_resume_seek(FILE *PFile, long long Offset){
+#ifdef _WIN32
+	return _fseeki64(PFile, Offset, SEEK_SET);
+#else
+	return fseeko(PFile, (off_t)Offset, SEEK_SET);
+#endif
+}
+
+// One connection's worth of the upload: begin, then segments from the
+// committed offset on until the server has the whole file.
+static int upload_resume_session(UPLOAD_RESUME *Resume, const char *IpAddress, u_short Port, char *SendBuffer, int SendBufferLen, FILE *PFile, char *FilePath, int UploadType){
+	using std::string;
+
+	HTTP_REQUEST Request;
+	SOCKET Socket;
+	const char *Content;
+	long long Acked = 0;
+	int SegmentLen = 0;
+	int KeepAlive = 0;
+	int Result = 0;
+
+	if(conn_pool_acquire(IpAddress, Port, 0, &Socket) == -1){
+		return UPLOAD_RESULT_CONNECT;
+	}
+
+	{
+		Document HttpContent;
+		Document BsonUploadData;
+
+		construct_http_content_base(HttpContent, POST_API_ACTION_UPLOAD_BEGIN);
+		BsonUploadData.set("uploadid", (string)Resume->UploadId);
+		BsonUploadData.set("folder", (string)FilePath);
+		BsonUploadData.set("size", Long(Resume->Size));
+		BsonUploadData.set("type", UploadType);
+		HttpContent.set("data", BsonUploadData);
+
+		if(construct_http_document(IpAddress, Port, POST_API_ACTION_UPLOAD_BEGIN, &Request, HttpContent, SendBuffer, SendBufferLen) == -1){
+			conn_pool_release(IpAddress, Port, Socket, 0);
+			return UPLOAD_RESULT_LOCAL;
+		}
+	}
+
+	KeepAlive = upload_resume_exchange(Socket, &Request, &Acked, &Result);
+	if(KeepAlive == -1){
+		Result = net_would_block(net_last_error()) ? UPLOAD_RESULT_TIMEOUT : UPLOAD_RESULT_FAILED;
+		conn_pool_release(IpAddress, Port, Socket, 0);
+		return Result;
+	}
+	if(Result != UPLOAD_RESULT_OK || Acked < 0 || Acked > Resume->Size){
+		conn_pool_release(IpAddress, Port, Socket, KeepAlive);
+		return Result != UPLOAD_RESULT_OK ? Result : UPLOAD_RESULT_REJECTED;
+	}
+	Resume->Offset = Acked;
+
+	while(Resume->Offset < Resume->Size){
+		SegmentLen = (int)((Resume->Size - Resume->Offset < UPLOAD_RESUME_SEGMENT) ? Resume->Size - Resume->Offset : UPLOAD_RESUME_SEGMENT);
+
+		// the segment is read into SendBuffer, copied into the document and
+		// then overwritten by its encoding, so it needs no buffer of its own
+		if(SegmentLen * 2 + SOCKET_MAX_BUF > SendBufferLen
+			|| upload_resume_seek(PFile, Resume->Offset) != 0
+			|| fread(SendBuffer, 1, SegmentLen, PFile) != (size_t)SegmentLen){
+			conn_pool_release(IpAddress, Port, Socket, KeepAlive);
+			return UPLOAD_RESULT_LOCAL;
+		}
+
+		{
+			Document HttpContent;
+			Document BsonUploadData;
+
+			Content = SendBuffer;
+			construct_http_content_base(HttpContent, POST_API_ACTION_UPLOAD_SEGMENT);
+			BsonUploadData.set("uploadid", (string)Resume->UploadId);
+			BsonUploadData.set("seq", Resume->Sequence);
+			BsonUploadData.set("offset", Long(Resume->Offset));
+			BsonUploadData.set("last", (Resume->Offset + SegmentLen == Resume->Size) ? 1 : 0);
+			BsonUploadData.set("content", BinaryData(Content, SegmentLen));
+			HttpContent.set("data", BsonUploadData);
+
+			if(construct_http_document(IpAddress, Port, POST_API_ACTION_UPLOAD_SEGMENT, &Request, HttpContent, SendBuffer, SendBufferLen) == -1){
+				conn_pool_release(IpAddress, Port, Socket, 0);
+				return UPLOAD_RESULT_LOCAL;
+			}
+		}
+
+		KeepAlive = upload_resume_exchange(Socket, &Request, &Acked, &Result);
+		if(KeepAlive == -1){
+			Result = net_would_block(net_last_error()) ? UPLOAD_RESULT_TIMEOUT : UPLOAD_RESULT_FAILED;
+			conn_pool_release(IpAddress, Port, Socket, 0);
+			return Result;
+		}
+
+		// the server may commit less than it was sent, never nothing
+		if(Result != UPLOAD_RESULT_OK || Acked <= Resume->Offset || Acked > Resume->Size){
+			conn_pool_release(IpAddress, Port, Socket, KeepAlive);
+			return Result != UPLOAD_RESULT_OK ? Result : UPLOAD_RESULT_REJECTED;
+		}
+		Resume->Offset = Acked;
+		Resume->Sequence ++;
+
+		// a segment is a slice of bulk time, control gets the line after it
+		traffic_lane_yield();
+
+		if(!KeepAlive && Resume->Offset < Resume->Size){
+			conn_pool_release(IpAddress, Port, Socket, 0);
+			return UPLOAD_RESULT_FAILED;
+		}
+	}
+
+	conn_pool_release(IpAddress, Port, Socket, KeepAlive);
+	return UPLOAD_RESULT_OK;
+}
+
+// Uploads a file through the resumable protocol. A connection that breaks
+// halfway is replaced and the upload carries on from the last offset the
+// server acknowledged, up to UPLOAD_RESUME_RECONNECTS times; other failures
+// are returned as UPLOAD_RESULT_* for the caller to retry later.
+int upload_resume_file(const char *IpAddress, u_short Port, char *SendBuffer, int SendBufferLen, char *FilePath, char *FilePathAndFileName, int UploadType){
+	UPLOAD_RESUME Resume;
+	FILE *PFile = NULL;
+	int Result = 0;
+
+	// the plain stat of Windows fails on a file past 2 GB
+#ifdef _WIN32
+	struct _stat64 FileStat;
+
+	if(_stat64(FilePathAndFileName, &FileStat) == -1){
+		return UPLOAD_RESULT_LOCAL;
+	}
+#else
+	struct stat FileStat;
+
+	if(stat(FilePathAndFileName, &FileStat) == -1){
+		return UPLOAD_RESULT_LOCAL;
+	}
+#endif
+
+	memset(&Resume, 0x00, sizeof Resume);
+	Resume.Size = FileStat.st_size;
+	upload_resume_id(Resume.UploadId, FilePathAndFileName, FileStat.st_size, FileStat.st_mtime);
+
+	PFile = fopen(FilePathAndFileName, "rb");
+	if(PFile == NULL){
+		return UPLOAD_RESULT_LOCAL;
+	}
+
+	for(Resume.Reconnects = 0; Resume.Reconnects <= UPLOAD_RESUME_RECONNECTS; Resume.Reconnects ++){
+		Result = upload_resume_session(&Resume, IpAddress, Port, SendBuffer, SendBufferLen, PFile, FilePath, UploadType);
+		if(Result != UPLOAD_RESULT_FAILED && Result != UPLOAD_RESULT_TIMEOUT){
+			break;
+		}
+	}
+
+	fclose(PFile);
+	return Result;
+}
\ No newline at end of file
@@ -0,0 +1,22 @@
+#ifndef __UPLOAD_RESUME__
+#define __UPLOAD_RESUME__
+
+#include "define.h"
+#include "conn_pool.h"
+#include "http_request.h"
+#include "http_response.h"
+#include "upload_engine.h"
+
+#define UPLOAD_RESUME_ID_LEN 33
+
+typedef struct{
+	char UploadId[UPLOAD_RESUME_ID_LEN];
+	long long Size;
+	long long Offset;
+	int Sequence;
+	int Reconnects;
+}UPLOAD_RESUME;
+
+int upload_resume_file(const char *IpAddress, u_short Port, char *SendBuffer, int SendBufferLen, char *FilePath, char *FilePathAndFileName, int UploadType);
+
+#endif // __UPLOAD_RESUME__
\ No newline at end of file
@@ -0,0 +1,78 @@
+#include "upload_window.h"
+
+// AIMD window over the number of upload requests in flight. It grows by one
+// per acknowledged request while below the slow start threshold, then by one
+// per full window. It stops growing while the smoothed latency sits well
+// above the best seen, and halves on a timeout, reset or error reply.
+
+void upload_window_init(UPLOAD_WINDOW *Window, int MinWindow, int MaxWindow, int InitialWindow){
+	memset(Window, 0x00, sizeof *Window);
+
+	if(MinWindow < 1){
+		MinWindow = 1;
+	}
+	if(MaxWindow < MinWindow){
+		MaxWindow = MinWindow;
+	}
+	if(InitialWindow < MinWindow){
+		InitialWindow = MinWindow;
+	}
+	if(InitialWindow > MaxWindow){
+		InitialWindow = MaxWindow;
+	}
+
+	Window->MinWindow = MinWindow;
+	Window->MaxWindow = MaxWindow;
+	Window->Window = InitialWindow;
+	Window->SlowStartThreshold = MaxWindow;
+}
+
+void upload_window_success(UPLOAD_WINDOW *Window, unsigned long long StartTick, unsigned long long Now){
+	unsigned long long Rtt = Now - StartTick;
+
+	if(Window->MinRtt == 0 || Rtt < Window->MinRtt){
+		Window->MinRtt = Rtt;
+	}
+	if(Window->SmoothRtt == 0){
+		Window->SmoothRtt = (double)Rtt;
+	}
+	else{
+		Window->SmoothRtt += ((double)Rtt - Window->SmoothRtt) / 8;
+	}
+
+	// queues building up somewhere: hold the window where it is
+	if(Window->SmoothRtt > Window->MinRtt * UPLOAD_WINDOW_RTT_TOLERANCE + UPLOAD_WINDOW_RTT_SLACK){
+		return;
+	}
+
+	if(Window->Window < Window->SlowStartThreshold){
+		Window->Window += 1;
+	}
+	else{
+		Window->Window += 1 / Window->Window;
+	}
+	if(Window->Window > Window->MaxWindow){
+		Window->Window = Window->MaxWindow;
+	}
+	Window->Increases ++;
+}
+
+// Requests sent before the last decrease saw the old window, so their
+// failures are the same congestion event and do not cut it again.
+void upload_window_failure(UPLOAD_WINDOW *Window, unsigned long long StartTick, unsigned long long Now){
+	if(Window->Decreases > 0 && StartTick < Window->LastDecrease){
+		return;
+	}
+
+	Window->Window /= 2;
+	if(Window->Window < Window->MinWindow){
+		Window->Window = Window->MinWindow;
+	}
+	Window->SlowStartThreshold = Window->Window;
+	Window->LastDecrease = Now;
+	Window->Decreases ++;
+}
+
+int upload_window_get(const UPLOAD_WINDOW *Window){
+	return (int)Window->Window;
+}
\ No newline at end of file
@@ -0,0 +1,23 @@
+#ifndef __UPLOAD_WINDOW__
+#define __UPLOAD_WINDOW__
+
+#include "define.h"
+
+typedef struct{
+	double Window;
+	double SlowStartThreshold;
+	int MinWindow;
+	int MaxWindow;
+	double SmoothRtt;
+	unsigned long long MinRtt;
+	unsigned long long LastDecrease;
+	int Increases;
+	int Decreases;
+}UPLOAD_WINDOW;
+
+void upload_window_init(UPLOAD_WINDOW *Window, int MinWindow, int MaxWindow, int InitialWindow);
+void upload_window_success(UPLOAD_WINDOW *Window, unsigned long long StartTick, unsigned long long Now);
+void upload_window_failure(UPLOAD_WINDOW *Window, unsigned long long StartTick, unsigned long long Now);
+int upload_window_get(const UPLOAD_WINDOW *Window);
+
+#endif // __UPLOAD_WINDOW__
\ No newline at end of file
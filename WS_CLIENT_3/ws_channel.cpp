@@ -0,0 +1,307 @@
+#include "ws_channel.h"
+
+#include <Poco/Mutex.h>
+#include <Poco/SHA1Engine.h>
+#include <Poco/Base64Encoder.h>
+
+// RFC 6455 client side over a blocking socket: one upgrade handshake, then
+// messages in frames, masked on the way out as a client must. A message may
+// come in fragments and control frames may sit between them; pings are
+// answered here and never reach the caller. Sends from any thread go through
+// one lock so a pong cannot cut into a frame being written.
+
+static const char WsGuid[] = "258EAFA5-E914-47DA-95CA-C5AB0DC11B85";
+
+static Poco::FastMutex WsSendMutex;
+
+static unsigned int ws_channel_random(WS_CHANNEL *Channel){
+	Channel->MaskSeed ^= Channel->MaskSeed << 13;
+	Channel->MaskSeed ^= Channel->MaskSeed >> 7;
+	Channel->MaskSeed ^= Channel->MaskSeed << 17;
+	return (unsigned int)(Channel->MaskSeed >> 32);
+}
+
+static std::string ws_channel_base64(const unsigned char *Data, int Len){
+	std::ostringstream Stream;
+	Poco::Base64Encoder Encoder(Stream);
+
+	Encoder.rdbuf()->setLineLength(0);
+	Encoder.write((const char *)Data, Len);
+	Encoder.close();
+	return Stream.str();
+}
+
+static int ws_channel_reserve(char **Buffer, int *Size, int Need){
+	char *NewBuffer;
+	int NewSize = *Size > 0 ? *Size : SOCKET_MAX_BUF;
+
+	if(Need <= *Size){
+		return 0;
+	}
+	while(NewSize < Need){
+		NewSize *= 2;
+	}
+	NewBuffer = (char *)realloc(*Buffer, NewSize);
+	if(NewBuffer == NULL){
+		return -1;
+	}
+	*Buffer = NewBuffer;
+	*Size = NewSize;
+	return 0;
+}
+
+// one recv into the raw buffer; 0 when the socket timeout ran out first
+static int ws_channel_fill(WS_CHANNEL *Channel){
+	int RecvRes = 0;
+
+	if(ws_channel_reserve(&Channel->Buffer, &Channel->Size, Channel->Len + SOCKET_MAX_BUF) == -1){
+		return -1;
+	}
+
+	RecvRes = recv(Channel->Socket, Channel->Buffer + Channel->Len, Channel->Size - Channel->Len, 0);
+	if(RecvRes == SOCKET_ERROR){
+		return net_would_block(net_last_error()) ? 0 : -1;
+	}
+	if(RecvRes == 0){
+		return -1;
+	}
+	Channel->Len += RecvRes;
+	return RecvRes;
+}
+
+static int ws_channel_handshake(WS_CHANNEL *Channel, const char *IpAddress, u_short Port, const char *Path){
+	unsigned char KeyBytes[16];
+	char Request[HTTP_HEADER_MAX_BUF];
+	char Value[MARK_MAX_BUF];
+	NET_SEGMENT Segment;
+	unsigned long long StartTick = net_tick_ms();
+	int HeaderLen = -1;
+	int i = 0;
+
+	for(i = 0; i < (int)sizeof KeyBytes; i ++){
+		KeyBytes[i] = (unsigned char)ws_channel_random(Channel);
+	}
+	std::string Key = ws_channel_base64(KeyBytes, sizeof KeyBytes);
+
+	Segment.Base = Request;
+	Segment.Len = sprintf(Request, "GET %s HTTP/1.1\r\nHost: %s:%d\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+		"Sec-WebSocket-Key: %s\r\nSec-WebSocket-Version: 13\r\nSec-WebSocket-Protocol: bson\r\n\r\n",
+		Path, IpAddress, (int)Port, Key.c_str());
+	if(net_send_segments_all(Channel->Socket, &Segment, 1) == -1){
+		return -1;
+	}
+
+	while((HeaderLen = http_parser_find_header_end(Channel->Buffer, 0, Channel->Len)) == -1){
+		if(net_tick_ms() - StartTick > REQUEST_TIMEOUT_FIRST_BYTE || Channel->Len > HTTP_HEADER_MAX_BUF * 4){
+			return -1;
+		}
+		if(ws_channel_fill(Channel) == -1){
+			return -1;
+		}
+	}
+
+	if(Channel->Len < 12 || strncmp(Channel->Buffer, "HTTP/1.1 101", 12) != 0){
+		return -1;
+	}
+
+	Poco::SHA1Engine Engine;
+	Engine.update(Key + WsGuid);
+	const Poco::DigestEngine::Digest &Digest = Engine.digest();
+	std::string Accept = ws_channel_base64(&Digest[0], (int)Digest.size());
+
+	if(http_response_header_value(Channel->Buffer, HeaderLen, "Sec-WebSocket-Accept", Value, sizeof Value) == -1
+		|| Accept != Value){
+		return -1;
+	}
+
+	// a frame the server sent right behind its answer stays buffered
+	Channel->Len -= HeaderLen;
+	memmove(Channel->Buffer, Channel->Buffer + HeaderLen, Channel->Len);
+	return 0;
+}
+
+// Connects and upgrades. RecvTimeout bounds every ws_channel_recv once the
+// handshake is done, 0 leaves it blocking.
+int ws_channel_open(WS_CHANNEL *Channel, const char *IpAddress, u_short Port, const char *Path, int RecvTimeout){
+	memset(Channel, 0x00, sizeof *Channel);
+	Channel->MaskSeed = (net_tick_us() ^ ((unsigned long long)time(NULL) << 20) ^ (unsigned long long)(size_t)Channel) | 1;
+
+	Channel->Socket = net_connect(IpAddress, Port, 0);
+	if(Channel->Socket == INVALID_SOCKET){
+		return -1;
+	}
+
+	if(ws_channel_handshake(Channel, IpAddress, Port, Path) == -1){
+		net_close(Channel->Socket);
+		free(Channel->Buffer);
+		memset(Channel, 0x00, sizeof *Channel);
+		Channel->Socket = INVALID_SOCKET;
+		return -1;
+	}
+
+	net_set_timeout(Channel->Socket, REQUEST_TIMEOUT_SEND, RecvTimeout);
+	return 0;
+}
+
+int ws_channel_close(WS_CHANNEL *Channel){
+	char Payload[2];
+
+	if(Channel->Socket != INVALID_SOCKET){
+		// 1000, normal closure; the server's answer is not waited for
+		Payload[0] = (char)0x03;
+		Payload[1] = (char)0xE8;
+		ws_channel_send(Channel, WS_OPCODE_CLOSE, Payload, sizeof Payload);
+		net_close(Channel->Socket);
+		Channel->Socket = INVALID_SOCKET;
+	}
+
+	free(Channel->Buffer);
+	free(Channel->Message);
+	Channel->Buffer = NULL;
+	Channel->Message = NULL;
+	Channel->Len = Channel->Size = 0;
+	Channel->MessageLen = Channel->MessageSize = 0;
+	return 0;
+}
+
+// Sends Payload as one final frame. The payload is masked in place, so the
+// caller's bytes are scrambled afterwards.
+int ws_channel_send(WS_CHANNEL *Channel, int Opcode, char *Payload, int Len){
+	Poco::FastMutex::ScopedLock Lock(WsSendMutex);
+	unsigned char Header[WS_FRAME_HEADER_MAX];
+	unsigned char Mask[4];
+	unsigned int MaskKey;
+	NET_SEGMENT Segment[2];
+	int HeaderLen = 0;
+	int i = 0;
+
+	if(Channel->Socket == INVALID_SOCKET || Len < 0){
+		return -1;
+	}
+
+	Header[HeaderLen ++] = (unsigned char)(0x80 | (Opcode & 0x0F));
+	if(Len < 126){
+		Header[HeaderLen ++] = (unsigned char)(0x80 | Len);
+	}
+	else if(Len < 65536){
+		Header[HeaderLen ++] = 0x80 | 126;
+		Header[HeaderLen ++] = (unsigned char)(Len >> 8);
+		Header[HeaderLen ++] = (unsigned char)Len;
+	}
+	else{
+		Header[HeaderLen ++] = 0x80 | 127;
+		for(i = 7; i >= 0; i --){
+			Header[HeaderLen ++] = (unsigned char)(i >= 4 ? 0 : ((unsigned int)Len >> (i * 8)));
+		}
+	}
+
+	MaskKey = ws_channel_random(Channel);
+	for(i = 0; i < 4; i ++){
+		Mask[i] = (unsigned char)(MaskKey >> (i * 8));
+		Header[HeaderLen ++] = Mask[i];
+	}
+	for(i = 0; i < Len; i ++){
+		Payload[i] ^= Mask[i & 3];
+	}
+
+	Segment[0].Base = (const char *)Header;
+	Segment[0].Len = HeaderLen;
+	Segment[1].Base = Payload;
+	Segment[1].Len = Len;
+	return net_send_segments_all(Channel->Socket, Segment, Len > 0 ? 2 : 1);
+}
+
+// Reads until one whole data message is in. Returns its opcode with Message
+// pointing at the payload, valid until the next call; 0 when the receive
+// timeout ran out first, partial frames stay buffered for the next call;
+// -1 when the connection failed or the server closed it.
+int ws_channel_recv(WS_CHANNEL *Channel, char **Message, int *MessageLen){
+	unsigned char *Frame;
+	unsigned long long PayloadLen;
+	int HeaderLen = 0;
+	int Opcode = 0;
+	int Fin = 0;
+	int Masked = 0;
+	int FillRes = 0;
+	int i = 0;
+
+	while(1){
+		Frame = (unsigned char *)Channel->Buffer;
+		HeaderLen = 2;
+		if(Channel->Len >= 2){
+			Fin = Frame[0] & 0x80;
+			Opcode = Frame[0] & 0x0F;
+			Masked = Frame[1] & 0x80;
+			PayloadLen = Frame[1] & 0x7F;
+			if(PayloadLen == 126){
+				HeaderLen += 2;
+			}
+			else if(PayloadLen == 127){
+				HeaderLen += 8;
+			}
+			if(Masked){
+				HeaderLen += 4;
+			}
+		}
+
+		if(Channel->Len >= HeaderLen && Channel->Len >= 2){
+			if(HeaderLen - (Masked ? 4 : 0) > 2){
+				PayloadLen = 0;
+				for(i = 2; i < HeaderLen - (Masked ? 4 : 0); i ++){
+					PayloadLen = (PayloadLen << 8) | Frame[i];
+				}
+			}
+			if(PayloadLen > (unsigned long long)WS_MAX_MESSAGE || (unsigned long long)Channel->MessageLen + PayloadLen > (unsigned long long)WS_MAX_MESSAGE){
+				return -1;
+			}
+
+			if(Channel->Len >= HeaderLen + (int)PayloadLen){
+				if(Masked){
+					for(i = 0; i < (int)PayloadLen; i ++){
+						Frame[HeaderLen + i] ^= Frame[HeaderLen - 4 + (i & 3)];
+					}
+				}
+
+				if(Opcode == WS_OPCODE_CLOSE){
+					ws_channel_send(Channel, WS_OPCODE_CLOSE, (char *)Frame + HeaderLen, PayloadLen >= 2 ? 2 : 0);
+					return -1;
+				}
+				if(Opcode == WS_OPCODE_PING){
+					if(ws_channel_send(Channel, WS_OPCODE_PONG, (char *)Frame + HeaderLen, (int)PayloadLen) == -1){
+						return -1;
+					}
+				}
+				else if(Opcode < WS_OPCODE_CLOSE){
+					if(Opcode != WS_OPCODE_CONTINUATION){
+						Channel->MessageOpcode = Opcode;
+						Channel->MessageLen = 0;
+					}
+					if(ws_channel_reserve(&Channel->Message, &Channel->MessageSize, Channel->MessageLen + (int)PayloadLen) == -1){
+						return -1;
+					}
+					memcpy(Channel->Message + Channel->MessageLen, Frame + HeaderLen, (size_t)PayloadLen);
+					Channel->MessageLen += (int)PayloadLen;
+				}
+
+				Channel->Len -= HeaderLen + (int)PayloadLen;
+				memmove(Channel->Buffer, Channel->Buffer + HeaderLen + (int)PayloadLen, Channel->Len);
+
+				if(Opcode < WS_OPCODE_CLOSE && Fin){
+					*Message = Channel->Message;
+					*MessageLen = Channel->MessageLen;
+					return Channel->MessageOpcode;
+				}
+				continue;
+			}
+
+			if(ws_channel_reserve(&Channel->Buffer, &Channel->Size, HeaderLen + (int)PayloadLen) == -1){
+				return -1;
+			}
+		}
+
+		FillRes = ws_channel_fill(Channel);
+		if(FillRes <= 0){
+			return FillRes;
+		}
+	}
+}
\ No newline at end of file
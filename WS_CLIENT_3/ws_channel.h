@@ -0,0 +1,35 @@
+#ifndef __WS_CHANNEL__
+#define __WS_CHANNEL__
+
+#include "define.h"
+#include "net_socket.h"
+#include "http_response.h"
+
+#define WS_OPCODE_CONTINUATION 0x0
+#define WS_OPCODE_TEXT 0x1
+#define WS_OPCODE_BINARY 0x2
+#define WS_OPCODE_CLOSE 0x8
+#define WS_OPCODE_PING 0x9
+#define WS_OPCODE_PONG 0xA
+
+#define WS_FRAME_HEADER_MAX 14
+
+typedef struct{
+	SOCKET Socket;
+	char *Buffer;
+	int Len;
+	int Size;
+	char *Message;
+	int MessageLen;
+	int MessageSize;
+	int MessageOpcode;
+	unsigned long long MaskSeed;
+}WS_CHANNEL;
+
+int ws_channel_open(WS_CHANNEL *Channel, const char *IpAddress, u_short Port, const char *Path, int RecvTimeout);
+int ws_channel_close(WS_CHANNEL *Channel);
+
+int ws_channel_send(WS_CHANNEL *Channel, int Opcode, char *Payload, int Len);
+int ws_channel_recv(WS_CHANNEL *Channel, char **Message, int *MessageLen);
+
+#endif // __WS_CHANNEL__
\ No newline at end of file
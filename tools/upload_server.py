@@ -0,0 +1,388 @@
+#!/usr/bin/env python3
+"""Stand-in server for the WS_CLIENT_3 upload API.
+
+Speaks just enough HTTP/1.1 and BSON to exercise the client locally:
+
+  /api/upload             whole-file and batch uploads; a batch item without
+                          content is acked only if its digest is known
+  /api/upload/probe       replies the ids of the probed digests already stored
+  /api/upload/begin       starts or resumes an upload, replies the committed offset
+  /api/upload/segment     appends a segment at the committed offset
+
+Uploads are kept under --dir as <uploadid>.part while in progress and renamed
+to <uploadid>.done once the last byte is committed. --drop N closes the
+connection without replying to every Nth segment, so resuming after a lost
+connection can be tried out.
+
+GET /api/ws upgrades to a WebSocket carrying the same documents in binary
+frames. A connection that does not open with an HTTP method carries them
+back to back with nothing around them. Either way documents are routed by
+their action field and answered in order; replies copy the request's seq,
+login and comm answer {error: 0} and any other action is echoed back.
+--push N sends a cmd document without a seq every N seconds on each such
+session.
+"""
+
+import argparse
+import base64
+import gzip
+import hashlib
+import os
+import socketserver
+import struct
+import threading
+import zlib
+
+WS_GUID = '258EAFA5-E914-47DA-95CA-C5AB0DC11B85'
+
+ACTION_LOGIN = 102
+ACTION_UPLOAD = 111
+ACTION_COMM = 121
+ACTION_TARGETS = {
+    ACTION_UPLOAD: '/api/upload',
+    112: '/api/upload/begin',
+    113: '/api/upload/segment',
+    114: '/api/upload/probe',
+}
+
+
+def bson_decode(data, pos=0):
+    size = struct.unpack_from('<i', data, pos)[0]
+    end = pos + size - 1
+    pos += 4
+    doc = {}
+    while pos < end:
+        kind = data[pos]
+        pos += 1
+        name_end = data.index(b'\0', pos)
+        name = data[pos:name_end].decode()
+        pos = name_end + 1
+        if kind == 0x01:
+            value = struct.unpack_from('<d', data, pos)[0]
+            pos += 8
+        elif kind in (0x02, 0x0D, 0x0E):
+            length = struct.unpack_from('<i', data, pos)[0]
+            value = data[pos + 4:pos + 3 + length].decode('utf-8', 'replace')
+            pos += 4 + length
+        elif kind in (0x03, 0x04):
+            length = struct.unpack_from('<i', data, pos)[0]
+            value = bson_decode(data, pos)
+            if kind == 0x04:
+                value = [value[k] for k in sorted(value, key=int)]
+            pos += length
+        elif kind == 0x05:
+            length = struct.unpack_from('<i', data, pos)[0]
+            value = bytes(data[pos + 5:pos + 5 + length])
+            pos += 5 + length
+        elif kind == 0x07:
+            value = bytes(data[pos:pos + 12])
+            pos += 12
+        elif kind == 0x08:
+            value = data[pos] != 0
+            pos += 1
+        elif kind in (0x09, 0x11, 0x12):
+            value = struct.unpack_from('<q', data, pos)[0]
+            pos += 8
+        elif kind == 0x0A:
+            value = None
+        elif kind == 0x10:
+            value = struct.unpack_from('<i', data, pos)[0]
+            pos += 4
+        else:
+            raise ValueError('bson type %#x' % kind)
+        doc[name] = value
+    return doc
+
+
+def bson_encode(doc):
+    body = b''
+    for name, value in doc.items():
+        key = name.encode() + b'\0'
+        if isinstance(value, bool):
+            body += b'\x08' + key + (b'\x01' if value else b'\x00')
+        elif isinstance(value, int):
+            if -2 ** 31 <= value < 2 ** 31:
+                body += b'\x10' + key + struct.pack('<i', value)
+            else:
+                body += b'\x12' + key + struct.pack('<q', value)
+        elif isinstance(value, str):
+            raw = value.encode() + b'\0'
+            body += b'\x02' + key + struct.pack('<i', len(raw)) + raw
+        elif isinstance(value, bytes):
+            body += b'\x05' + key + struct.pack('<i', len(value)) + b'\x00' + value
+        elif isinstance(value, dict):
+            body += b'\x03' + key + bson_encode(value)
+        elif isinstance(value, list):
+            body += b'\x04' + key + bson_encode({str(i): v for i, v in enumerate(value)})
+    return struct.pack('<i', len(body) + 5) + body + b'\0'
+
+
+class UploadStore:
+    def __init__(self, directory, drop):
+        self.directory = directory
+        self.drop = drop
+        self.segments = 0
+        self.digests = set()
+        os.makedirs(directory, exist_ok=True)
+
+    def probe(self, data):
+        return {'error': 0, 'have': [item['id'] for item in data if item['digest'] in self.digests]}
+
+    def batch(self, data):
+        acks = []
+        for item in data:
+            if 'content' in item:
+                if 'digest' in item:
+                    self.digests.add(item['digest'])
+                acks.append({'id': item['id'], 'error': 0})
+            else:
+                acks.append({'id': item['id'], 'error': 0 if item.get('digest') in self.digests else 1})
+        return {'error': 0, 'data': acks}
+
+    def path(self, upload_id, suffix):
+        if not upload_id or not all(c in '0123456789abcdef' for c in upload_id):
+            raise ValueError('bad upload id')
+        return os.path.join(self.directory, upload_id + suffix)
+
+    def committed(self, upload_id):
+        if os.path.exists(self.path(upload_id, '.done')):
+            return os.path.getsize(self.path(upload_id, '.done'))
+        if os.path.exists(self.path(upload_id, '.part')):
+            return os.path.getsize(self.path(upload_id, '.part'))
+        return 0
+
+    def begin(self, data):
+        upload_id = data['uploadid']
+        offset = self.committed(upload_id)
+        if not os.path.exists(self.path(upload_id, '.done')):
+            if offset > data['size']:
+                os.remove(self.path(upload_id, '.part'))
+                offset = 0
+            if offset == data['size']:
+                open(self.path(upload_id, '.part'), 'ab').close()
+                os.replace(self.path(upload_id, '.part'), self.path(upload_id, '.done'))
+        return {'error': 0, 'uploadid': upload_id, 'offset': offset}
+
+    def segment(self, data):
+        upload_id = data['uploadid']
+        if os.path.exists(self.path(upload_id, '.done')):
+            return {'error': 0, 'offset': self.committed(upload_id)}
+        offset = self.committed(upload_id)
+        if data['offset'] != offset:
+            # out of order: tell the client where to carry on
+            return {'error': 0, 'offset': offset}
+        self.segments += 1
+        if self.drop and self.segments % self.drop == 0:
+            return None
+        with open(self.path(upload_id, '.part'), 'ab') as part:
+            part.write(data['content'])
+        offset += len(data['content'])
+        if data.get('last'):
+            os.replace(self.path(upload_id, '.part'), self.path(upload_id, '.done'))
+        return {'error': 0, 'offset': offset}
+
+
+def answer(store, target, doc):
+    data = doc.get('data')
+    if target == '/api/upload/begin':
+        return store.begin(data)
+    if target == '/api/upload/segment':
+        return store.segment(data)
+    if target == '/api/upload/probe':
+        return store.probe(data)
+    if target == '/api/upload' and isinstance(data, list):
+        return store.batch(data)
+    return {'error': 0}
+
+
+class UploadHandler(socketserver.StreamRequestHandler):
+    def read_body(self, headers):
+        if headers.get('transfer-encoding', '').lower() == 'chunked':
+            body = b''
+            while True:
+                size = int(self.rfile.readline().split(b';')[0], 16)
+                body += self.rfile.read(size)
+                self.rfile.readline()
+                if size == 0:
+                    return body
+        return self.rfile.read(int(headers.get('content-length', '0')))
+
+    def reply(self, doc, status='200 OK'):
+        body = bson_encode(doc) if doc is not None else b''
+        self.wfile.write(('HTTP/1.1 %s\r\nContent-Length: %d\r\nAccept-Encoding: gzip, deflate\r\n'
+                          'Connection: keep-alive\r\n\r\n' % (status, len(body))).encode() + body)
+
+    def ws_send(self, opcode, payload):
+        size = len(payload)
+        if size < 126:
+            header = struct.pack('!BB', 0x80 | opcode, size)
+        elif size < 65536:
+            header = struct.pack('!BBH', 0x80 | opcode, 126, size)
+        else:
+            header = struct.pack('!BBQ', 0x80 | opcode, 127, size)
+        with self.ws_lock:
+            self.wfile.write(header + payload)
+            self.wfile.flush()
+
+    def ws_frame(self):
+        head = self.rfile.read(2)
+        if len(head) < 2:
+            return None, None, None
+        fin, opcode = head[0] & 0x80, head[0] & 0x0F
+        size = head[1] & 0x7F
+        if size == 126:
+            size = struct.unpack('!H', self.rfile.read(2))[0]
+        elif size == 127:
+            size = struct.unpack('!Q', self.rfile.read(8))[0]
+        mask = self.rfile.read(4) if head[1] & 0x80 else b'\0\0\0\0'
+        payload = bytearray(self.rfile.read(size))
+        for i in range(len(payload)):
+            payload[i] ^= mask[i & 3]
+        return fin, opcode, bytes(payload)
+
+    def bson_send(self, payload):
+        with self.ws_lock:
+            self.wfile.write(payload)
+            self.wfile.flush()
+
+    def session_push(self, send, closed):
+        while not closed.wait(self.server.push):
+            try:
+                send(bson_encode({'error': 0, 'action': ACTION_COMM, 'cmd': 'noop'}))
+            except OSError:
+                return
+
+    def session_start(self, send):
+        self.ws_lock = threading.Lock()
+        closed = threading.Event()
+        if self.server.push:
+            threading.Thread(target=self.session_push, args=(send, closed), daemon=True).start()
+        return closed
+
+    def session_reply(self, doc):
+        action = doc.get('action')
+        if action in (ACTION_LOGIN, ACTION_COMM) or action in ACTION_TARGETS:
+            reply = answer(self.server.store, ACTION_TARGETS.get(action, ''), doc)
+            if reply is None:
+                return None
+        else:
+            reply = dict(doc)
+        if 'seq' in doc:
+            reply['seq'] = doc['seq']
+        return bson_encode(reply)
+
+    def bson_session(self):
+        closed = self.session_start(self.bson_send)
+        try:
+            while True:
+                head = self.rfile.read(4)
+                if len(head) < 4:
+                    return
+                size = struct.unpack('<i', head)[0]
+                if size < 5:
+                    return
+                reply = self.session_reply(bson_decode(head + self.rfile.read(size - 4)))
+                if reply is None:
+                    return
+                self.bson_send(reply)
+        except (ValueError, KeyError, TypeError, struct.error, IndexError, OSError) as error:
+            print('bson session: %s' % error)
+        finally:
+            closed.set()
+
+    def websocket(self, headers):
+        key = headers.get('sec-websocket-key', '')
+        accept = base64.b64encode(hashlib.sha1((key + WS_GUID).encode()).digest()).decode()
+        self.wfile.write(('HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n'
+                          'Sec-WebSocket-Accept: %s\r\nSec-WebSocket-Protocol: bson\r\n\r\n' % accept).encode())
+        self.wfile.flush()
+        closed = self.session_start(lambda payload: self.ws_send(0x2, payload))
+
+        message = b''
+        try:
+            while True:
+                fin, opcode, payload = self.ws_frame()
+                if opcode is None or opcode == 0x8:
+                    if opcode == 0x8:
+                        self.ws_send(0x8, payload[:2])
+                    return
+                if opcode == 0x9:
+                    self.ws_send(0xA, payload)
+                    continue
+                if opcode not in (0x0, 0x1, 0x2):
+                    continue
+                message += payload
+                if not fin:
+                    continue
+                reply, message = self.session_reply(bson_decode(message)), b''
+                if reply is None:
+                    return
+                self.ws_send(0x2, reply)
+        except (ValueError, KeyError, TypeError, struct.error, IndexError, OSError) as error:
+            print('websocket: %s' % error)
+        finally:
+            closed.set()
+
+    def handle(self):
+        store = self.server.store
+        # an HTTP request opens with its method, a document with its length
+        if not self.rfile.peek(3)[:3].isalpha():
+            self.bson_session()
+            return
+        while True:
+            line = self.rfile.readline()
+            if not line:
+                return
+            method, target = line.decode().split()[:2]
+            headers = {}
+            while True:
+                line = self.rfile.readline().decode().strip()
+                if not line:
+                    break
+                name, _, value = line.partition(':')
+                headers[name.strip().lower()] = value.strip()
+            if method == 'GET' and headers.get('upgrade', '').lower() == 'websocket':
+                self.websocket(headers)
+                return
+            body = self.read_body(headers)
+            encoding = headers.get('content-encoding', '').lower()
+            if encoding == 'gzip':
+                body = gzip.decompress(body)
+            elif encoding == 'deflate':
+                body = zlib.decompress(body)
+            if body[:1] == b':':
+                body = body[5:]
+
+            try:
+                reply = answer(store, target, bson_decode(body))
+                if reply is None:
+                    return
+            except (ValueError, KeyError, TypeError, struct.error, IndexError) as error:
+                print('%s %s: %s' % (method, target, error))
+                self.reply({'error': 1}, '400 Bad Request')
+                continue
+            self.reply(reply)
+
+
+class UploadServer(socketserver.ThreadingMixIn, socketserver.TCPServer):
+    allow_reuse_address = True
+    daemon_threads = True
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--host', default='127.0.0.1')
+    parser.add_argument('--port', type=int, default=80)
+    parser.add_argument('--dir', default='uploads')
+    parser.add_argument('--drop', type=int, default=0, help='drop the connection on every Nth segment')
+    parser.add_argument('--push', type=float, default=0, help='push a cmd every N seconds on each WebSocket')
+    args = parser.parse_args()
+
+    server = UploadServer((args.host, args.port), UploadHandler)
+    server.store = UploadStore(args.dir, args.drop)
+    server.push = args.push
+    server.serve_forever()
+
+
+if __name__ == '__main__':
+    main()